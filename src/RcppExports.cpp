@@ -9,8 +9,8 @@
 using namespace Rcpp;
 
 // dada_uniques
-Rcpp::List dada_uniques(std::vector< std::string > seqs, std::vector<int> abundances, Rcpp::NumericMatrix err, Rcpp::NumericMatrix quals, Rcpp::NumericMatrix score, int gap, bool use_kmers, double kdist_cutoff, int band_size, double omegaA, int max_clust, double min_fold, int min_hamming, bool use_quals, bool final_consensus, bool vectorized_alignment, int homo_gap, bool multithread, bool verbose);
-RcppExport SEXP _dada2_dada_uniques(SEXP seqsSEXP, SEXP abundancesSEXP, SEXP errSEXP, SEXP qualsSEXP, SEXP scoreSEXP, SEXP gapSEXP, SEXP use_kmersSEXP, SEXP kdist_cutoffSEXP, SEXP band_sizeSEXP, SEXP omegaASEXP, SEXP max_clustSEXP, SEXP min_foldSEXP, SEXP min_hammingSEXP, SEXP use_qualsSEXP, SEXP final_consensusSEXP, SEXP vectorized_alignmentSEXP, SEXP homo_gapSEXP, SEXP multithreadSEXP, SEXP verboseSEXP) {
+Rcpp::List dada_uniques(std::vector< std::string > seqs, std::vector<int> abundances, Rcpp::NumericMatrix err, Rcpp::NumericMatrix quals, Rcpp::NumericMatrix score, int gap, bool use_kmers, double kdist_cutoff, int band_size, double omegaA, int max_clust, double min_fold, int min_hamming, bool use_quals, bool final_consensus, bool vectorized_alignment, int homo_gap, bool multithread, bool verbose, Rcpp::IntegerVector initial_map, bool batch_bud);
+RcppExport SEXP _dada2_dada_uniques(SEXP seqsSEXP, SEXP abundancesSEXP, SEXP errSEXP, SEXP qualsSEXP, SEXP scoreSEXP, SEXP gapSEXP, SEXP use_kmersSEXP, SEXP kdist_cutoffSEXP, SEXP band_sizeSEXP, SEXP omegaASEXP, SEXP max_clustSEXP, SEXP min_foldSEXP, SEXP min_hammingSEXP, SEXP use_qualsSEXP, SEXP final_consensusSEXP, SEXP vectorized_alignmentSEXP, SEXP homo_gapSEXP, SEXP multithreadSEXP, SEXP verboseSEXP, SEXP initial_mapSEXP, SEXP batch_budSEXP) {
 BEGIN_RCPP
     Rcpp::RObject rcpp_result_gen;
     Rcpp::RNGScope rcpp_rngScope_gen;
@@ -33,10 +33,65 @@ BEGIN_RCPP
     Rcpp::traits::input_parameter< int >::type homo_gap(homo_gapSEXP);
     Rcpp::traits::input_parameter< bool >::type multithread(multithreadSEXP);
     Rcpp::traits::input_parameter< bool >::type verbose(verboseSEXP);
-    rcpp_result_gen = Rcpp::wrap(dada_uniques(seqs, abundances, err, quals, score, gap, use_kmers, kdist_cutoff, band_size, omegaA, max_clust, min_fold, min_hamming, use_quals, final_consensus, vectorized_alignment, homo_gap, multithread, verbose));
+    Rcpp::traits::input_parameter< Rcpp::IntegerVector >::type initial_map(initial_mapSEXP);
+    Rcpp::traits::input_parameter< bool >::type batch_bud(batch_budSEXP);
+    rcpp_result_gen = Rcpp::wrap(dada_uniques(seqs, abundances, err, quals, score, gap, use_kmers, kdist_cutoff, band_size, omegaA, max_clust, min_fold, min_hamming, use_quals, final_consensus, vectorized_alignment, homo_gap, multithread, verbose, initial_map, batch_bud));
     return rcpp_result_gen;
 END_RCPP
 }
+// dada_session
+SEXP dada_session(std::vector< std::string > seqs, std::vector<int> abundances, Rcpp::NumericMatrix quals, double cache_mb);
+RcppExport SEXP _dada2_dada_session(SEXP seqsSEXP, SEXP abundancesSEXP, SEXP qualsSEXP, SEXP cache_mbSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< std::vector< std::string > >::type seqs(seqsSEXP);
+    Rcpp::traits::input_parameter< std::vector<int> >::type abundances(abundancesSEXP);
+    Rcpp::traits::input_parameter< Rcpp::NumericMatrix >::type quals(qualsSEXP);
+    Rcpp::traits::input_parameter< double >::type cache_mb(cache_mbSEXP);
+    rcpp_result_gen = Rcpp::wrap(dada_session(seqs, abundances, quals, cache_mb));
+    return rcpp_result_gen;
+END_RCPP
+}
+// dada_session_run
+Rcpp::List dada_session_run(SEXP session, Rcpp::NumericMatrix err, Rcpp::NumericMatrix score, int gap, bool use_kmers, double kdist_cutoff, int band_size, double omegaA, int max_clust, double min_fold, int min_hamming, bool use_quals, bool final_consensus, bool vectorized_alignment, int homo_gap, bool multithread, bool verbose, Rcpp::IntegerVector initial_map, bool batch_bud);
+RcppExport SEXP _dada2_dada_session_run(SEXP sessionSEXP, SEXP errSEXP, SEXP scoreSEXP, SEXP gapSEXP, SEXP use_kmersSEXP, SEXP kdist_cutoffSEXP, SEXP band_sizeSEXP, SEXP omegaASEXP, SEXP max_clustSEXP, SEXP min_foldSEXP, SEXP min_hammingSEXP, SEXP use_qualsSEXP, SEXP final_consensusSEXP, SEXP vectorized_alignmentSEXP, SEXP homo_gapSEXP, SEXP multithreadSEXP, SEXP verboseSEXP, SEXP initial_mapSEXP, SEXP batch_budSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< SEXP >::type session(sessionSEXP);
+    Rcpp::traits::input_parameter< Rcpp::NumericMatrix >::type err(errSEXP);
+    Rcpp::traits::input_parameter< Rcpp::NumericMatrix >::type score(scoreSEXP);
+    Rcpp::traits::input_parameter< int >::type gap(gapSEXP);
+    Rcpp::traits::input_parameter< bool >::type use_kmers(use_kmersSEXP);
+    Rcpp::traits::input_parameter< double >::type kdist_cutoff(kdist_cutoffSEXP);
+    Rcpp::traits::input_parameter< int >::type band_size(band_sizeSEXP);
+    Rcpp::traits::input_parameter< double >::type omegaA(omegaASEXP);
+    Rcpp::traits::input_parameter< int >::type max_clust(max_clustSEXP);
+    Rcpp::traits::input_parameter< double >::type min_fold(min_foldSEXP);
+    Rcpp::traits::input_parameter< int >::type min_hamming(min_hammingSEXP);
+    Rcpp::traits::input_parameter< bool >::type use_quals(use_qualsSEXP);
+    Rcpp::traits::input_parameter< bool >::type final_consensus(final_consensusSEXP);
+    Rcpp::traits::input_parameter< bool >::type vectorized_alignment(vectorized_alignmentSEXP);
+    Rcpp::traits::input_parameter< int >::type homo_gap(homo_gapSEXP);
+    Rcpp::traits::input_parameter< bool >::type multithread(multithreadSEXP);
+    Rcpp::traits::input_parameter< bool >::type verbose(verboseSEXP);
+    Rcpp::traits::input_parameter< Rcpp::IntegerVector >::type initial_map(initial_mapSEXP);
+    Rcpp::traits::input_parameter< bool >::type batch_bud(batch_budSEXP);
+    rcpp_result_gen = Rcpp::wrap(dada_session_run(session, err, score, gap, use_kmers, kdist_cutoff, band_size, omegaA, max_clust, min_fold, min_hamming, use_quals, final_consensus, vectorized_alignment, homo_gap, multithread, verbose, initial_map, batch_bud));
+    return rcpp_result_gen;
+END_RCPP
+}
+// dada_session_free
+void dada_session_free(SEXP session);
+RcppExport SEXP _dada2_dada_session_free(SEXP sessionSEXP) {
+BEGIN_RCPP
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< SEXP >::type session(sessionSEXP);
+    dada_session_free(session);
+    return R_NilValue;
+END_RCPP
+}
 // C_is_bimera
 bool C_is_bimera(std::string sq, std::vector<std::string> pars, bool allow_one_off, int min_one_off_par_dist, int match, int mismatch, int gap_p, int max_shift);
 RcppExport SEXP _dada2_C_is_bimera(SEXP sqSEXP, SEXP parsSEXP, SEXP allow_one_offSEXP, SEXP min_one_off_par_distSEXP, SEXP matchSEXP, SEXP mismatchSEXP, SEXP gap_pSEXP, SEXP max_shiftSEXP) {
@@ -158,6 +213,18 @@ BEGIN_RCPP
     return rcpp_result_gen;
 END_RCPP
 }
+// C_ppois_upper
+Rcpp::NumericVector C_ppois_upper(std::vector<int> n, std::vector<double> E);
+RcppExport SEXP _dada2_C_ppois_upper(SEXP nSEXP, SEXP ESEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< std::vector<int> >::type n(nSEXP);
+    Rcpp::traits::input_parameter< std::vector<double> >::type E(ESEXP);
+    rcpp_result_gen = Rcpp::wrap(C_ppois_upper(n, E));
+    return rcpp_result_gen;
+END_RCPP
+}
 // C_matchRef
 Rcpp::IntegerVector C_matchRef(std::vector<std::string> seqs, std::string ref, unsigned int word_size, bool non_overlapping);
 RcppExport SEXP _dada2_C_matchRef(SEXP seqsSEXP, SEXP refSEXP, SEXP word_sizeSEXP, SEXP non_overlappingSEXP) {
@@ -184,8 +251,8 @@ BEGIN_RCPP
 END_RCPP
 }
 // C_nwvec
-Rcpp::CharacterVector C_nwvec(std::vector<std::string> s1, std::vector<std::string> s2, int16_t match, int16_t mismatch, int16_t gap_p, int band, bool endsfree);
-RcppExport SEXP _dada2_C_nwvec(SEXP s1SEXP, SEXP s2SEXP, SEXP matchSEXP, SEXP mismatchSEXP, SEXP gap_pSEXP, SEXP bandSEXP, SEXP endsfreeSEXP) {
+Rcpp::CharacterVector C_nwvec(std::vector<std::string> s1, std::vector<std::string> s2, int16_t match, int16_t mismatch, int16_t gap_p, int16_t homo_gap_p, int band, bool endsfree);
+RcppExport SEXP _dada2_C_nwvec(SEXP s1SEXP, SEXP s2SEXP, SEXP matchSEXP, SEXP mismatchSEXP, SEXP gap_pSEXP, SEXP homo_gap_pSEXP, SEXP bandSEXP, SEXP endsfreeSEXP) {
 BEGIN_RCPP
     Rcpp::RObject rcpp_result_gen;
     Rcpp::RNGScope rcpp_rngScope_gen;
@@ -194,9 +261,10 @@ BEGIN_RCPP
     Rcpp::traits::input_parameter< int16_t >::type match(matchSEXP);
     Rcpp::traits::input_parameter< int16_t >::type mismatch(mismatchSEXP);
     Rcpp::traits::input_parameter< int16_t >::type gap_p(gap_pSEXP);
+    Rcpp::traits::input_parameter< int16_t >::type homo_gap_p(homo_gap_pSEXP);
     Rcpp::traits::input_parameter< int >::type band(bandSEXP);
     Rcpp::traits::input_parameter< bool >::type endsfree(endsfreeSEXP);
-    rcpp_result_gen = Rcpp::wrap(C_nwvec(s1, s2, match, mismatch, gap_p, band, endsfree));
+    rcpp_result_gen = Rcpp::wrap(C_nwvec(s1, s2, match, mismatch, gap_p, homo_gap_p, band, endsfree));
     return rcpp_result_gen;
 END_RCPP
 }
@@ -250,7 +318,10 @@ RcppExport SEXP _dada2_RcppExport_registerCCallable() {
 }
 
 static const R_CallMethodDef CallEntries[] = {
-    {"_dada2_dada_uniques", (DL_FUNC) &_dada2_dada_uniques, 19},
+    {"_dada2_dada_uniques", (DL_FUNC) &_dada2_dada_uniques, 21},
+    {"_dada2_dada_session", (DL_FUNC) &_dada2_dada_session, 4},
+    {"_dada2_dada_session_run", (DL_FUNC) &_dada2_dada_session_run, 19},
+    {"_dada2_dada_session_free", (DL_FUNC) &_dada2_dada_session_free, 1},
     {"_dada2_C_is_bimera", (DL_FUNC) &_dada2_C_is_bimera, 8},
     {"_dada2_C_table_bimera2", (DL_FUNC) &_dada2_C_table_bimera2, 10},
     {"_dada2_C_nwalign", (DL_FUNC) &_dada2_C_nwalign, 8},
@@ -259,9 +330,10 @@ static const R_CallMethodDef CallEntries[] = {
     {"_dada2_C_isACGT", (DL_FUNC) &_dada2_C_isACGT, 1},
     {"_dada2_evaluate_kmers", (DL_FUNC) &_dada2_evaluate_kmers, 6},
     {"_dada2_C_subpos", (DL_FUNC) &_dada2_C_subpos, 2},
+    {"_dada2_C_ppois_upper", (DL_FUNC) &_dada2_C_ppois_upper, 2},
     {"_dada2_C_matchRef", (DL_FUNC) &_dada2_C_matchRef, 4},
     {"_dada2_C_matrixEE", (DL_FUNC) &_dada2_C_matrixEE, 1},
-    {"_dada2_C_nwvec", (DL_FUNC) &_dada2_C_nwvec, 7},
+    {"_dada2_C_nwvec", (DL_FUNC) &_dada2_C_nwvec, 8},
     {"_dada2_C_assign_taxonomy", (DL_FUNC) &_dada2_C_assign_taxonomy, 7},
     {"_dada2_C_assign_taxonomy2", (DL_FUNC) &_dada2_C_assign_taxonomy2, 7},
     {"_dada2_RcppExport_registerCCallable", (DL_FUNC) &_dada2_RcppExport_registerCCallable, 0},
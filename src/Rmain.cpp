@@ -1,14 +1,26 @@
 #include "dada.h"
 #include <Rcpp.h>
+#include <algorithm>
 
 using namespace Rcpp;
 //' @useDynLib dada2
 //' @importFrom Rcpp evalCpp
 
-B *run_dada(Raw **raws, int nraw, Rcpp::NumericMatrix errMat, int score[4][4], int gap_pen, int homo_gap_pen, bool use_kmers, double kdist_cutoff, int band_size, double omegaA, int max_clust, double min_fold, int min_hamming, bool use_quals, bool final_consensus, bool vectorized_alignment, bool multithread, bool verbose);
+B *run_dada(Raw **raws, int nraw, Rcpp::NumericMatrix errMat, int score[4][4], int gap_pen, int homo_gap_pen, bool use_kmers, double kdist_cutoff, int band_size, double omegaA, int max_clust, double min_fold, int min_hamming, bool use_quals, bool final_consensus, bool vectorized_alignment, bool multithread, bool verbose, AlignCache *cache, std::vector<unsigned int> &seeds, bool batch_bud);
+Session *session_new(std::vector< std::string > &seqs, std::vector<int> &abundances, Rcpp::NumericMatrix quals, size_t cache_bytes);
+void session_free(Session *session);
+Rcpp::List session_run(Session *session, Rcpp::NumericMatrix err, Rcpp::NumericMatrix score, int gap,
+                       bool use_kmers, double kdist_cutoff, int band_size, double omegaA, int max_clust,
+                       double min_fold, int min_hamming, bool use_quals, bool final_consensus,
+                       bool vectorized_alignment, int homo_gap, bool multithread, bool verbose,
+                       Rcpp::IntegerVector initial_map, bool batch_bud);
 
 //------------------------------------------------------------------
 // C interface to run DADA on the provided unique sequences/abundance pairs. 
+// If initial_map is non-empty, it is a partition of the uniques (eg. the map of a previous run)
+// whose centers seed the clustering, rather than budding every cluster from scratch.
+// If batch_bud, each round buds every significant raw independent of those before it (see
+// b_bud_batch), rather than only the most significant.
 // 
 // [[Rcpp::export]]
 Rcpp::List dada_uniques(std::vector< std::string > seqs, std::vector<int> abundances,
@@ -25,9 +37,65 @@ Rcpp::List dada_uniques(std::vector< std::string > seqs, std::vector<int> abunda
                         bool vectorized_alignment,
                         int homo_gap,
                         bool multithread,
-                        bool verbose) {
+                        bool verbose,
+                        Rcpp::IntegerVector initial_map, bool batch_bud) {
+  Session *session = session_new(seqs, abundances, quals, 0);
+  Rcpp::List rval = session_run(session, err, score, gap, use_kmers, kdist_cutoff, band_size, omegaA, max_clust, min_fold, min_hamming, use_quals, final_consensus, vectorized_alignment, homo_gap, multithread, verbose, initial_map, batch_bud);
+  session_free(session);
+  return rval;
+}
+
+//------------------------------------------------------------------
+// Makes a session holding the raws of the provided unique sequences/abundance pairs, which
+// dada_session_run can be called on repeatedly, eg. over the selfConsist iterations of dada.
+// If cache_mb > 0, alignments are kept between runs, so later runs only recompute lambdas, until
+// the alignments and raws of all sessions keeping them hold cache_mb megabytes.
+// 
+// [[Rcpp::export]]
+SEXP dada_session(std::vector< std::string > seqs, std::vector<int> abundances,
+                  Rcpp::NumericMatrix quals, double cache_mb) {
+  if(!(cache_mb >= 0)) { Rcpp::stop("Invalid alignment cache size."); }
+  Rcpp::XPtr<Session, Rcpp::PreserveStorage, session_free> xp(session_new(seqs, abundances, quals, (size_t) (cache_mb * 1048576.0)), true);
+  return xp;
+}
 
-  unsigned int i, j, r, index, pos, nraw, maxlen, minlen;
+//------------------------------------------------------------------
+// C interface to run DADA on a session made by dada_session. Arguments and return as dada_uniques.
+// 
+// [[Rcpp::export]]
+Rcpp::List dada_session_run(SEXP session,
+                            Rcpp::NumericMatrix err,
+                            Rcpp::NumericMatrix score, int gap,
+                            bool use_kmers, double kdist_cutoff,
+                            int band_size,
+                            double omegaA, 
+                            int max_clust,
+                            double min_fold, int min_hamming,
+                            bool use_quals,
+                            bool final_consensus,
+                            bool vectorized_alignment,
+                            int homo_gap,
+                            bool multithread,
+                            bool verbose,
+                            Rcpp::IntegerVector initial_map, bool batch_bud) {
+  Rcpp::XPtr<Session, Rcpp::PreserveStorage, session_free> xp(session);
+  if(xp.get() == NULL) { Rcpp::stop("Invalid dada session."); }
+  return session_run(xp.get(), err, score, gap, use_kmers, kdist_cutoff, band_size, omegaA, max_clust, min_fold, min_hamming, use_quals, final_consensus, vectorized_alignment, homo_gap, multithread, verbose, initial_map, batch_bud);
+}
+
+//------------------------------------------------------------------
+// Frees the raws and alignments of a session made by dada_session now, rather than when
+// it is garbage collected. The session can't be run afterwards.
+// 
+// [[Rcpp::export]]
+void dada_session_free(SEXP session) {
+  Rcpp::XPtr<Session, Rcpp::PreserveStorage, session_free> xp(session);
+  xp.release();
+}
+
+// The constructor for the Session object. Validates the input and constructs the raws.
+Session *session_new(std::vector< std::string > &seqs, std::vector<int> &abundances, Rcpp::NumericMatrix quals, size_t cache_bytes) {
+  unsigned int index, pos, nraw, maxlen, minlen;
   
   /********** INPUT VALIDATION *********/
   // Check lengths of seqs and abundances vectors
@@ -55,20 +123,6 @@ Rcpp::List dada_uniques(std::vector< std::string > seqs, std::vector<int> abunda
       Rcpp::stop("Sequence must have associated qualities for each nucleotide position.");
     }
   }
-  // Copy score matrix into a C style array
-  if(score.nrow() != 4 || score.ncol() != 4) {
-    Rcpp::stop("Score matrix must be 4x4.");
-  }
-  int c_score[4][4];
-  for(i=0;i<4;i++) {
-    for(j=0;j<4;j++) {
-      c_score[i][j] = (int) score(i,j);
-    }
-  }
-  // Check error matrix
-  if(err.nrow() != 16) {
-    Rcpp::stop("Error matrix must have 16 rows.");
-  }
 
   /********** CONSTRUCT RAWS *********/
   char seq[SEQLEN];
@@ -90,41 +144,115 @@ Rcpp::List dada_uniques(std::vector< std::string > seqs, std::vector<int> abunda
     raws[index]->index = index;
   }
 
+  Session *session = new Session;
+  if (session == NULL)  Rcpp::stop("Memory allocation failed.");
+  session->raws = raws;
+  session->nraw = nraw;
+  session->maxlen = maxlen;
+  session->has_quals = has_quals;
+  session->quals = quals;
+  session->keep_alignments = cache_bytes > 0;
+  cache_init(&session->cache, raws, nraw, cache_bytes);
+  return session;
+}
+
+// The destructor for the Session object.
+void session_free(Session *session) {
+  for(unsigned int index=0;index<session->nraw;index++) {
+    raw_free(session->raws[index]);
+  }
+  free(session->raws);
+  cache_free(&session->cache);
+  delete session;
+}
+
+// Runs DADA on the raws of a session, and makes the output List.
+Rcpp::List session_run(Session *session, Rcpp::NumericMatrix err, Rcpp::NumericMatrix score, int gap,
+                       bool use_kmers, double kdist_cutoff, int band_size, double omegaA, int max_clust,
+                       double min_fold, int min_hamming, bool use_quals, bool final_consensus,
+                       bool vectorized_alignment, int homo_gap, bool multithread, bool verbose,
+                       Rcpp::IntegerVector initial_map, bool batch_bud) {
+  unsigned int i, j, r;
+  unsigned int nraw = session->nraw, maxlen = session->maxlen;
+  bool has_quals = session->has_quals;
+  Rcpp::NumericMatrix quals = session->quals;
+  Raw **raws = session->raws;
+  
+  // Copy score matrix into a C style array
+  if(score.nrow() != 4 || score.ncol() != 4) {
+    Rcpp::stop("Score matrix must be 4x4.");
+  }
+  int c_score[4][4];
+  for(i=0;i<4;i++) {
+    for(j=0;j<4;j++) {
+      c_score[i][j] = (int) score(i,j);
+    }
+  }
+  // Check error matrix
+  if(err.nrow() != 16) {
+    Rcpp::stop("Error matrix must have 16 rows.");
+  }
+  
+  // Find the centers of the initial partition, ie. the most abundant raw of each cluster, in cluster order
+  std::vector<unsigned int> seeds;
+  if(initial_map.size() > 0) {
+    if(initial_map.size() != nraw) {
+      Rcpp::stop("Initial map must have an entry for each input sequence.");
+    }
+    std::vector<int> center(nraw, -1);
+    for(r=0;r<nraw;r++) {
+      i = initial_map[r];
+      if(initial_map[r] < 1 || i > nraw) { Rcpp::stop("Initial map entries must be cluster numbers from 1 to the number of sequences."); }
+      if(center[i-1] < 0 || raws[r]->reads > raws[center[i-1]]->reads) { center[i-1] = r; }
+    }
+    for(i=0;i<nraw;i++) {
+      if(center[i] >= 0) { seeds.push_back(center[i]); }
+    }
+  }
+
   /********** RUN DADA *********/
-  B *bb = run_dada(raws, nraw, err, c_score, gap, homo_gap, use_kmers, kdist_cutoff, band_size, omegaA, max_clust, min_fold, min_hamming, use_quals, final_consensus, vectorized_alignment, multithread, verbose);
+  B *bb = run_dada(raws, nraw, err, c_score, gap, homo_gap, use_kmers, kdist_cutoff, band_size, omegaA, max_clust, min_fold, min_hamming, use_quals, final_consensus, vectorized_alignment, multithread, verbose, session->keep_alignments ? &session->cache : NULL, seeds, batch_bud);
 
   /********** MAKE OUTPUT *********/
   Raw *raw;
+  AlignContext ctx;
+  actx_init(&ctx);
   
-  // Create subs for all the relevant alignments
+  // Create subs for all the relevant alignments, drawn from the pool of ctx
+  // Most are rebuilt from the alignments kept by b_compare, rather than aligned again
   Sub **subs = (Sub **) malloc(bb->nraw * sizeof(Sub *)); //E
   Sub **birth_subs = (Sub **) malloc(bb->nclust * sizeof(Sub *)); //E
   if(!subs || !birth_subs) Rcpp::stop("Memory allocation failed.");
+  // In parallel, the transition matrix is accumulated as the subs are made
+  Rcpp::IntegerMatrix mat_trans;
+  if(multithread) { mat_trans = b_make_subs_parallel(bb, subs, &ctx, has_quals, err.ncol()); }
   for(i=0;i<bb->nclust;i++) {
     // Make subs for members of that cluster
-    for(r=0;r<bb->bi[i]->nraw;r++) {
-      raw = bb->bi[i]->raw[r];
-      subs[raw->index] = sub_new(bb->bi[i]->center, raw, c_score, gap, homo_gap, false, 1.0, band_size, vectorized_alignment);
+    if(!multithread) {
+      for(r=0;r<bb->bi[i]->nraw;r++) {
+        raw = bb->bi[i]->raw[r];
+        subs[raw->index] = b_stored_sub(bb, i, raw, &ctx);
+      }
     }
     // Make birth sub for that cluster
     if(i==0) { birth_subs[i] = NULL; }
     else {
-      birth_subs[i] = sub_new(bb->bi[bb->bi[i]->birth_comp.i]->center, bb->bi[i]->center, c_score, gap, homo_gap, false, 1.0, band_size, vectorized_alignment);
+      birth_subs[i] = b_stored_sub(bb, bb->bi[i]->birth_comp.i, bb->bi[i]->center, &ctx);
+      if(has_quals) { sub_set_quals(birth_subs[i], bb->bi[bb->bi[i]->birth_comp.i]->center, bb->bi[i]->center, quals, &ctx); }
     }
   }
   Rcpp::DataFrame df_clustering = b_make_clustering_df(bb, subs, birth_subs, has_quals);
-  Rcpp::IntegerMatrix mat_trans = b_make_transition_by_quality_matrix(bb, subs, has_quals, err.ncol());
-  Rcpp::NumericMatrix mat_quals = b_make_cluster_quality_matrix(bb, subs, has_quals, maxlen);
+  if(!multithread) { mat_trans = b_make_transition_by_quality_matrix(bb, subs, has_quals, err.ncol()); }
+  Rcpp::NumericMatrix mat_quals;
+  if(multithread) { mat_quals = b_make_cluster_quality_matrix_parallel(bb, subs, quals, has_quals, maxlen); }
+  else { mat_quals = b_make_cluster_quality_matrix(bb, subs, quals, has_quals, maxlen); }
   //  Rcpp::DataFrame df_expected = b_make_positional_substitution_df(bb, subs, seqlen, err, use_quals);
   Rcpp::DataFrame df_birth_subs = b_make_birth_subs_df(bb, birth_subs, has_quals);
 
   // Free the created subs
-  for(index=0;index<bb->nraw;index++) {
-    sub_free(subs[index]);
-  }
-  for(i=0;i<bb->nclust;i++) {
-    sub_free(birth_subs[i]);
-  }
+  actx_free(&ctx);
+  free(subs);
+  free(birth_subs);
   
   // Make map from uniques to cluster
   Rcpp::IntegerVector Rmap(nraw);
@@ -136,45 +264,94 @@ Rcpp::List dada_uniques(std::vector< std::string > seqs, std::vector<int> abunda
 
   // Free memory
   b_free(bb);
-  for(index=0;index<nraw;index++) {
-    raw_free(raws[index]);
-  }
-  free(raws);
   
   // Organize return List  
   return Rcpp::List::create(_["clustering"] = df_clustering, _["birth_subs"] = df_birth_subs, _["subqual"] = mat_trans, _["clusterquals"] = mat_quals, _["map"] = Rmap);
 }
 
-B *run_dada(Raw **raws, int nraw, Rcpp::NumericMatrix errMat, int score[4][4], int gap_pen, int homo_gap_pen, bool use_kmers, double kdist_cutoff, int band_size, double omegaA, int max_clust, double min_fold, int min_hamming, bool use_quals, bool final_consensus, bool vectorized_alignment, bool multithread, bool verbose) {
-  int newi=0, nshuffle = 0;
+// Shuffles until no raw moves, or MAX_SHUFFLE times
+static void run_shuffles(B *bb, bool verbose) {
+  int nshuffle = 0;
   bool shuffled = false;
+  do {
+    shuffled = b_shuffle2(bb);
+    if(verbose) { Rprintf("S"); }
+  } while(shuffled && ++nshuffle < MAX_SHUFFLE);
+  if(verbose && nshuffle >= MAX_SHUFFLE) { Rprintf("Warning: Reached maximum (%i) shuffles.\n", MAX_SHUFFLE); }
+}
+
+B *run_dada(Raw **raws, int nraw, Rcpp::NumericMatrix errMat, int score[4][4], int gap_pen, int homo_gap_pen, bool use_kmers, double kdist_cutoff, int band_size, double omegaA, int max_clust, double min_fold, int min_hamming, bool use_quals, bool final_consensus, bool vectorized_alignment, bool multithread, bool verbose, AlignCache *cache, std::vector<unsigned int> &seeds, bool batch_bud) {
+  int newi=0;
+  unsigned int first, index, s;
+  std::vector<unsigned int> origin; // the Bi of each raw before the shuffle after b_bud_batch
 
   B *bb;
-  bb = b_new(raws, nraw, score, gap_pen, homo_gap_pen, omegaA, band_size, vectorized_alignment, use_quals); // New cluster with all sequences in 1 bi
+  // Cache the lambda of each raw with no subs, and its per-sub bounds, under this error model
+  raws_set_log_lambda(raws, nraw, errMat, use_quals);
+  bb = b_new(raws, nraw, score, gap_pen, homo_gap_pen, omegaA, min_fold, min_hamming, band_size, vectorized_alignment, use_quals); // New cluster with all sequences in 1 bi
+  if(cache) { b_cache_attach(bb, cache); } // Reuse the alignments of previous runs
   // Everyone gets aligned within the initial cluster, no KMER screen
   if(multithread) { b_compare_parallel(bb, 0, FALSE, 1.0, errMat, verbose); }
   else { b_compare(bb, 0, FALSE, 1.0, errMat, verbose); }
-  b_p_update(bb);       // Calculates abundance p-value for each raw in its cluster (consensuses)
+  // Calculates abundance p-value for each raw in its cluster (consensuses)
+  if(multithread) { b_p_update_parallel(bb); }
+  else { b_p_update(bb); }
   
   if(max_clust < 1) { max_clust = bb->nraw; }
   
-  while( (bb->nclust < max_clust) && (newi = b_bud(bb, min_fold, min_hamming, verbose)) ) {
-    if(verbose) Rprintf("----------- New Cluster C%i -----------\n", newi);
-    if(multithread) { b_compare_parallel(bb, newi, use_kmers, kdist_cutoff, errMat, verbose); }
-    else { b_compare(bb, newi, use_kmers, kdist_cutoff, errMat, verbose); }
+  // Warm start from the seeds, in rounds of at most BUD_BATCH_MAX as by b_bud_batch,
+  // then dissolve those no longer significant until all that remain are
+  seeds.erase(std::remove(seeds.begin(), seeds.end(), bb->bi[0]->center->index), seeds.end());
+  if(bb->nclust + seeds.size() > (unsigned int) max_clust) {
+    if(verbose) Rprintf("Seeding only the first %i of %i clusters (MAX_CLUST).\n", max_clust - (int) bb->nclust, (int) seeds.size());
+    seeds.resize(max_clust - bb->nclust);
+  }
+  if(!seeds.empty()) {
+    if(verbose) Rprintf("----------- Seeded %i Clusters -----------\n", (int) seeds.size());
+    for(s=0;s<seeds.size();s+=BUD_BATCH_MAX) {
+      first = b_seed(bb, seeds, s, (s+BUD_BATCH_MAX < seeds.size()) ? s+BUD_BATCH_MAX : seeds.size());
+      if(multithread) { b_compare_batch_parallel(bb, first, bb->nclust, use_kmers, kdist_cutoff, errMat, verbose); }
+      else {
+        for(newi=first;newi<(int) bb->nclust;newi++) { b_compare(bb, newi, use_kmers, kdist_cutoff, errMat, verbose); }
+      }
+      run_shuffles(bb, verbose);
+      Rcpp::checkUserInterrupt();
+    }
+    if(multithread) { b_p_update_parallel(bb); }
+    else { b_p_update(bb); }
+    while(b_dissolve(bb, 1)) {
+      if(verbose) Rprintf("\n----------- Dissolved Seeds, %i Remain -----------\n", (int) bb->nclust-1);
+      run_shuffles(bb, verbose);
+      if(multithread) { b_p_update_parallel(bb); }
+      else { b_p_update(bb); }
+      Rcpp::checkUserInterrupt();
+    }
+  }
+  
+  while( (bb->nclust < max_clust) && (newi = (batch_bud ? b_bud_batch(bb, max_clust - bb->nclust, kdist_cutoff, verbose) : b_bud(bb, verbose))) ) {
+    if(verbose) {
+      if(newi+1 < (int) bb->nclust) { Rprintf("----------- New Clusters C%i-C%i -----------\n", newi, bb->nclust-1); }
+      else { Rprintf("----------- New Cluster C%i -----------\n", newi); }
+    }
+    if(newi+1 < (int) bb->nclust) {
+      origin.resize(bb->nraw);
+      for(index=0;index<bb->nraw;index++) { origin[index] = bb->raw[index]->i; }
+    }
+    if(multithread) { b_compare_batch_parallel(bb, newi, bb->nclust, use_kmers, kdist_cutoff, errMat, verbose); }
+    else {
+      for(first=newi;first<bb->nclust;first++) { b_compare(bb, first, use_kmers, kdist_cutoff, errMat, verbose); }
+    }
     // Keep shuffling and updating until no more shuffles
-    nshuffle = 0;
-    do {
-      shuffled = b_shuffle2(bb);
-      if(verbose) { Rprintf("S"); }
-    } while(shuffled && ++nshuffle < MAX_SHUFFLE);
-    if(verbose && nshuffle >= MAX_SHUFFLE) { Rprintf("Warning: Reached maximum (%i) shuffles.\n", MAX_SHUFFLE); }
-
-    b_p_update(bb);
+    run_shuffles(bb, verbose);
+    if(newi+1 < (int) bb->nclust) { b_birth_batch(bb, newi, origin); }
+
+    if(multithread) { b_p_update_parallel(bb); }
+    else { b_p_update(bb); }
     Rcpp::checkUserInterrupt();
-  } // while( (bb->nclust < max_clust) && (newi = b_bud(bb, min_fold, min_hamming, verbose)) )
+  } // while( (bb->nclust < max_clust) && (newi = b_bud(bb, verbose)) )
   
-  if(verbose) Rprintf("\nALIGN: %i aligns, %i shrouded (%i raw).\n", bb->nalign, bb->nshroud, bb->nraw);
+  if(verbose) Rprintf("\nALIGN: %i aligns, %i shrouded, %i skipped (%i raw).\n", bb->nalign, bb->nshroud, bb->nskip, bb->nraw);
+  if(verbose && bb->nnarrow) Rprintf("ALIGN: %i aligned in 8 bits, %i of them redone in 16 bits.\n", bb->nnarrow, bb->nwiden);
   
   return bb;
 }
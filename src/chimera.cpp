@@ -21,9 +21,11 @@ bool C_is_bimera(std::string sq, std::vector<std::string> pars, bool allow_one_o
   int max_left=0, max_right=0;
   int oo_max_left=0, oo_max_right=0, oo_max_left_oo=0, oo_max_right_oo=0;
   bool rval = false;
+  AlignContext ctx;
+  actx_init(&ctx);
   
   for(i=0;i<pars.size() && rval==false;i++) {
-    al = nwalign_vectorized2(sq.c_str(), pars[i].c_str(), (int16_t) match, (int16_t) mismatch, (int16_t) gap_p, 0, max_shift);  // Remember, alignments must be freed!
+    al = nwalign_vectorized2(sq.c_str(), pars[i].c_str(), (int16_t) match, (int16_t) mismatch, (int16_t) gap_p, 0, max_shift, &ctx);
     get_lr(al, left, right, left_oo, right_oo, allow_one_off, max_shift);
     
     if((left+right) >= sq.size()) { // Toss id/pure-shift/internal-indel "parents"
@@ -49,10 +51,8 @@ bool C_is_bimera(std::string sq, std::vector<std::string> pars, bool allow_one_o
         rval=true;
       }
     }
-    free(al[0]);
-    free(al[1]);
-    free(al);
   }
+  actx_free(&ctx);
   
   return(rval);
 }
@@ -99,6 +99,7 @@ struct BimeraTableParallel : public RcppParallel::Worker
     std::vector<int> lefts_oo(ncol);
     std::vector<int> rights_oo(ncol);
     std::vector<bool> allowed(ncol);
+    AlignContext *ctx = actx_thread();
     
     for(std::size_t j=begin;j<end;j++) {
 //  for(j=0;j<ncol;j++) { // Evaluate each sequence
@@ -119,7 +120,7 @@ struct BimeraTableParallel : public RcppParallel::Worker
         for(k=0;k<ncol;k++) { // Compare with all possible parents
           if(vals[i+k*nrow]>(min_fold*vals[i+j*nrow]) && vals[i+k*nrow]>=min_abund) {
             if(lefts[k]<0) { // Comparison not yet done to this potential parent
-              al = nwalign_vectorized2(seqs[j].c_str(), seqs[k].c_str(), (int16_t) match, (int16_t) mismatch, (int16_t) gap_p, 0, max_shift);  // Remember, alignments must be freed!
+              al = nwalign_vectorized2(seqs[j].c_str(), seqs[k].c_str(), (int16_t) match, (int16_t) mismatch, (int16_t) gap_p, 0, max_shift, ctx);
               get_lr(al, left, right, left_oo, right_oo, allow_one_off, max_shift);
               if(allow_one_off && get_ham_endsfree(al[0], al[1]) >= min_one_off_par_dist) {
                 allowed[k]=true;
@@ -140,9 +141,6 @@ struct BimeraTableParallel : public RcppParallel::Worker
                   rights_oo[k] = 0;
                 }
               }
-              free(al[0]);
-              free(al[1]);
-              free(al);
             }
             // Now compare to best parents yet found
             if(lefts[k] > max_left) { max_left=lefts[k]; }
@@ -10,8 +10,8 @@
  inner two loops.
  */
 
-#define RAWBUF 50
-#define CLUSTBUF 50
+#define RAWBUF 50 // initial capacity of each Bi's raw list, doubled when full
+#define CLUSTBUF 50 // initial capacity of b->bi, doubled when full
 
 /* private function declarations */
 Bi *bi_new(unsigned int totraw);
@@ -20,11 +20,19 @@ void bi_free(Bi *bi);
 unsigned int b_add_bi(B *b, Bi *bi);
 Raw *bi_pop_raw(Bi *bi, unsigned int r);
 unsigned int bi_add_raw(Bi *bi, Raw *raw);
+void b_move_raw(B *b, Raw *raw, unsigned int i);
 
 void bi_census(Bi *bi);
 void bi_assign_center(Bi *bi);
 void bi_make_consensus(Bi *bi, bool use_quals);
 
+bool bud_less(const Bud &a, const Bud &b);
+void b_heap_sift(B *b, unsigned int h);
+void b_heap_set(B *b, const Bud &bud);
+void b_heap_remove(B *b, unsigned int index);
+void b_heap_update(B *b, unsigned int i, unsigned int r, bool budable);
+bool bi_p_update_raw(B *b, unsigned int i, Raw *raw, PvalMemo *memo);
+
 
 /********* CONSTRUCTORS AND DESTRUCTORS *********/
 
@@ -38,25 +46,37 @@ Raw *raw_new(char *seq, double *qual, unsigned int reads) {
   // Assign sequence and associated properties
   strcpy(raw->seq, seq);
   raw->length = strlen(seq);
-  raw->kmer = get_kmer(seq, KMER_SIZE);
+  raw->kmer = get_kmer_pairs(seq, KMER_SIZE, &raw->nkmer);
+  raw->kmer_bits = get_kmer_bits(raw->kmer, raw->nkmer, &raw->nkmer_multi);
   raw->reads = reads;
-  // Allocate and copy quals (quals downgraded to floats here for memory savings)
+  raw->homo = (unsigned char *) malloc(raw->length); //E
+  if (raw->homo == NULL)  Rcpp::stop("Memory allocation failed.");
+  homo_mask(raw->seq, raw->length, raw->homo);
+  // Allocate and assign the rounded quals, which index the err lookup table
+  // Output that needs the unrounded quals reads them from the input matrix
   if(qual) { 
-    raw->qual = (float *) malloc(raw->length * sizeof(float)); //E
-    if (raw->qual == NULL)  Rcpp::stop("Memory allocation failed.");
-    for(size_t i=0;i<raw->length;i++) { raw->qual[i] = (float) qual[i]; }
+    raw->qind = (uint8_t *) malloc(raw->length); //E
+    if (raw->qind == NULL)  Rcpp::stop("Memory allocation failed.");
+    for(size_t i=0;i<raw->length;i++) {
+      float q = round((float) qual[i]);
+      if(!(q >= 0 && q <= UINT8_MAX)) { Rcpp::stop("Quality score out of range: %.2f.", qual[i]); }
+      raw->qind[i] = (uint8_t) q;
+    }
   } else {
-    raw->qual = NULL;
+    raw->qind = NULL;
   }
   raw->E_minmax = -999.0;
+  raw->log_self = NAN; // Not yet computed, see raws_set_log_lambda
   return raw;
 }
 
 // The destructor for the Raw object.
 void raw_free(Raw *raw) {
   free(raw->seq);
-  if(raw->qual) { free(raw->qual); }
+  if(raw->qind) { free(raw->qind); }
+  free(raw->homo);
   free(raw->kmer);
+  if(raw->kmer_bits) { free(raw->kmer_bits); }
   free(raw);  
 }
 
@@ -68,6 +88,7 @@ Bi *bi_new(unsigned int totraw) {
   if (bi->raw == NULL)  Rcpp::stop("Memory allocation failed.");
   bi->maxraw = RAWBUF;
   bi->totraw = totraw;
+  bi->i = 0;
   bi->center = NULL;
   strcpy(bi->seq, "");
   bi->update_lambda = true;
@@ -86,11 +107,11 @@ void bi_free(Bi *bi) {
 }
 
 // The constructor for the B object. Takes in array of Raws.
-B *b_new(Raw **raws, unsigned int nraw, int score[4][4], int gap_pen, int homo_gap_pen, double omegaA, int band_size, bool vectorized_alignment, bool use_quals) {
+B *b_new(Raw **raws, unsigned int nraw, int score[4][4], int gap_pen, int homo_gap_pen, double omegaA, double min_fold, int min_hamming, int band_size, bool vectorized_alignment, bool use_quals) {
   unsigned int i, j, index;
 
   // Allocate memory
-  B *b = (B *) malloc(sizeof(B)); //E
+  B *b = new B;
   if (b == NULL)  Rcpp::stop("Memory allocation failed.");
   b->bi = (Bi **) malloc(CLUSTBUF * sizeof(Bi *)); //E
   if (b->bi == NULL)  Rcpp::stop("Memory allocation failed.");
@@ -103,9 +124,13 @@ B *b_new(Raw **raws, unsigned int nraw, int score[4][4], int gap_pen, int homo_g
   b->gap_pen = gap_pen;
   b->homo_gap_pen = homo_gap_pen;
   b->omegaA = omegaA;
+  b->min_fold = min_fold;
+  b->min_hamming = min_hamming;
   b->band_size = band_size;
   b->vectorized_alignment = vectorized_alignment;
   b->use_quals = use_quals;
+  actx_init(&b->actx);
+  b->cache = NULL;
   
   // Copy the score matrix
   for(i=0;i<4;i++) {
@@ -146,9 +171,21 @@ void b_init(B *b) {
   b->bi[0]->birth_e = b->reads;
   b->nalign = 0;
   b->nshroud = 0;
+  b->nskip = 0;
+  b->nnarrow = 0;
+  b->nwiden = 0;
+  
+  // Reset the per-raw best E/i tracking used by b_shuffle2
+  b->emax.assign(b->nraw, -1.0);
+  b->imax.assign(b->nraw, 0);
+  b->raw_comp.assign(b->nraw, std::vector< std::pair<unsigned int, unsigned int> >());
+  b->bud_heap.clear();
+  b->bud_pos.assign(b->nraw, -1);
 
   // Add all raws to that cluster
+  // Their E_minmax may be left over from a previous clustering (see b_seed, Session)
   for (index=0; index<b->nraw; index++) {
+    b->raw[index]->E_minmax = -999.0;
     bi_add_raw(b->bi[0], b->raw[index]);
   }
 
@@ -160,23 +197,29 @@ void b_init(B *b) {
 void b_free(B *b) {
   for(int i=0;i<b->nclust;i++) { bi_free(b->bi[i]); }
   free(b->bi);
-  free(b);
+  actx_free(&b->actx);
+  delete b;
 }
 
 
 /********* CONTAINER OPERATIONS *********/
 
-// Add a Raw to a Bi object. Update reads/nraw. Return index to raw in bi.
+// Add a Raw to a Bi object. Update reads/nraw and the raw's position. Return index to raw in bi.
+// Sets update_e/shuffle flags.
 unsigned int bi_add_raw(Bi *bi, Raw *raw) {
   // Allocate more space if needed
   if(bi->nraw >= bi->maxraw) {    // Extend Raw* buffer
-    bi->raw = (Raw **) realloc(bi->raw, (bi->maxraw+RAWBUF) * sizeof(Raw *)); //E
+    bi->raw = (Raw **) realloc(bi->raw, 2 * bi->maxraw * sizeof(Raw *)); //E
     if (bi->raw == NULL)  Rcpp::stop("Memory allocation failed.");
-    bi->maxraw+=RAWBUF;
+    bi->maxraw *= 2;
   }
   // Add raw and update reads/nraw
   bi->raw[bi->nraw] = raw;
+  raw->i = bi->i;
+  raw->r = bi->nraw;
   bi->reads += raw->reads;
+  bi->update_e = true;
+  bi->shuffle = true;
   return(bi->nraw++);
 }
 
@@ -185,9 +228,9 @@ unsigned int bi_add_raw(Bi *bi, Raw *raw) {
 unsigned int b_add_bi(B *b, Bi *bi) {
   // Allocate more space if needed
   if(b->nclust >= b->maxclust) {    // Extend Bi* buffer
-    b->bi = (Bi **) realloc(b->bi, (b->maxclust+CLUSTBUF) * sizeof(Bi *)); //E
+    b->bi = (Bi **) realloc(b->bi, 2 * b->maxclust * sizeof(Bi *)); //E
     if (b->bi == NULL)  Rcpp::stop("Memory allocation failed.");
-    b->maxclust+=CLUSTBUF;
+    b->maxclust *= 2;
   }
   // Add bi and update nclust
   b->bi[b->nclust] = bi;
@@ -196,18 +239,20 @@ unsigned int b_add_bi(B *b, Bi *bi) {
 }
 
 // Removes a Raw from a Bi object. Updates reads/nraw. Returns pointer to that raw.
-// Sets update_e flag. Frees the bi/raw sub object.
-// THIS REORDERS THE BIs LIST OF RAWS. CAN BREAK INDICES.
-// This is called in b_shuffle
+// Sets update_e/shuffle flags.
+// The last raw of the Bi takes the place of the popped raw, and its position is updated,
+// so any raw can be popped from wherever it is by bi_pop_raw(bi, raw->r).
 Raw *bi_pop_raw(Bi *bi, unsigned int r) {
   Raw *pop;
   if(r<bi->nraw) {
     pop = bi->raw[r];
     bi->raw[r] = bi->raw[bi->nraw-1]; // POPPED RAW REPLACED BY LAST RAW
+    bi->raw[r]->r = r;
     bi->raw[bi->nraw-1] = NULL;
     bi->nraw--;
     bi->reads -= pop->reads;
     bi->update_e = true;
+    bi->shuffle = true;
   } else {
     Rcpp::stop("Container Error (Bi): Tried to pop out-of-range raw.");
     pop = NULL;
@@ -215,6 +260,112 @@ Raw *bi_pop_raw(Bi *bi, unsigned int r) {
   return pop;
 }
 
+// Moves a Raw from the Bi it is in to Bi i, and finds its comparison there if already stored.
+void b_move_raw(B *b, Raw *raw, unsigned int i) {
+  bi_pop_raw(b->bi[raw->i], raw->r);
+  bi_add_raw(b->bi[i], raw);
+  raw->ci = b_comp_find(b, i, raw);
+}
+
+// Adds a comparison to the store of a Bi. Returns its position there.
+unsigned int bi_comp_add(Bi *bi, const Comparison &comp) {
+  bi->comp_lambda.push_back(comp.lambda);
+  bi->comp_hamming.push_back(comp.hamming);
+  bi->comp_index.push_back(comp.index);
+  return(bi->comp_index.size()-1);
+}
+
+// The comparison at position ci of the store of a Bi.
+Comparison bi_comp(Bi *bi, unsigned int ci) {
+  Comparison comp;
+  comp.i = bi->i;
+  comp.index = bi->comp_index[ci];
+  comp.lambda = bi->comp_lambda[ci];
+  comp.hamming = bi->comp_hamming[ci];
+  return comp;
+}
+
+// The position of the comparison to raw in the store of the Bi it is in, or -1 if none was stored.
+// Safe to call from worker threads.
+int bi_comp_own(Bi *bi, Raw *raw) {
+  if(raw->ci < bi->comp_index.size() && bi->comp_index[raw->ci] == raw->index) { return raw->ci; }
+  return -1;
+}
+
+// The position of the comparison to raw in the store of Bi i, or -1 if none was stored.
+// Found directly for the Bi the raw is in, and otherwise from the raw's comparisons.
+int b_comp_find(B *b, unsigned int i, Raw *raw) {
+  unsigned int k;
+  if(raw->i == i && bi_comp_own(b->bi[i], raw) >= 0) { 
+    return raw->ci; 
+  }
+  for(k=0;k<b->raw_comp[raw->index].size();k++) {
+    if(b->raw_comp[raw->index][k].first == i) { return b->raw_comp[raw->index][k].second; }
+  }
+  return -1;
+}
+
+
+/********* BUD HEAP *********/
+
+// Orders budding candidates: smallest pval first, then most reads, then
+// the order in which b_bud used to scan the clustering (by i, then r).
+bool bud_less(const Bud &a, const Bud &b) {
+  if(a.p != b.p) { return a.p < b.p; }
+  if(a.reads != b.reads) { return a.reads > b.reads; }
+  if(a.i != b.i) { return a.i < b.i; }
+  return a.r < b.r;
+}
+
+// Restores the heap property around position h after its entry changed.
+void b_heap_sift(B *b, unsigned int h) {
+  std::vector<Bud> &heap = b->bud_heap;
+  Bud bud = heap[h];
+  unsigned int parent, child;
+  // Sift up
+  while(h > 0) {
+    parent = (h-1)/2;
+    if(!bud_less(bud, heap[parent])) { break; }
+    heap[h] = heap[parent];
+    b->bud_pos[heap[h].index] = h;
+    h = parent;
+  }
+  // Sift down
+  while((child = 2*h+1) < heap.size()) {
+    if(child+1 < heap.size() && bud_less(heap[child+1], heap[child])) { child++; }
+    if(!bud_less(heap[child], bud)) { break; }
+    heap[h] = heap[child];
+    b->bud_pos[heap[h].index] = h;
+    h = child;
+  }
+  heap[h] = bud;
+  b->bud_pos[bud.index] = h;
+}
+
+// Inserts the budding candidate, or updates its entry if already present.
+void b_heap_set(B *b, const Bud &bud) {
+  int h = b->bud_pos[bud.index];
+  if(h < 0) {
+    h = b->bud_heap.size();
+    b->bud_heap.push_back(bud);
+  } else {
+    b->bud_heap[h] = bud;
+  }
+  b_heap_sift(b, h);
+}
+
+// Removes the raw from the budding candidates, if present.
+void b_heap_remove(B *b, unsigned int index) {
+  int h = b->bud_pos[index];
+  if(h < 0) { return; }
+  b->bud_pos[index] = -1;
+  Bud last = b->bud_heap.back();
+  b->bud_heap.pop_back();
+  if(h < (int) b->bud_heap.size()) {
+    b->bud_heap[h] = last;
+    b_heap_sift(b, h);
+  }
+}
 
 /********* CONTAINER HOUSEKEEPING *********/
 
@@ -227,6 +378,7 @@ void bi_census(Bi *bi) {
   }
   if(reads != bi->reads) {
     bi->update_e = true;
+    bi->shuffle = true;
   }
   bi->reads = reads;
   bi->nraw = nraw;
@@ -254,6 +406,16 @@ void bi_assign_center(Bi *bi) {
 
 /********* ALGORITHM LOGIC *********/
 
+// True if the comparison of raw to center provably would not be stored by b_compare, ie. the
+// largest lambda allowed by the fewest substitutions in their alignment can't beat E_minmax.
+// dotsum is the number of kmers raw shares with center.
+static bool b_lambda_screen(B *b, Raw *center, uint32_t dotsum, Raw *raw) {
+  unsigned int nsubs;
+  if(raw == center || raw->E_minmax < 0) { return false; }
+  nsubs = min_nsubs(center, dotsum, raw, b->score, b->gap_pen, b->homo_gap_pen);
+  return lambda_bound(raw, nsubs) * b->reads <= raw->E_minmax;
+}
+
 /*
  compare:
 Performs alignments and computes lambda for all raws to the specified Bi
@@ -261,19 +423,51 @@ Stores only those that can possibly be recruited to this Bi
 */
 void b_compare(B *b, unsigned int i, bool use_kmers, double kdist_cutoff, Rcpp::NumericMatrix errMat, bool verbose) {
   unsigned int index, cind;
+  uint32_t dotsum = 0;
   double lambda;
+  bool skip;
   Raw *raw;
   Sub *sub;
   Comparison comp;
+  Raw *center = b->bi[i]->center;
+  std::vector<uint16_t> runs;
+  
+  // The kmers of center as a dense vector, for the kmer screen
+  std::vector<uint16_t> kv;
+  if(use_kmers) {
+    kv.resize(KMER_VLEN);
+    kmer_pairs_dense(center->kmer, center->nkmer, kv.data());
+  }
   
   // align all raws to this sequence and compute corresponding lambda
   if(verbose) { Rprintf("C%iLU:", i); }
   for(index=0, cind=0; index<b->nraw; index++) {
     raw = b->raw[index];
-    // get sub object
-    sub = sub_new(b->bi[i]->center, raw, b->score, b->gap_pen, b->homo_gap_pen, use_kmers, kdist_cutoff, b->band_size, b->vectorized_alignment);
+    if(use_kmers) { dotsum = kmer_shared(kv.data(), center, raw); }
+    // get sub object, NULL if outside the kmer screen or if it couldn't be stored anyway
+    skip = false;
+    if(use_kmers && kmer_dist_shared(dotsum, center->length, raw->length, KMER_SIZE) > kdist_cutoff) {
+      sub = NULL;
+    } else if(use_kmers && b_lambda_screen(b, center, dotsum, raw)) {
+      sub = NULL;
+      skip = true;
+    } else if(b->cache && cache_find(b->cache, center, raw, &b->actx)) {
+      sub = path2sub(center->seq, raw->seq, &b->actx);
+    } else {
+      sub = sub_new(center, raw, b->score, b->gap_pen, b->homo_gap_pen, false, kdist_cutoff, b->band_size, b->vectorized_alignment, &b->actx);
+      if(b->vectorized_alignment && b->actx.nw_narrow) {
+        b->nnarrow++;
+        if(b->actx.nw_narrow == 2) { b->nwiden++; }
+      }
+      if(b->cache) {
+        runs.clear();
+        path_pack(&b->actx, runs);
+        cache_add(b->cache, center, raw, runs);
+      }
+    }
     b->nalign++;
-    if(!sub) { b->nshroud++; }
+    if(skip) { b->nskip++; }
+    else if(!sub) { b->nshroud++; }
     
     // Calculate lambda for that sub
     lambda = compute_lambda(raw, sub, errMat, b->use_quals, errMat.ncol());
@@ -290,11 +484,17 @@ void b_compare(B *b, unsigned int i, bool use_kmers, double kdist_cutoff, Rcpp::
       comp.index = index;
       comp.lambda = lambda;
       comp.hamming = sub->nsubs;
-      b->bi[i]->comp.push_back(comp);
-      b->bi[i]->comp_index.insert(std::make_pair(index, cind++));
+      bi_comp_add(b->bi[i], comp);
+      if(raw->i == i) { raw->ci = cind; }
+      b->raw_comp[index].push_back(std::make_pair(i, cind++));
+      // Keep the alignment, so the output doesn't need to redo it
+      b->bi[i]->path_start.push_back(b->bi[i]->path.size());
+      path_pack(&b->actx, b->bi[i]->path);
     }
-    sub_free(sub);
+    actx_release_subs(&b->actx);
   }
+  b->bi[i]->update_lambda = false;
+  b->bi[i]->update_e = true;
 }
 
 /***********************************************
@@ -419,52 +619,141 @@ void b_compare_threaded(B *b, unsigned int i, bool use_kmers, double kdist_cutof
  
 struct CompareParallel : public RcppParallel::Worker
 {
-  // source data
+  // source data: the Bi and raw index of each comparison, and the dense kmer vectors of the
+  // centers of the Bis compared (KMER_VLEN apart, from Bi first on)
   B *b;
-  unsigned int i;
+  unsigned int *ii;
+  unsigned int *cand;
+  uint16_t *kvs;
+  unsigned int first;
   
-  // destination comparison array
+  // destination comparison array, whether each was skipped by the lambda screen, and its ctx->nw_narrow
   Comparison *output;
+  bool *skip;
+  unsigned char *narrow;
   
   // parameters
   bool use_kmers;
   double kdist_cutoff;
   unsigned int ncol;
   double *err_mat;
+  bool batch; // align with align_center_batch, which takes only match/mismatch scores and no homopolymer gaps
   
   // initialize with source and destination
-  CompareParallel(B *b, unsigned int i, Comparison *output, bool use_kmers, double kdist_cutoff, 
+  CompareParallel(B *b, unsigned int *ii, unsigned int *cand, uint16_t *kvs, unsigned int first, Comparison *output, bool *skip, unsigned char *narrow, bool use_kmers, double kdist_cutoff, 
                   unsigned int ncol, double *err_mat) 
-    : b(b), i(i), output(output), use_kmers(use_kmers), kdist_cutoff(kdist_cutoff), ncol(ncol), err_mat(err_mat) {}
+    : b(b), ii(ii), cand(cand), kvs(kvs), first(first), output(output), skip(skip), narrow(narrow), use_kmers(use_kmers), kdist_cutoff(kdist_cutoff), ncol(ncol), err_mat(err_mat),
+      batch(b->vectorized_alignment && b->homo_gap_pen == b->gap_pen && score_match_mismatch(b->score)) {}
+  
+  // Comparisons waiting to be aligned together by align_center_batch: same Bi, raws of the same length
+  typedef struct {
+    unsigned int i;
+    unsigned int length;
+    unsigned int n;
+    std::size_t c[ALIGN_LANES];
+  } Pending;
   
   // Perform sequence comparison
   void operator()(std::size_t begin, std::size_t end) {
     Raw *raw;
     Sub *sub;
+    Raw *center;
+    uint32_t dotsum = 0;
+    unsigned int g;
+    std::vector<Pending> pending;
+    AlignContext *ctx = actx_thread();
     
-    for(std::size_t index=begin;index<end;index++) {
+    for(std::size_t c=begin;c<end;c++) {
+      unsigned int index = cand[c];
       raw = b->raw[index];
-      sub = sub_new(b->bi[i]->center, raw, b->score, b->gap_pen, b->homo_gap_pen, use_kmers, kdist_cutoff, b->band_size, b->vectorized_alignment);
-      
-      // Make comparison object
-      output[index].i = i;
-      output[index].index = index;
-      output[index].lambda = compute_lambda_ts(raw, sub, ncol, err_mat, b->use_quals);
-      if(sub) {
-        output[index].hamming = sub->nsubs;
+      center = b->bi[ii[c]]->center;
+      if(use_kmers) { dotsum = kmer_shared(&kvs[(ii[c]-first)*KMER_VLEN], center, raw); }
+      // get sub object, NULL if outside the kmer screen or if it couldn't be stored anyway
+      // E_minmax is only changed after all the comparisons are made
+      skip[c] = false;
+      narrow[c] = 0;
+      if(use_kmers && kmer_dist_shared(dotsum, center->length, raw->length, KMER_SIZE) > kdist_cutoff) {
+        sub = NULL;
+      } else if(use_kmers && b_lambda_screen(b, center, dotsum, raw)) {
+        sub = NULL;
+        skip[c] = true;
+      } else if(b->cache && cache_find(b->cache, center, raw, ctx)) { // the cache is only read here
+        sub = path2sub(center->seq, raw->seq, ctx);
+      } else if(batch) { // aligned later with others of its length
+        for(g=0;g<pending.size();g++) {
+          if(pending[g].i == ii[c] && pending[g].length == raw->length) { break; }
+        }
+        if(g == pending.size()) {
+          pending.push_back(Pending());
+          pending[g].i = ii[c];
+          pending[g].length = raw->length;
+          pending[g].n = 0;
+        }
+        pending[g].c[pending[g].n++] = c;
+        if(pending[g].n == ALIGN_LANES) { flush(pending[g], ctx); }
+        continue;
       } else {
-        output[index].hamming = -1;
+        sub = sub_new(center, raw, b->score, b->gap_pen, b->homo_gap_pen, false, kdist_cutoff, b->band_size, b->vectorized_alignment, ctx);
       }
-
-      // Free sub
-      sub_free(sub);
+      store(c, sub, ctx);
     }
+    for(g=0;g<pending.size();g++) { flush(pending[g], ctx); }
+  }
+  
+  // Aligns the pending comparisons of a group together, and stores them
+  void flush(Pending &pend, AlignContext *ctx) {
+    unsigned int k;
+    Sub *sub;
+    Raw *raws[ALIGN_LANES];
+    Raw *center = b->bi[pend.i]->center;
+    
+    for(k=0;k<pend.n;k++) { raws[k] = b->raw[cand[pend.c[k]]]; }
+    if(pend.n == 1) {
+      sub = sub_new(center, raws[0], b->score, b->gap_pen, b->homo_gap_pen, false, kdist_cutoff, b->band_size, true, ctx);
+      narrow[pend.c[0]] = ctx->nw_narrow;
+      store(pend.c[0], sub, ctx);
+    } else if(pend.n > 1) {
+      align_center_batch(center, raws, pend.n, b->score, b->gap_pen, b->band_size, ctx);
+      for(k=0;k<pend.n;k++) {
+        actx_lane_path(ctx, k);
+        store(pend.c[k], path2sub(center->seq, raws[k]->seq, ctx), ctx);
+      }
+    }
+    pend.n = 0;
+  }
+  
+  // Makes the comparison object of comparison c from its sub, and keeps its alignment path
+  void store(std::size_t c, Sub *sub, AlignContext *ctx) {
+    output[c].i = ii[c];
+    output[c].index = cand[c];
+    output[c].lambda = compute_lambda_ts(b->raw[cand[c]], sub, ncol, err_mat, b->use_quals);
+    if(sub) {
+      output[c].hamming = sub->nsubs;
+    } else {
+      output[c].hamming = -1;
+    }
+    b->cand_path[c].clear();
+    if(sub) { path_pack(ctx, b->cand_path[c]); }
+    
+    // Return sub to the pool
+    actx_release_subs(ctx);
   }
 };
 
 
 void b_compare_parallel(B *b, unsigned int i, bool use_kmers, double kdist_cutoff, Rcpp::NumericMatrix errMat, bool verbose) {
-  unsigned int index, cind, row, col, ncol;
+  b_compare_batch_parallel(b, i, i+1, use_kmers, kdist_cutoff, errMat, verbose);
+}
+
+/* b_compare_batch_parallel:
+ Compares the Bis first to last-1 to all raws, eg. after b_bud_batch, in parallel passes over
+ as many Bis as fit in COMPARE_BATCH_MAX comparisons (at least one), reusing the buffers of a pass.
+ The comparisons are then stored in Bi order, exactly as by b_compare_parallel on each Bi in turn
+ (the lambda screen only depends on E_minmax from before the pass, which can only be smaller).
+*/
+void b_compare_batch_parallel(B *b, unsigned int first, unsigned int last, bool use_kmers, double kdist_cutoff, Rcpp::NumericMatrix errMat, bool verbose) {
+  unsigned int i, c, index, cind, row, col, ncol, start, stop, per_pass;
+  size_t ncomp;
   double lambda;
   Raw *raw;
   Comparison comp;
@@ -480,39 +769,177 @@ void b_compare_parallel(B *b, unsigned int i, bool use_kmers, double kdist_cutof
     }
   }
   
-  // Parallelize for loop to perform all comparisons
-  Comparison *comps = (Comparison *) malloc(sizeof(Comparison) * b->nraw);
-  if(comps==NULL) Rcpp::stop("Memory allocation failed.");
-  CompareParallel compareParallel(b, i, comps, use_kmers, kdist_cutoff, ncol, err_mat);
-  RcppParallel::parallelFor(0, b->nraw, compareParallel, GRAIN_SIZE);
+  // Buffers for one pass, every raw is compared to each center and the workers do the kmer screen
+  per_pass = (b->nraw > 0 && COMPARE_BATCH_MAX / b->nraw > 0) ? COMPARE_BATCH_MAX / b->nraw : 1;
+  if(per_pass > last-first) { per_pass = last-first; }
+  ncomp = (size_t) per_pass * b->nraw;
+  std::vector<unsigned int> ii(ncomp), cc(ncomp);
+  std::vector<uint16_t> kvs;
+  if(use_kmers) { kvs.resize(per_pass*KMER_VLEN); }
+  Comparison *comps = (Comparison *) malloc(sizeof(Comparison) * ncomp);
+  bool *skip = (bool *) malloc(sizeof(bool) * ncomp);
+  unsigned char *narrow = (unsigned char *) malloc(ncomp);
+  if((comps==NULL || skip==NULL || narrow==NULL) && ncomp > 0) Rcpp::stop("Memory allocation failed.");
+  b->cand_path.resize(ncomp);
   
-  // Selectively store
-  for(index=0, cind=0; index<b->nraw; index++) {
-    b->nalign++; ///t
-    raw = b->raw[index];
-    comp = comps[index];
-    lambda = comp.lambda;
-    if(lambda<0 || lambda>1) Rcpp::stop("Lambda out-of-range error.");
-
-    // Store self-lambda
-    if(index == b->bi[i]->center->index) { 
-      b->bi[i]->self = lambda; 
+  for(start=first;start<last;start=stop) {
+    stop = (last-start > per_pass) ? start+per_pass : last;
+    ncomp = (size_t) (stop-start) * b->nraw;
+    for(i=start, c=0;i<stop;i++) {
+      for(index=0;index<b->nraw;index++, c++) {
+        ii[c] = i;
+        cc[c] = index;
+      }
+      if(use_kmers) { kmer_pairs_dense(b->bi[i]->center->kmer, b->bi[i]->center->nkmer, &kvs[(i-start)*KMER_VLEN]); }
     }
     
-    // Store comparison if potentially useful
-    if(lambda * b->reads > raw->E_minmax) { // This cluster could attract this raw
-      if(lambda * b->bi[i]->center->reads > raw->E_minmax) { // Better E_minmax, set
-        raw->E_minmax = lambda * b->bi[i]->center->reads;
+    // Parallelize for loop to perform the comparisons of this pass
+    CompareParallel compareParallel(b, ii.data(), cc.data(), kvs.data(), start, comps, skip, narrow, use_kmers, kdist_cutoff, ncol, err_mat);
+    RcppParallel::parallelFor(0, ncomp, compareParallel, COMPARE_GRAIN);
+    
+    // Selectively store
+    for(c=0, cind=0; c<ncomp; c++) {
+      i = ii[c];
+      if(c>0 && i != ii[c-1]) { cind = 0; }
+      index = cc[c];
+      b->nalign++; ///t
+      if(skip[c]) { b->nskip++; }
+      else if(comps[c].hamming == (unsigned int) -1) { b->nshroud++; }
+      if(narrow[c]) { b->nnarrow++; }
+      if(narrow[c] == 2) { b->nwiden++; }
+      raw = b->raw[index];
+      if(b->cache && !b->cand_path[c].empty()) { cache_add(b->cache, b->bi[i]->center, raw, b->cand_path[c]); }
+      comp = comps[c];
+      lambda = comp.lambda;
+      if(lambda<0 || lambda>1) Rcpp::stop("Lambda out-of-range error.");
+  
+      // Store self-lambda
+      if(index == b->bi[i]->center->index) { 
+        b->bi[i]->self = lambda; 
+      }
+      
+      // Store comparison if potentially useful
+      if(lambda * b->reads > raw->E_minmax) { // This cluster could attract this raw
+        if(lambda * b->bi[i]->center->reads > raw->E_minmax) { // Better E_minmax, set
+          raw->E_minmax = lambda * b->bi[i]->center->reads;
+        }
+        bi_comp_add(b->bi[i], comp);
+        if(raw->i == i) { raw->ci = cind; }
+        b->raw_comp[index].push_back(std::make_pair(i, cind++));
+        b->bi[i]->path_start.push_back(b->bi[i]->path.size());
+        b->bi[i]->path.insert(b->bi[i]->path.end(), b->cand_path[c].begin(), b->cand_path[c].end());
       }
-      b->bi[i]->comp.push_back(comp);
-      b->bi[i]->comp_index.insert(std::make_pair(index, cind++));
     }
   }
+  for(i=first;i<last;i++) {
+    b->bi[i]->update_lambda = false;
+    b->bi[i]->update_e = true;
+  }
+  std::vector< std::vector<uint16_t> >().swap(b->cand_path); // clear() would keep the capacity of each path
   free(err_mat);
   free(comps);
+  free(skip);
+  free(narrow);
 }
 
 
+/* b_stored_sub:
+ The Sub of raw against the center of Bi i, rebuilt from the alignment kept by b_compare
+ if the comparison was stored, and otherwise aligned anew. The Sub is drawn from ctx.
+*/
+Sub *b_stored_sub(B *b, unsigned int i, Raw *raw, AlignContext *ctx) {
+  Bi *bi = b->bi[i];
+  int ci = b_comp_find(b, i, raw);
+  
+  if(ci >= 0) {
+    unsigned int cind = ci;
+    unsigned int start = bi->path_start[cind];
+    unsigned int end = (cind+1 < bi->path_start.size()) ? bi->path_start[cind+1] : bi->path.size();
+    if(end > start) {
+      path_unpack(&bi->path[start], end-start, ctx);
+      return path2sub(bi->center->seq, raw->seq, ctx);
+    }
+  }
+  return sub_new(bi->center, raw, b->score, b->gap_pen, b->homo_gap_pen, false, 1.0, b->band_size, b->vectorized_alignment, ctx);
+}
+
+// Has b_compare reuse and add to the alignments in cache. They are dropped first if
+// they were made with different alignment parameters than those of b.
+void b_cache_attach(B *b, AlignCache *cache) {
+  unsigned int i, j;
+  bool same = (cache->gap_pen == b->gap_pen && cache->homo_gap_pen == b->homo_gap_pen &&
+               cache->band_size == b->band_size && cache->vectorized_alignment == b->vectorized_alignment);
+  for(i=0;i<4;i++) {
+    for(j=0;j<4;j++) {
+      if(cache->score[i][j] != b->score[i][j]) { same = false; }
+    }
+  }
+  if(!same || cache->path.empty()) {
+    cache_clear(cache);
+    memcpy(cache->score, b->score, sizeof(cache->score));
+    cache->gap_pen = b->gap_pen;
+    cache->homo_gap_pen = b->homo_gap_pen;
+    cache->band_size = b->band_size;
+    cache->vectorized_alignment = b->vectorized_alignment;
+  }
+  b->cache = cache;
+}
+
+// Restores into ctx the kept alignment of raw to center, if there is one
+bool cache_find(AlignCache *cache, Raw *center, Raw *raw, AlignContext *ctx) {
+  std::unordered_map<uint64_t, unsigned int>::const_iterator it = cache->start.find(((uint64_t) center->index << 32) | raw->index);
+  if(it == cache->start.end()) { return false; }
+  path_unpack(&cache->path[it->second + 1], cache->path[it->second], ctx);
+  return true;
+}
+
+// The bytes held by all live AlignCaches and their raws, which are only changed from the main thread
+static size_t cache_bytes_live = 0;
+
+// Keeps the alignment of raw to center, given packed in runs, if not already kept
+// and if that keeps all the caches and their raws within cache->max_bytes
+void cache_add(AlignCache *cache, Raw *center, Raw *raw, const std::vector<uint16_t> &runs) {
+  uint64_t key = ((uint64_t) center->index << 32) | raw->index;
+  // The path plus a hash node of the key, start and next pointer, and its bucket
+  size_t bytes = (runs.size()+1) * sizeof(uint16_t) + sizeof(key) + sizeof(unsigned int) + 2 * sizeof(void *);
+  if(cache_bytes_live + bytes > cache->max_bytes) { return; }
+  if(!cache->start.insert(std::make_pair(key, (unsigned int) cache->path.size())).second) { return; }
+  cache->path.push_back((uint16_t) runs.size());
+  cache->path.insert(cache->path.end(), runs.begin(), runs.end());
+  cache->bytes += bytes;
+  cache_bytes_live += bytes;
+}
+
+// Drops the alignments in cache and releases their memory
+void cache_clear(AlignCache *cache) {
+  std::unordered_map<uint64_t, unsigned int>().swap(cache->start);
+  std::vector<uint16_t>().swap(cache->path);
+  cache_bytes_live -= cache->bytes;
+  cache->bytes = 0;
+}
+
+// Readies an empty cache for the session of raws, whose memory is counted against
+// max_bytes along with the alignments. A max_bytes of 0 keeps no alignments.
+void cache_init(AlignCache *cache, Raw **raws, unsigned int nraw, size_t max_bytes) {
+  size_t bytes = 0;
+  for(unsigned int index=0;index<nraw;index++) {
+    // The Raw, its seq, homo and qind, its kmer pairs and its kmer bitmap if any
+    bytes += sizeof(Raw) + 3 * (raws[index]->length + 1) + 2 * raws[index]->nkmer * sizeof(uint16_t);
+    if(raws[index]->kmer_bits) { bytes += KMER_NWORDS * sizeof(uint64_t) + 2 * raws[index]->nkmer_multi * sizeof(uint16_t); }
+  }
+  cache->bytes = 0;
+  cache->raw_bytes = max_bytes > 0 ? bytes : 0;
+  cache->max_bytes = max_bytes;
+  cache_bytes_live += cache->raw_bytes;
+}
+
+// Drops the alignments in cache and stops counting its raws
+void cache_free(AlignCache *cache) {
+  cache_clear(cache);
+  cache_bytes_live -= cache->raw_bytes;
+  cache->raw_bytes = 0;
+}
+
 /*
 void b_e_update(B *b) {
   unsigned int i, index;
@@ -531,125 +958,218 @@ void b_e_update(B *b) {
 /* b_shuffle2:
  move each sequence to the bi that produces the highest expected
  number of that sequence. The center of a Bi cannot leave.
+ The best E/i for each raw is kept in b->emax/b->imax between calls, and only
+ the comparisons of Bis whose reads changed since the last shuffle are revisited.
 */
 bool b_shuffle2(B *b) {
-  unsigned int i, j, index;
+  unsigned int i, j, index, ci;
   bool shuffled = false;
+  double e;
   Raw *raw;
+  std::vector<unsigned int> rescan;
   
-  double *emax = (double *) malloc(b->nraw * sizeof(double));
-  unsigned int *imax = (unsigned int *) malloc(b->nraw * sizeof(unsigned int));
-  if(emax==NULL || imax==NULL) Rcpp::stop("Memory allocation failed.");
-
-  // Initialize emax/imax off of cluster 0
-  // Comparisons to all raws exist in cluster 0, in index order
-  for(index=0;index<b->nraw;index++) {
-    emax[index] = b->bi[0]->comp[index].lambda * b->bi[0]->reads;
-    imax[index] = 0;
+  // Update best E/i for each raw from the comparisons of flagged Bis
+  // Ties go to the lower cluster index, as when scanning all clusters in order
+  for(i=0;i<b->nclust;i++) {
+    if(!b->bi[i]->shuffle) { continue; }
+    for(j=0;j<b->bi[i]->comp_index.size();j++) {
+      index = b->bi[i]->comp_index[j];
+      e = b->bi[i]->comp_lambda[j] * b->bi[i]->reads;
+      if(b->imax[index] == i) {
+        if(e >= b->emax[index]) { b->emax[index] = e; }
+        else { rescan.push_back(index); } // The best Bi got worse, need to check all the others
+      } else if(e > b->emax[index] || (e == b->emax[index] && i < b->imax[index])) { // better E
+        b->emax[index] = e;
+        b->imax[index] = i;
+      }
+    }
+    b->bi[i]->shuffle = false;
   }
   
-  // Iterate over remaining comparisons, find best E/i for each raw
-  for(i=1;i<b->nclust;i++) {
-    for(j=0;j<b->bi[i]->comp.size();j++) {
-      if(b->bi[i]->comp[j].lambda * b->bi[i]->reads > emax[b->bi[i]->comp[j].index]) { // better E
-        emax[b->bi[i]->comp[j].index] = b->bi[i]->comp[j].lambda * b->bi[i]->reads;
-        imax[b->bi[i]->comp[j].index] = b->bi[i]->comp[j].i;
+  // Recompute best E/i for raws whose best Bi lost reads
+  // Comparisons to each raw are stored in cluster order, starting with cluster 0
+  for(j=0;j<rescan.size();j++) {
+    index = rescan[j];
+    b->emax[index] = -1.0;
+    for(ci=0;ci<b->raw_comp[index].size();ci++) {
+      i = b->raw_comp[index][ci].first;
+      e = b->bi[i]->comp_lambda[b->raw_comp[index][ci].second] * b->bi[i]->reads;
+      if(e > b->emax[index]) {
+        b->emax[index] = e;
+        b->imax[index] = i;
       }
     }
   }
   
   // Iterate over raws, if best i different than current, move
+  // Raws are moved in the same order as before they tracked their positions, as the order
+  // of each Bi's raw list decides ties between equal buds (see bud_less)
   for(i=0;i<b->nclust;i++) {
     // IMPORTANT TO ITERATE BACKWARDS DUE TO BI_POP_RAW!!!!!!
     for(int r=b->bi[i]->nraw-1; r>=0; r--) {
       raw = b->bi[i]->raw[r];
       // If a better cluster was found, move the raw to the new bi
-      if(imax[raw->index] != i) {
+      if(b->imax[raw->index] != i) {
         if(raw->index == b->bi[i]->center->index) {  // Check if center
           if(VERBOSE) { Rprintf("Warning: Shuffle blocked the center of a Bi from leaving."); }
           continue;
         }
-        // Moving raw
-        bi_pop_raw(b->bi[i], r);
-        bi_add_raw(b->bi[imax[raw->index]], raw);
-        shuffled = true;  
-      }  
+        b_move_raw(b, raw, b->imax[raw->index]);
+        shuffled = true;
+      }
     } // for(r=0;r<b->bi[i]->nraw;r++)
   }
-
-  free(emax);
-  free(imax);
   
   return shuffled;
 }
 
+/* bi_p_update_raw:
+ Calculates the abundance p-value of a raw in Bi i, and returns whether the raw
+ passes the hamming/fold screens for budding. Safe to call from worker threads.
+*/
+bool bi_p_update_raw(B *b, unsigned int i, Raw *raw, PvalMemo *memo) {
+  int ci;
+  raw->p = get_pA(raw, b->bi[i], memo);
+  
+  // Only those passing the hamming/fold screens can be budded, and never centers
+  // nor raws without a comparison to their Bi
+  ci = bi_comp_own(b->bi[i], raw);
+  return(ci >= 0 && raw->index != b->bi[i]->center->index && 
+         b->bi[i]->comp_hamming[ci] >= b->min_hamming &&
+         (b->min_fold <= 1 || ((double) raw->reads) >= b->min_fold * b->bi[i]->comp_lambda[ci] * b->bi[i]->reads) &&
+         raw->p <= 1.0);
+}
+
+// Inserts/updates the bud heap entry for the raw at b->bi[i]->raw[r], or removes it if not budable
+void b_heap_update(B *b, unsigned int i, unsigned int r, bool budable) {
+  Raw *raw = b->bi[i]->raw[r];
+  Bud bud;
+  if(budable) {
+    bud.p = raw->p;
+    bud.reads = raw->reads;
+    bud.i = i;
+    bud.r = r;
+    bud.index = raw->index;
+    b_heap_set(b, bud);
+  } else {
+    b_heap_remove(b, raw->index);
+  }
+}
+
 /* b_p_update:
  Calculates the abundance p-value for each raw in the clustering.
  Depends on the lambda between the raw and its cluster, and the reads of each.
+ Also refreshes the entries of the bud heap, which holds the raws that pass the
+ hamming/fold screens for budding keyed on their p-value.
+ Only Bis flagged update_e (reads or lambdas changed) are recalculated.
 */
 void b_p_update(B *b) {
   unsigned int i, r;
-  Raw *raw;
+  PvalMemo memo;
+  pmemo_init(&memo);
   for(i=0;i<b->nclust;i++) {
+    if(!b->bi[i]->update_e) { continue; }
     for(r=0;r<b->bi[i]->nraw;r++) {
-      raw = b->bi[i]->raw[r];
-      raw->p = get_pA(raw, b->bi[i]);
+      b_heap_update(b, i, r, bi_p_update_raw(b, i, b->bi[i]->raw[r], &memo));
     } // for(r=0;r<b->bi[i]->nraw;r++)
+    b->bi[i]->update_e = false;
   } // for(i=0;i<b->nclust;i++)
 }
 
+struct PUpdateParallel : public RcppParallel::Worker
+{
+  // source data
+  B *b;
+  unsigned int *ii;
+  unsigned int *rr;
+  
+  // destination budable flags
+  bool *budable;
+  
+  // initialize with source and destination
+  PUpdateParallel(B *b, unsigned int *ii, unsigned int *rr, bool *budable) 
+    : b(b), ii(ii), rr(rr), budable(budable) {}
+  
+  // Calculate the pvals, with the pval memo of this thread
+  void operator()(std::size_t begin, std::size_t end) {
+    PvalMemo *memo = pmemo_thread();
+    for(std::size_t j=begin;j<end;j++) {
+      budable[j] = bi_p_update_raw(b, ii[j], b->bi[ii[j]]->raw[rr[j]], memo);
+    }
+  }
+};
+
+/* b_p_update_parallel:
+ As b_p_update, with the p-values computed in parallel. The bud heap
+ is then updated serially.
+*/
+void b_p_update_parallel(B *b) {
+  unsigned int i, r, j, n;
+  
+  // Gather the raws in flagged Bis
+  for(i=0,n=0;i<b->nclust;i++) {
+    if(b->bi[i]->update_e) { n += b->bi[i]->nraw; }
+  }
+  unsigned int *ii = (unsigned int *) malloc(n * sizeof(unsigned int)); //E
+  unsigned int *rr = (unsigned int *) malloc(n * sizeof(unsigned int)); //E
+  bool *budable = (bool *) malloc(n * sizeof(bool)); //E
+  if(n>0 && (ii==NULL || rr==NULL || budable==NULL)) Rcpp::stop("Memory allocation failed.");
+  for(i=0,j=0;i<b->nclust;i++) {
+    if(!b->bi[i]->update_e) { continue; }
+    for(r=0;r<b->bi[i]->nraw;r++,j++) {
+      ii[j] = i;
+      rr[j] = r;
+    }
+    b->bi[i]->update_e = false;
+  }
+  
+  // Parallelize the pval calculations
+  PUpdateParallel pUpdateParallel(b, ii, rr, budable);
+  RcppParallel::parallelFor(0, n, pUpdateParallel, GRAIN_SIZE);
+  
+  // Update bud heap
+  for(j=0;j<n;j++) {
+    b_heap_update(b, ii[j], rr[j], budable[j]);
+  }
+  free(ii);
+  free(rr);
+  free(budable);
+}
+
 /* b_bud:
  Finds the minimum p-value. If significant, creates a new cluster and moves the
  raws from the raw with the minimum p-value to the new cluster.
+ The minimum is read off the top of the bud heap kept current by b_p_update.
  Returns index of new cluster, or 0 if no new cluster added.
 */
 
-int b_bud(B *b, double min_fold, int min_hamming, bool verbose) {
-  int i, r, ci;
-  int mini, minr, minreads, hamming;
+int b_bud(B *b, bool verbose) {
+  int i, ci;
+  unsigned int mini, minr;
   double minp = 1.0;
   double pA=1.0;
-  double lambda, mine;
-  Comparison mincomp;
+  double mine;
   Raw *raw;
 
-  // Find i, r indices and value of minimum pval.
-  mini=-999; minr=-999; minreads=0; minp=1.0;
-  for(i=0;i<b->nclust;i++) {
-    for(r=0; r<b->bi[i]->nraw; r++) {
-      raw = b->bi[i]->raw[r];
-      if(b->bi[i]->center->index == raw->index) { continue; } // Don't bud centers
-      ci = b->bi[i]->comp_index[raw->index];
-      hamming = b->bi[i]->comp[ci].hamming;
-      lambda = b->bi[i]->comp[ci].lambda;
-
-      // Calculate the fold over-abundance and the hamming distance to this raw
-      if(hamming >= min_hamming) { // Only those passing the hamming/fold screens can be budded
-        if(min_fold <= 1 || ((double) raw->reads) >= min_fold * lambda * b->bi[i]->reads) {  
-          if((raw->p < minp) ||
-            ((raw->p == minp && raw->reads > minreads))) { // Most significant
-            mini = i; minr = r;
-            minp = raw->p;
-            mine = lambda * b->bi[i]->reads;
-            mincomp = b->bi[i]->comp[ci];
-            minreads = raw->reads;
-          }
-        }
-      }
-    }
-  }
-
   // Bonferoni correct the abundance pval by the number of raws and compare to OmegaA
   // (quite conservative, although probably unimportant given the abundance model issues)
+  if(!b->bud_heap.empty()) { minp = b->bud_heap[0].p; }
   pA = minp*b->nraw;
-  if(pA < b->omegaA && mini >= 0 && minr >= 0) {  // A significant abundance pval
-    raw = bi_pop_raw(b->bi[mini], minr);
+  if(pA < b->omegaA && !b->bud_heap.empty()) {  // A significant abundance pval
+    mini = b->bud_heap[0].i;
+    minr = b->bud_heap[0].r;
+    raw = b->bi[mini]->raw[minr];
+    ci = raw->ci;
+    mine = b->bi[mini]->comp_lambda[ci] * b->bi[mini]->reads;
+    
+    b_heap_remove(b, raw->index);
+    bi_pop_raw(b->bi[mini], minr);
     i = b_add_bi(b, bi_new(b->nraw));
     strcpy(b->bi[i]->birth_type, "A");
     b->bi[i]->birth_pval = pA;
     b->bi[i]->birth_fold = raw->reads/mine;
     b->bi[i]->birth_e = mine;
-    b->bi[i]->birth_comp = mincomp;
+    b->bi[i]->birth_comp = bi_comp(b->bi[mini], ci);
     
     // Add raw to new cluster.
     bi_add_raw(b->bi[i], raw);
@@ -670,6 +1190,315 @@ int b_bud(B *b, double min_fold, int min_hamming, bool verbose) {
   return 0;
 }
 
+// The kmer distance between two raws, from their sorted (kmer, count) pairs
+static double raw_kmer_dist(Raw *raw1, Raw *raw2) {
+  unsigned int j1=0, j2=0;
+  uint32_t dotsum = 0;
+  while(j1<raw1->nkmer && j2<raw2->nkmer) {
+    if(raw1->kmer[2*j1] < raw2->kmer[2*j2]) { j1++; }
+    else if(raw1->kmer[2*j1] > raw2->kmer[2*j2]) { j2++; }
+    else {
+      dotsum += (raw1->kmer[2*j1+1] < raw2->kmer[2*j2+1] ? raw1->kmer[2*j1+1] : raw2->kmer[2*j2+1]);
+      j1++; j2++;
+    }
+  }
+  return kmer_dist_shared(dotsum, raw1->length, raw2->length, KMER_SIZE);
+}
+
+/* b_bud_batch:
+ As b_bud, but buds up to max_new significant raws at once, most significant first, which
+ need not be the order b_bud would take them in as the p-values change between its buds. A raw is only budded if it is outside the kmer screen (kmer distance > kdist_cutoff)
+ of every more significant raw, budded or held back, so that none of the new clusters can
+ take it or its reads, and budding one doesn't change whether the others are significant.
+ Each raw taken is screened against all those before it, so at most BUD_BATCH_MAX are
+ taken per call, bounding the kmer distances to BUD_BATCH_MAX^2/2. The rest stay on the
+ heap for the next call.
+ The birth information is that of the Bis before any raw moved, which is only what b_bud
+ would find for the first new cluster; b_birth_batch corrects the others after the shuffle.
+ Returns index of the first new cluster, or 0 if no new cluster added.
+*/
+int b_bud_batch(B *b, unsigned int max_new, double kdist_cutoff, bool verbose) {
+  unsigned int i, j, k, ci, first = b->nclust;
+  double mine;
+  Raw *raw;
+  Bud bud;
+  std::vector<Bud> buds, held;
+  
+  // Take significant raws off the bud heap, holding back those not independent of those before
+  while(!b->bud_heap.empty() && buds.size() < max_new && buds.size() + held.size() < BUD_BATCH_MAX &&
+        b->bud_heap[0].p * b->nraw < b->omegaA) {
+    bud = b->bud_heap[0];
+    b_heap_remove(b, bud.index);
+    raw = b->raw[bud.index];
+    for(k=0;k<buds.size();k++) {
+      if(raw_kmer_dist(raw, b->raw[buds[k].index]) <= kdist_cutoff) { break; }
+    }
+    for(j=0;k==buds.size() && j<held.size();j++) {
+      if(raw_kmer_dist(raw, b->raw[held[j].index]) <= kdist_cutoff) { break; }
+    }
+    if(k<buds.size() || j<held.size()) { held.push_back(bud); }
+    else { buds.push_back(bud); }
+  }
+  for(k=0;k<held.size();k++) { b_heap_set(b, held[k]); }
+  if(buds.empty()) {
+    if(verbose) { Rprintf("\nNo significant pval, no new cluster.\n"); }
+    return 0;
+  }
+  
+  // Birth information is relative to the Bi each raw is budded from, so find it before moving
+  for(k=0;k<buds.size();k++) {
+    raw = b->raw[buds[k].index];
+    ci = raw->ci;
+    mine = b->bi[buds[k].i]->comp_lambda[ci] * b->bi[buds[k].i]->reads;
+    i = b_add_bi(b, bi_new(b->nraw));
+    strcpy(b->bi[i]->birth_type, "A");
+    b->bi[i]->birth_pval = buds[k].p * b->nraw;
+    b->bi[i]->birth_fold = raw->reads/mine;
+    b->bi[i]->birth_e = mine;
+    b->bi[i]->birth_comp = bi_comp(b->bi[buds[k].i], ci);
+  }
+  
+  for(k=0;k<buds.size();k++) {
+    b_move_raw(b, b->raw[buds[k].index], first+k);
+    bi_assign_center(b->bi[first+k]);
+  }
+  return first;
+}
+
+/* b_birth_batch:
+ Sets the birth information of the clusters after first, budded together by b_bud_batch, to
+ what b_bud would have found budding them one at a time, each once those before it had taken
+ their raws by shuffling. The reads of the older Bis when cluster k is budded are taken to be
+ their reads now plus those of the raws now in clusters k on that came from them, where origin
+ is the Bi of each raw before the shuffle. The raw is budded from the older Bi with the largest
+ expected reads of it, as it would then be in that Bi. Raws moved between the older Bis by the
+ shuffle are taken to have moved before the first new cluster was budded.
+*/
+void b_birth_batch(B *b, unsigned int first, const std::vector<unsigned int> &origin) {
+  unsigned int i, j, k, r, ci, maxj;
+  double e, emax, pA;
+  Raw *raw, *center;
+  PvalMemo memo;
+  pmemo_init(&memo);
+  std::vector<unsigned int> reads(first);
+  
+  for(j=0;j<first;j++) { reads[j] = b->bi[j]->reads; }
+  for(i=b->nclust-1;i>first;i--) {
+    // Return the raws of this cluster to their older Bis, the center to the Bi it was budded from
+    center = b->bi[i]->center;
+    for(r=0;r<b->bi[i]->nraw;r++) {
+      raw = b->bi[i]->raw[r];
+      j = (raw == center) ? b->bi[i]->birth_comp.i : origin[raw->index];
+      if(j < first) { reads[j] += raw->reads; }
+    }
+    
+    // Comparisons to each raw are in cluster order, ties go to the lower cluster index as in b_shuffle2
+    emax = -1.0;
+    maxj = 0;
+    ci = 0;
+    for(k=0;k<b->raw_comp[center->index].size();k++) {
+      j = b->raw_comp[center->index][k].first;
+      if(j >= first) { break; }
+      e = b->bi[j]->comp_lambda[b->raw_comp[center->index][k].second] * reads[j];
+      if(e > emax) {
+        emax = e;
+        maxj = j;
+        ci = b->raw_comp[center->index][k].second;
+      }
+    }
+    if(emax < 0) { continue; } // Not compared to an older Bi, keep the birth information of b_bud_batch
+    
+    // The abundance p-value as get_pA would find it in that Bi, Bonferroni corrected as in b_bud
+    if(b->bi[maxj]->comp_lambda[ci] == 0) { pA = 0.0; }
+    else { pA = calc_pA(center->reads, emax, &memo); }
+    b->bi[i]->birth_pval = pA * b->nraw;
+    b->bi[i]->birth_fold = center->reads/emax;
+    b->bi[i]->birth_e = emax;
+    b->bi[i]->birth_comp = bi_comp(b->bi[maxj], ci);
+  }
+}
+
+/* b_seed:
+ Starts a new cluster from each of the raws seeds[start] to seeds[end-1] (eg. the centers of
+ a previous run), in that order, as b_bud would have budded them from the Bis they are in.
+ Their birth information is that of budding them there, until b_dissolve tests them.
+ Must follow the comparison and p-value update of the initial cluster.
+ Returns the index of the first new cluster.
+*/
+unsigned int b_seed(B *b, const std::vector<unsigned int> &seeds, unsigned int start, unsigned int end) {
+  unsigned int i, s, ci, first = b->nclust;
+  double mine, pA;
+  Raw *raw;
+  Bi *bi;
+  PvalMemo memo;
+  pmemo_init(&memo);
+  std::vector<bool> is_seed(b->nraw, false);
+  
+  // The center of a Bi can't leave it
+  for(s=start;s<end;s++) { 
+    raw = b->raw[seeds[s]];
+    is_seed[raw->index] = (raw != b->bi[raw->i]->center);
+  }
+  
+  // Birth information is relative to the Bis the seeds are in, so find it before moving
+  for(s=start;s<end;s++) {
+    raw = b->raw[seeds[s]];
+    if(!is_seed[raw->index]) { continue; }
+    bi = b->bi[raw->i];
+    ci = raw->ci;
+    mine = bi->comp_lambda[ci] * bi->reads;
+    if(raw->reads == 1 || bi->comp_hamming[ci] == 0) { pA = 1.0; } // As get_pA would find it
+    else if(mine == 0) { pA = 0.0; }
+    else { pA = calc_pA(raw->reads, mine, &memo); }
+    i = b_add_bi(b, bi_new(b->nraw));
+    strcpy(b->bi[i]->birth_type, "A");
+    b->bi[i]->birth_pval = pA * b->nraw;
+    b->bi[i]->birth_fold = raw->reads/mine;
+    b->bi[i]->birth_e = mine;
+    b->bi[i]->birth_comp = bi_comp(bi, ci);
+  }
+  
+  for(s=start,i=first;s<end;s++) {
+    raw = b->raw[seeds[s]];
+    if(!is_seed[raw->index]) { continue; }
+    b_heap_remove(b, raw->index);
+    b_move_raw(b, raw, i);
+    bi_assign_center(b->bi[i]);
+    i++;
+  }
+  return first;
+}
+
+// Removes the Bis flagged in drop, returning their raws to the initial cluster, and renumbers
+// the others in order. The comparisons of the removed Bis are dropped, and each raw's E_minmax
+// is reset to what the comparisons kept would have set. The best E/i of every raw is then
+// recomputed by the next b_shuffle2, and the bud heap rebuilt by the next b_p_update.
+static void b_drop_bis(B *b, const std::vector<bool> &drop) {
+  unsigned int i, n, index, k, j;
+  int r;
+  double e;
+  Raw *raw;
+  std::vector<unsigned int> renum(b->nclust);
+  
+  for(i=1;i<b->nclust;i++) {
+    if(!drop[i]) { continue; }
+    for(r=b->bi[i]->nraw-1;r>=0;r--) { b_move_raw(b, b->bi[i]->raw[r], 0); }
+  }
+  for(i=0,n=0;i<b->nclust;i++) {
+    if(drop[i]) { bi_free(b->bi[i]); continue; }
+    renum[i] = n;
+    b->bi[n] = b->bi[i];
+    b->bi[n]->i = n;
+    for(r=0;r<(int) b->bi[n]->nraw;r++) { b->bi[n]->raw[r]->i = n; }
+    b->bi[n]->update_e = true;
+    b->bi[n]->shuffle = true;
+    n++;
+  }
+  for(i=0;i<n;i++) {
+    if(b->bi[i]->birth_comp.i < b->nclust && !drop[b->bi[i]->birth_comp.i]) { b->bi[i]->birth_comp.i = renum[b->bi[i]->birth_comp.i]; }
+  }
+  b->nclust = n;
+  
+  // Comparisons to each raw stay in cluster order, starting with the initial cluster
+  for(index=0;index<b->nraw;index++) {
+    raw = b->raw[index];
+    raw->E_minmax = -999.0;
+    for(k=0,j=0;k<b->raw_comp[index].size();k++) {
+      i = b->raw_comp[index][k].first;
+      if(drop[i]) { continue; }
+      b->raw_comp[index][j].first = renum[i];
+      b->raw_comp[index][j].second = b->raw_comp[index][k].second;
+      e = b->bi[renum[i]]->comp_lambda[b->raw_comp[index][k].second] * b->bi[renum[i]]->center->reads;
+      if(e > raw->E_minmax) { raw->E_minmax = e; }
+      j++;
+    }
+    b->raw_comp[index].resize(j);
+  }
+  
+  b->emax.assign(b->nraw, -1.0);
+  b->imax.assign(b->nraw, 0);
+  b->bud_heap.clear();
+  b->bud_pos.assign(b->nraw, -1);
+}
+
+/* b_dissolve:
+ Tests the center of each cluster from first on as b_bud would were that cluster dissolved:
+ its other raws returned to the other Bis expecting the most reads of them, and the center
+ to the one that would then expect the most reads of it, where its abundance p-value and the
+ hamming/fold screens of b_p_update are taken. Sets the birth information of the clusters to
+ that of this test, keeps those compared to no other, and removes those that fail, returning
+ their raws to the initial cluster. Returns whether any were removed, in which case the
+ clustering must be shuffled, p-updated and tested again.
+*/
+bool b_dissolve(B *b, unsigned int first) {
+  unsigned int i, j, k, r, ci, maxj = 0;
+  double e, emax, pA;
+  Comparison comp = {0, 0, 0.0, 0};
+  bool found;
+  Raw *raw, *center;
+  PvalMemo memo;
+  pmemo_init(&memo);
+  std::vector<unsigned int> extra(b->nclust, 0), touched; // the reads each other Bi would gain
+  std::vector<bool> drop(b->nclust, false);
+  bool dropped = false;
+  
+  for(i=first;i<b->nclust;i++) {
+    center = b->bi[i]->center;
+    // Comparisons to each raw are in cluster order, ties go to the lower cluster index as in b_shuffle2
+    for(r=0;r<b->bi[i]->nraw;r++) {
+      raw = b->bi[i]->raw[r];
+      if(raw == center) { continue; }
+      emax = -1.0;
+      for(k=0;k<b->raw_comp[raw->index].size();k++) {
+        j = b->raw_comp[raw->index][k].first;
+        if(j == i) { continue; }
+        e = b->bi[j]->comp_lambda[b->raw_comp[raw->index][k].second] * b->bi[j]->reads;
+        if(e > emax) {
+          emax = e;
+          maxj = j;
+        }
+      }
+      if(emax < 0) { continue; }
+      if(extra[maxj] == 0) { touched.push_back(maxj); }
+      extra[maxj] += raw->reads;
+    }
+    
+    emax = -1.0;
+    found = false;
+    for(k=0;k<b->raw_comp[center->index].size();k++) {
+      j = b->raw_comp[center->index][k].first;
+      if(j == i) { continue; }
+      ci = b->raw_comp[center->index][k].second;
+      e = b->bi[j]->comp_lambda[ci] * (b->bi[j]->reads + extra[j] + center->reads);
+      if(e > emax) {
+        emax = e;
+        comp = bi_comp(b->bi[j], ci);
+        found = true;
+      }
+    }
+    for(k=0;k<touched.size();k++) { extra[touched[k]] = 0; }
+    touched.clear();
+    if(!found) { continue; } // Nothing to test against, keep the seed
+    
+    // As get_pA would find it, Bonferroni corrected as in b_bud
+    if(center->reads == 1 || comp.hamming == 0) { pA = 1.0; }
+    else if(comp.lambda == 0) { pA = 0.0; }
+    else { pA = calc_pA(center->reads, emax, &memo); }
+    b->bi[i]->birth_pval = pA * b->nraw;
+    b->bi[i]->birth_fold = center->reads/emax;
+    b->bi[i]->birth_e = emax;
+    b->bi[i]->birth_comp = comp;
+    if(pA * b->nraw >= b->omegaA || comp.hamming < b->min_hamming ||
+       (b->min_fold > 1 && ((double) center->reads) < b->min_fold * emax)) {
+      drop[i] = true;
+      dropped = true;
+    }
+  }
+  
+  if(dropped) { b_drop_bis(b, drop); }
+  return dropped;
+}
+
 /* Bi_make_consensus:
   Uses the alignments to the cluster center to construct a consensus sequence, which
   is then assigned to bi->seq
@@ -18,12 +18,13 @@
 #define TESTING 0
 #define VERBOSE 0
 #define SEQLEN 1000 // Buffer size for DNA sequences read in from uniques files
-// SEQLEN MAY NOT BE INCREASED BEYOND 1000 WITHOUT REVISITING AL2SUBS
 #define MIN_BUCKETS 10
 #define BUCKET_SCALE 0.5
 #define TAIL_APPROX_CUTOFF 1e-7 // Should test to find optimal
 #define DBL_PRECISION 1e-15 // precision of doubles
 #define KMER_SIZE 5
+#define KMER_VLEN ((1 << (2*KMER_SIZE)) + 1) // Entries of a dense kmer vector, padded as in get_kmer
+#define KMER_NWORDS ((1 << (2*KMER_SIZE))/64) // Words of a kmer presence bitmap, see get_kmer_bits
 #define NERRS 12
 #define TRUE  1
 #define FALSE 0
@@ -32,6 +33,13 @@
 #define QSTEP 1
 #define GAP_GLYPH 9999
 #define GRAIN_SIZE 10
+#define PMEMO_SIZE 256 // Number of entries in the direct-mapped pval memo
+#define NSUB_BOUND 8 // Number of per-sub lambda ratios kept by each raw for the lambda bound
+#define SUBPOOL_CHUNK 65536 // Default size in bytes of the chunks Subs are drawn from
+#define ALIGN_LANES 16 // Number of raws aligned together by align_center_batch, one per DP lane
+#define COMPARE_GRAIN (8*ALIGN_LANES) // Grain size of the parallel comparisons, so each range fills the lanes
+#define COMPARE_BATCH_MAX 65536 // Most comparisons in each parallel pass of b_compare_batch_parallel, see there
+#define BUD_BATCH_MAX 256 // Most significant raws examined by each b_bud_batch, see there
 
 
 /* -------------------------------------------
@@ -39,7 +47,8 @@
    ------------------------------------------- */
 
 /* Comparison:
- A brief summary of the comparison between a cluster and a raw */
+ A brief summary of the comparison between a cluster and a raw.
+ Stored comparisons are kept column-wise in their Bi (see bi_comp). */
 typedef struct {
   unsigned int i;
   unsigned int index;
@@ -47,10 +56,21 @@ typedef struct {
   unsigned int hamming;
 } Comparison;
 
+/* Bud:
+ A raw that could seed a new cluster, keyed for b_bud on its abundance pval */
+typedef struct {
+  double p;
+  unsigned int reads;
+  unsigned int i;     // the Bi containing the raw
+  unsigned int r;     // the position of the raw in bi->raw
+  unsigned int index; // the index of the raw in b->raw
+} Bud;
+
 /* Sub:
  A set of substitutions (position and identity) of one sequence
  in an alignment to another sequence.
- Note: positions will be 0-indexed in the alignment */
+ Note: positions will be 0-indexed in the alignment
+ Stored as one block, the arrays following the struct (see sub_size). */
 typedef struct {
   unsigned int nsubs;   // number of substitions
   unsigned int len0;    // The length of the ref seq
@@ -58,22 +78,30 @@ typedef struct {
   uint16_t *pos;    // sequence position of the substitition: index in the reference seq
   char *nt0;   // nt in reference seq
   char *nt1;   // different nt in aligned seq
-  double *q0;  // quality in reference seq
-  double *q1;  // quality in aligned seq
-  char *key;   // string of all subs: concatenation of "%c%d%c," % nt0,pos,nt1
+  double *q0;  // quality in reference seq (only allocated and filled by sub_set_quals for output, else NULL)
+  double *q1;  // quality in aligned seq (likewise)
 } Sub;
 
 // Raw: Container for each unique sequence/abundance
 typedef struct {
   char *seq;   // the sequence, stored as C-string with A=1,C=2,G=3,T=4
-  float *qual; // the average qualities at each position for this unique
-  uint16_t *kmer;   // the kmer vector of this sequence
+  uint8_t *qind; // the rounded average quality at each position, ie. the column in the err lookup table
+  unsigned char *homo; // 1 at the positions in homopolymers, see homo_mask
+  uint16_t *kmer;   // the sorted (kmer, count) pairs of the kmers in this sequence
+  unsigned int nkmer; // the number of (kmer, count) pairs
+  uint64_t *kmer_bits; // the kmer presence bitmap then the pairs with counts above 1 (see get_kmer_bits), or NULL
+  unsigned int nkmer_multi; // the number of pairs with counts above 1 after kmer_bits
   unsigned int length;  // the length of the sequence
   unsigned int reads;   // number of reads of this unique sequence
   unsigned int index;   // The index of this Raw in b->raw[index]
+  unsigned int i;       // the Bi containing this raw, kept by bi_add_raw
+  unsigned int r;       // the position of this raw in that Bi's raw list, kept by bi_add_raw/bi_pop_raw
   double p;    // abundance pval relative to the current Bi
   double E_minmax;
-  Comparison comp;
+  double log_self; // log of lambda with no subs, product of self-transition rates (set by raws_set_log_lambda)
+  double log_ub; // log_self plus the sum of the positive log(err/self) ratios over positions (set by raws_set_log_lambda)
+  double log_ratio[NSUB_BOUND]; // the largest non-positive log(err/self) ratios over positions, descending
+  unsigned int ci; // the position of the comparison to this raw in its Bi, kept by b_compare/b_move_raw
 } Raw;
 
 // Bi: This is one cluster or partition. Contains raws grouped in fams.
@@ -85,11 +113,11 @@ typedef struct {
   unsigned int nraw;    // number of raws in Bi
   unsigned int reads;   // number of reads in this cluster
   unsigned int i;       // the cluster number in the total clustering
-  Raw **raw;   // Array of pointers to child fams.
-  unsigned int maxraw;  // number of fams currently allocated for in **fam
-  bool update_lambda; // set to true when consensus changes
-  bool update_e; // set to true when consensus changes and when raws are shuffled
-  bool shuffle; // set to true when e-values are updated
+  Raw **raw;   // Array of pointers to the raws in this Bi, in no particular order
+  unsigned int maxraw;  // number of raws currently allocated for in **raw
+  bool update_lambda; // set to true when consensus changes, cleared when b_compare computes lambdas
+  bool update_e; // set to true when lambdas are computed and when raws are shuffled, cleared by b_p_update
+  bool shuffle; // set to true when reads change, so b_shuffle2 revisits this Bi's comparisons
   double self; // self-production genotype error probability
   unsigned int totraw; // number of total raws in the clustering
   char birth_type[2]; // encoding of how this Bi was created: "I": Initial cluster, "A": Abundance pval, "S": Singleton pval
@@ -97,10 +125,75 @@ typedef struct {
   double birth_fold; // the multiple of expectations at birth
   double birth_e; // the expected number of reads at birth
   Comparison birth_comp; // the Comparison object at birth
-  std::vector<Comparison> comp;
-  std::unordered_map<unsigned int, unsigned int> comp_index;
+  std::vector<double> comp_lambda; // the lambda of each stored comparison (see b_compare)
+  std::vector<uint16_t> comp_hamming; // the hamming distance of each stored comparison
+  std::vector<unsigned int> comp_index; // the index of the raw of each stored comparison
+  std::vector<uint16_t> path; // the alignment paths of the stored comparisons, packed by path_pack
+  std::vector<unsigned int> path_start; // the start in path of each stored comparison's path (by position in comp)
 } Bi;
 
+/* SubChunk:
+ A chunk of the pool that Subs are drawn from, its data follows the header */
+typedef struct SubChunk {
+  struct SubChunk *next;
+  size_t size; // bytes of data
+  size_t used; // bytes of data handed out
+} SubChunk;
+
+/* AlignCache:
+ The alignments between raws kept across runs on the same raws (see Session), keyed by
+ (center index, raw index). Only valid for the alignment parameters they were made with.
+ The kept alignments of all sessions and the raws of those sessions, which stay resident too,
+ are bounded together by max_bytes (see ALIGN_CACHE_MB in setDadaOpt); further alignments aren't kept. */
+typedef struct {
+  std::unordered_map<uint64_t, unsigned int> start; // the start in path of each kept alignment
+  std::vector<uint16_t> path; // the kept alignments, each its number of runs then its runs (see path_pack)
+  int score[4][4]; // the alignment parameters they were made with
+  int gap_pen;
+  int homo_gap_pen;
+  int band_size;
+  bool vectorized_alignment;
+  size_t bytes; // the approximate memory held by the alignments
+  size_t raw_bytes; // the approximate memory held by the raws of the session
+  size_t max_bytes; // the bound on the memory held by all live AlignCaches and their raws
+} AlignCache;
+
+/* AlignContext:
+ Grow-only scratch buffers for the aligners, so that steady-state alignment does no heap
+ allocation. The aligners trace back into path, as moves from the end of the alignment
+ (1: both, 2: gap in s1, 3: gap in s2), from which path2sub or path2al build their output.
+ The alignment path2al returns lives in the context, and is only valid until the next
+ alignment made with it. The Subs made with it are drawn from its pool, and are valid
+ until actx_release_subs or actx_free (they are not passed to sub_free).
+ Not shared between threads, each worker uses that of its thread (actx_thread). */
+typedef struct {
+  void *d; size_t d_size; // DP score matrix
+  void *p; size_t p_size; // DP traceback matrix
+  void *diag; size_t diag_size; // diagonal buffer of nwalign_vectorized2
+  void *homo; size_t homo_size; // homopolymer flags of nwalign_endsfree_homo
+  void *gaps; size_t gaps_size; // gap penalty at each position of the sequences of nwalign_vectorized2_homo
+  void *path; size_t path_size; // the traceback moves, last column first
+  size_t len_path; // the number of moves in path
+  void *subs; size_t subs_size; // substitutions found by path2sub
+  SubChunk *pool; // chunks holding the current Subs, most recent first
+  SubChunk *spare; // released chunks, for reuse
+  void *alb; size_t alb_size; // the alignment strings
+  char *al[2]; // the returned alignment, pointing into alb
+  void *lseq; size_t lseq_size; // the lane sequences of align_center_batch interleaved by position, or s1 reversed
+  void *lpath; size_t lpath_size; // the traceback moves of each lane, lpath_stride apart
+  size_t lpath_stride;
+  size_t lane_len_path[ALIGN_LANES]; // the number of moves of each lane
+  int nw_narrow; // 1 if the last nwalign_vectorized2_path was done in 8 bits, 2 if then redone in 16, else 0
+} AlignContext;
+
+// PvalMemo: A small direct-mapped cache of abundance pvals keyed by (reads, E_reads).
+// Not shared between threads, each worker uses that of its thread (pmemo_thread).
+typedef struct {
+  int reads[PMEMO_SIZE];
+  double E[PMEMO_SIZE];
+  double pval[PMEMO_SIZE];
+} PvalMemo;
+
 // B: holds all the clusters. The full clustering (or partition).
 typedef struct {
   unsigned int nclust;
@@ -110,37 +203,80 @@ typedef struct {
   int band_size;
   unsigned int nalign;
   unsigned int nshroud;
+  unsigned int nskip;
+  unsigned int nnarrow; // alignments tried in 8 bits
+  unsigned int nwiden; // of those, the ones redone in 16 bits
   int score[4][4];
   int gap_pen;
   int homo_gap_pen;
   bool vectorized_alignment;
   double omegaA;
+  double min_fold;
+  int min_hamming;
   bool use_quals;
   double *lams;
   double *cdf;
   size_t nlam;
   Raw **raw;
   Bi **bi;
+  std::vector<double> emax; // the best E over all clusters for each raw, maintained by b_shuffle2
+  std::vector<unsigned int> imax; // the cluster providing that best E
+  std::vector< std::vector< std::pair<unsigned int, unsigned int> > > raw_comp; // (i, cind) of each stored comparison to each raw
+  std::vector<Bud> bud_heap; // binary min-heap of the raws that can be budded, maintained by b_p_update
+  std::vector<int> bud_pos; // position of each raw in bud_heap, -1 if absent
+  std::vector< std::vector<uint16_t> > cand_path; // scratch for b_compare_batch_parallel: packed path of each comparison in a pass, released after
+  AlignContext actx; // aligner scratch for the serial b_compare
+  AlignCache *cache; // alignments kept from previous runs on these raws, or NULL
 } B;
 
+/* Session:
+ The raws of one sample, kept by dada_session so that repeated runs on it (eg. the
+ selfConsist iterations of dada) don't rebuild them, and optionally the alignments made. */
+typedef struct {
+  Raw **raws;
+  unsigned int nraw;
+  unsigned int maxlen;
+  bool has_quals;
+  Rcpp::NumericMatrix quals; // the input quals, a column for each raw
+  bool keep_alignments; // whether to keep alignments in cache between runs
+  AlignCache cache;
+} Session;
+
 /* -------------------------------------------
    -------- METHODS METHODS METHODS ----------
    ------------------------------------------- */
 
 // methods implemented in cluster.c
-B *b_new(Raw **raws, unsigned int nraw, int score[4][4], int gap_pen, int homo_gap_pen, double omegaA, int band_size, bool vectorized_alignment, bool use_quals);
+B *b_new(Raw **raws, unsigned int nraw, int score[4][4], int gap_pen, int homo_gap_pen, double omegaA, double min_fold, int min_hamming, int band_size, bool vectorized_alignment, bool use_quals);
 Raw *raw_new(char *seq, double *qual, unsigned int reads);
 void raw_free(Raw *raw);
 void b_free(B *b);
 void b_init(B *b);
 bool b_shuffle2(B *b);
+Sub *b_stored_sub(B *b, unsigned int i, Raw *raw, AlignContext *ctx);
+int bi_comp_own(Bi *bi, Raw *raw);
+int b_comp_find(B *b, unsigned int i, Raw *raw);
+Comparison bi_comp(Bi *bi, unsigned int ci);
+unsigned int bi_comp_add(Bi *bi, const Comparison &comp);
+void b_cache_attach(B *b, AlignCache *cache);
+bool cache_find(AlignCache *cache, Raw *center, Raw *raw, AlignContext *ctx);
+void cache_add(AlignCache *cache, Raw *center, Raw *raw, const std::vector<uint16_t> &runs);
+void cache_clear(AlignCache *cache);
+void cache_init(AlignCache *cache, Raw **raws, unsigned int nraw, size_t max_bytes);
+void cache_free(AlignCache *cache);
 void b_compare(B *b, unsigned int i, bool use_kmers, double kdist_cutoff, Rcpp::NumericMatrix errMat, bool verbose);
 //void b_compare_threaded(B *b, unsigned int i, bool use_kmers, double kdist_cutoff, Rcpp::NumericMatrix errMat, unsigned int nthreads, bool verbose);
 void b_compare_parallel(B *b, unsigned int i, bool use_kmers, double kdist_cutoff, Rcpp::NumericMatrix errMat, bool verbose);
+void b_compare_batch_parallel(B *b, unsigned int first, unsigned int last, bool use_kmers, double kdist_cutoff, Rcpp::NumericMatrix errMat, bool verbose);
 void b_consensus_update(B *b);
 //void b_e_update(B *b);
 void b_p_update(B *b);
-int b_bud(B *b, double min_fold, int min_hamming, bool verbose);
+void b_p_update_parallel(B *b);
+int b_bud(B *b, bool verbose);
+int b_bud_batch(B *b, unsigned int max_new, double kdist_cutoff, bool verbose);
+void b_birth_batch(B *b, unsigned int first, const std::vector<unsigned int> &origin);
+unsigned int b_seed(B *b, const std::vector<unsigned int> &seeds, unsigned int start, unsigned int end);
+bool b_dissolve(B *b, unsigned int first);
 char **b_get_seqs(B *b);
 int *b_get_abunds(B *b);
 //void b_make_consensus(B *b);
@@ -156,21 +292,55 @@ void err_print(double err[4][4]);
 void test_fun(int i);
 
 // method implemented in nwalign_endsfree.c
-char **nwalign(const char *s1, const char *s2, int score[4][4], int gap_p, int band);
-char **nwalign_endsfree(const char *s1, const char *s2, int score[4][4], int gap_p, int band);
-char **nwalign_endsfree_homo(const char *s1, const char *s2, int score[4][4], int gap_p, int gap_homo_p, int band);
-char **nwalign_vectorized2(const char *s1, const char *s2, int16_t match, int16_t mismatch, int16_t gap_p, int16_t end_gap_p, int band);
-char **raw_align(Raw *raw1, Raw *raw2, int score[4][4], int gap_p, int homo_gap_p, bool use_kmer, double kdist_cutoff, int band, bool vectorized_alignment);
+void actx_init(AlignContext *ctx);
+void actx_free(AlignContext *ctx);
+AlignContext *actx_thread();
+void *actx_reserve(void **buf, size_t *buf_size, size_t size);
+char **actx_alignment(AlignContext *ctx, size_t len_al);
+void actx_lane_path(AlignContext *ctx, unsigned int k);
+void actx_release_subs(AlignContext *ctx);
+void actx_take_subs(AlignContext *ctx, AlignContext *from);
+char **path2al(const char *s1, const char *s2, AlignContext *ctx);
+Sub *path2sub(const char *s1, const char *s2, AlignContext *ctx);
+void path_pack(AlignContext *ctx, std::vector<uint16_t> &runs);
+void path_unpack(const uint16_t *runs, size_t nrun, AlignContext *ctx);
+void nwalign_path(const char *s1, const char *s2, int score[4][4], int gap_p, int band, AlignContext *ctx);
+void nwalign_endsfree_path(const char *s1, const char *s2, int score[4][4], int gap_p, int band, AlignContext *ctx);
+void nwalign_endsfree_homo_path(const char *s1, const char *s2, const unsigned char *homo1, const unsigned char *homo2, int score[4][4], int gap_p, int gap_homo_p, int band, AlignContext *ctx);
+void nwalign_vectorized2_path(const char *s1, const char *s2, int16_t match, int16_t mismatch, int16_t gap_p, int16_t end_gap_p, int band, AlignContext *ctx);
+void nwalign_vectorized2_homo_path(const char *s1, const char *s2, const unsigned char *homo1, const unsigned char *homo2, int16_t match, int16_t mismatch, int16_t gap_p, int16_t homo_gap_p, int16_t end_gap_p, int band, AlignContext *ctx);
+void nwalign_vectorized2_score_path(const char *s1, const char *s2, const unsigned char *homo1, const unsigned char *homo2, int score[4][4], int16_t gap_p, int16_t homo_gap_p, int16_t end_gap_p, int band, AlignContext *ctx);
+void nwalign_vectorized2_batch_path(const char *s1, const char **s2, unsigned int n, int16_t match, int16_t mismatch, int16_t gap_p, int16_t end_gap_p, int band, AlignContext *ctx);
+void align_center_batch(Raw *center, Raw **raws, unsigned int n, int score[4][4], int gap_p, int band, AlignContext *ctx);
+char **nwalign(const char *s1, const char *s2, int score[4][4], int gap_p, int band, AlignContext *ctx);
+char **nwalign_endsfree(const char *s1, const char *s2, int score[4][4], int gap_p, int band, AlignContext *ctx);
+char **nwalign_endsfree_homo(const char *s1, const char *s2, int score[4][4], int gap_p, int gap_homo_p, int band, AlignContext *ctx);
+char **nwalign_vectorized2(const char *s1, const char *s2, int16_t match, int16_t mismatch, int16_t gap_p, int16_t end_gap_p, int band, AlignContext *ctx);
+char **nwalign_vectorized2_homo(const char *s1, const char *s2, int16_t match, int16_t mismatch, int16_t gap_p, int16_t homo_gap_p, int16_t end_gap_p, int band, AlignContext *ctx);
+void homo_mask(const char *seq, unsigned int len, unsigned char *homo);
+bool score_match_mismatch(int score[4][4]);
+bool raw_align(Raw *raw1, Raw *raw2, int score[4][4], int gap_p, int homo_gap_p, bool use_kmer, double kdist_cutoff, int band, bool vectorized_alignment, AlignContext *ctx);
 uint16_t *get_kmer(char *seq, int k);
-double kmer_dist(uint16_t *kv1, int len1, uint16_t *kv2, int len2, int k);
-Sub *al2subs(char **al);
-Sub *sub_new(Raw *raw0, Raw *raw1, int score[4][4], int gap_p, int homo_gap_p, bool use_kmers, double kdist_cutoff, int band, bool vectorized_alignment);
+uint16_t *get_kmer_pairs(char *seq, int k, unsigned int *nkmer);
+double kmer_dist(uint16_t *kv1, int len1, uint16_t *kp2, unsigned int n2, int len2, int k);
+uint64_t *get_kmer_bits(const uint16_t *kp, unsigned int n, unsigned int *nmulti);
+uint32_t kmer_shared(const uint16_t *kv0, const Raw *raw0, const Raw *raw1);
+void kmer_pairs_dense(const uint16_t *kp, unsigned int n, uint16_t *kv);
+double kmer_dist_shared(uint32_t dotsum, int len1, int len2, int k);
+unsigned int min_nsubs(Raw *raw0, uint32_t dotsum, Raw *raw1, int score[4][4], int gap_p, int homo_gap_p);
+Sub *sub_new(Raw *raw0, Raw *raw1, int score[4][4], int gap_p, int homo_gap_p, bool use_kmers, double kdist_cutoff, int band, bool vectorized_alignment, AlignContext *ctx);
+void sub_set_quals(Sub *sub, Raw *raw0, Raw *raw1, Rcpp::NumericMatrix quals, AlignContext *ctx);
 Sub *sub_copy(Sub *sub);
 void sub_free(Sub *sub);
 
 // methods implemented in pval.cpp
-double calc_pA(int reads, double E_reads);
-double get_pA(Raw *raw, Bi *bi);
+double ppois_upper(int n, double E);
+double calc_pA(int reads, double E_reads, PvalMemo *memo);
+void pmemo_init(PvalMemo *memo);
+PvalMemo *pmemo_thread();
+double get_pA(Raw *raw, Bi *bi, PvalMemo *memo);
+void raws_set_log_lambda(Raw **raws, unsigned int nraw, Rcpp::NumericMatrix errMat, bool use_quals);
+double lambda_bound(Raw *raw, unsigned int nsubs);
 double compute_lambda(Raw *raw, Sub *sub, Rcpp::NumericMatrix errMat, bool use_quals, unsigned int ncol);
 double compute_lambda_ts(Raw *raw, Sub *sub, unsigned int ncol, double *err_mat, bool use_quals);
 double get_self(char *seq, double err[4][4]);
@@ -178,7 +348,9 @@ double get_self(char *seq, double err[4][4]);
 // methods implemented in error.cpp
 Rcpp::DataFrame b_make_clustering_df(B *b, Sub **subs, Sub **birth_subs, bool has_quals);
 Rcpp::IntegerMatrix b_make_transition_by_quality_matrix(B *b, Sub **subs, bool has_quals, int ncol);
-Rcpp::NumericMatrix b_make_cluster_quality_matrix(B *b, Sub **subs, bool has_quals, unsigned int seqlen);
+Rcpp::IntegerMatrix b_make_subs_parallel(B *b, Sub **subs, AlignContext *ctx, bool has_quals, int ncol);
+Rcpp::NumericMatrix b_make_cluster_quality_matrix(B *b, Sub **subs, Rcpp::NumericMatrix quals, bool has_quals, unsigned int seqlen);
+Rcpp::NumericMatrix b_make_cluster_quality_matrix_parallel(B *b, Sub **subs, Rcpp::NumericMatrix quals, bool has_quals, unsigned int seqlen);
 Rcpp::DataFrame b_make_positional_substitution_df(B *b, Sub **subs, unsigned int seqlen, Rcpp::NumericMatrix errMat, bool use_quals);
 Rcpp::DataFrame b_make_birth_subs_df(B *b, Sub **birth_subs, bool has_quals);
 
@@ -7,7 +7,7 @@ using namespace Rcpp;
 // This function constructs the output "clustering" data.frame for the dada(...) function.
 // This contains core and diagnostic information on each partition (or cluster, or Bi).
 Rcpp::DataFrame b_make_clustering_df(B *b, Sub **subs, Sub **birth_subs, bool has_quals) {
-  unsigned int i, j, r, s, cind, max_reads;
+  unsigned int i, j, k, r, s, cind, index, max_reads;
   Raw *max_raw;
   Sub *sub;
   double q_ave, tot_e;
@@ -90,26 +90,50 @@ Rcpp::DataFrame b_make_clustering_df(B *b, Sub **subs, Sub **birth_subs, bool ha
     
     // Calculate post-hoc pval
     // This is not as exhaustive anymore
+    // The comparisons to the center are in cluster order, as are the terms of the sum
     tot_e = 0.0;
-    for(j=0;j<b->nclust;j++) {
-      if(i != j && b->bi[j]->comp_index.count(b->bi[i]->center->index) > 0) {
-        cind = b->bi[j]->comp_index[b->bi[i]->center->index];
-        tot_e += b->bi[j]->comp[cind].lambda * b->bi[j]->reads;
-//        b->bi[j]->e[b->bi[i]->center->index];
+    index = b->bi[i]->center->index;
+    for(k=0;k<b->raw_comp[index].size();k++) {
+      j = b->raw_comp[index][k].first;
+      if(i != j) {
+        cind = b->raw_comp[index][k].second;
+        tot_e += b->bi[j]->comp_lambda[cind] * b->bi[j]->reads;
       }
     }
-    Rpvals[i] = calc_pA(1+b->bi[i]->reads, tot_e); // Add 1 because calc_pA subtracts 1 (conditional p-val)
+    Rpvals[i] = calc_pA(1+b->bi[i]->reads, tot_e, NULL); // Add 1 because calc_pA subtracts 1 (conditional p-val)
   }
   
   return(Rcpp::DataFrame::create(_["sequence"] = Rseqs, _["abundance"] = Rabunds, _["n0"] = Rzeros, _["n1"] = Rones, _["nunq"] = Rraws, _["pval"] = Rpvals, _["birth_type"] = Rbirth_types, _["birth_pval"] = Rbirth_pvals, _["birth_fold"] = Rbirth_folds, _["birth_ham"] = Rbirth_hams, _["birth_qave"] = Rbirth_qaves));
 }
 
+// Adds the reads of raw to the counts (16 rows by quality, column-major) of each transition
+// from the center to raw, as given by the map in sub. Gaps are excluded from the model.
+static void sub_count_transitions(int *counts, Sub *sub, Raw *center, Raw *raw, bool has_quals) {
+  unsigned int pos0, pos1, nti0, nti1, t_ij;
+  
+  for(pos0=0;pos0<center->length;pos0++) {
+    pos1 = sub->map[pos0];
+    if(pos1 == GAP_GLYPH) { // A gap in the aligned seq
+      continue; // Gaps excluded from the model
+    }
+    nti0 = (int) (center->seq[pos0] - 1);
+    nti1 = (int) (raw->seq[pos1] - 1);
+    // And record these counts
+    t_ij = (4*nti0)+nti1;
+    if(has_quals) {
+      counts[t_ij + 16*raw->qind[pos1]] += raw->reads;
+    } else { 
+      counts[t_ij] += raw->reads; 
+    }
+  }
+}
+
 // Returns a 16xN matrix with the observed counts of each transition categorized by
 // type (row) and quality (column). Assumes qualities start at 0.
 Rcpp::IntegerMatrix b_make_transition_by_quality_matrix(B *b, Sub **subs, bool has_quals, int ncol) {
-  unsigned int i, r, pos0, pos1, nti0, nti1, qual, t_ij;
+  unsigned int i, r;
   Sub *sub;
-  Raw *raw, *center;
+  Raw *raw;
   
   if(!has_quals) { ncol = 1; }
   
@@ -117,7 +141,6 @@ Rcpp::IntegerMatrix b_make_transition_by_quality_matrix(B *b, Sub **subs, bool h
   Rcpp::IntegerMatrix transMat(16, ncol);
 
   for(i=0;i<b->nclust;i++) {
-    center = b->bi[i]->center;
     for(r=0;r<b->bi[i]->nraw;r++) {
       raw = b->bi[i]->raw[r];
       sub = subs[raw->index]; // The sub object includes the map between the center and the raw positions
@@ -125,29 +148,103 @@ Rcpp::IntegerMatrix b_make_transition_by_quality_matrix(B *b, Sub **subs, bool h
         if(VERBOSE) { Rprintf("Warning: No sub for R%i in C%i.\n", r, i); }
         continue;
       }
-      
-      for(pos0=0;pos0<center->length;pos0++) {
-        pos1 = sub->map[pos0];
-        if(pos1 == GAP_GLYPH) { // A gap in the aligned seq
-          continue; // Gaps excluded from the model
-        }
-        nti0 = (int) (center->seq[pos0] - 1);
-        nti1 = (int) (raw->seq[pos1] - 1);
-        qual = round(raw->qual[pos1]);
-        // And record these counts
-        t_ij = (4*nti0)+nti1;
-        if(has_quals) {
-          transMat(t_ij, qual) += raw->reads;
-        } else { 
-          transMat(t_ij, 0) += raw->reads; 
-        }
-      } // for(pos0=0;pos0<center->length;pos0++)
+      sub_count_transitions(&transMat[0], sub, b->bi[i]->center, raw, has_quals);
     } // for(r=0;b->bi[i]->nraw)
   } // for(i=0;i<b->nclust;i++)
   
   return(transMat);
 }
 
+struct SubsParallel : public RcppParallel::Worker
+{
+  // source data
+  B *b;
+  unsigned int *ii;
+  unsigned int *rr;
+  
+  // destination subs, the context they are drawn from, and the transition counts
+  Sub **subs;
+  AlignContext *ctx;
+  bool own_ctx;
+  std::vector<int> counts;
+  
+  // parameters
+  bool has_quals;
+  
+  // initialize with source and destination
+  SubsParallel(B *b, unsigned int *ii, unsigned int *rr, Sub **subs, AlignContext *ctx, bool has_quals, int ncol) 
+    : b(b), ii(ii), rr(rr), subs(subs), ctx(ctx), own_ctx(false), counts(16*ncol, 0), has_quals(has_quals) {}
+  
+  // split with a context and counts of its own
+  SubsParallel(const SubsParallel &w, RcppParallel::Split)
+    : b(w.b), ii(w.ii), rr(w.rr), subs(w.subs), own_ctx(true), counts(w.counts.size(), 0), has_quals(w.has_quals) {
+    ctx = (AlignContext *) malloc(sizeof(AlignContext)); //E
+    if(ctx == NULL) Rcpp::stop("Memory allocation failed.");
+    actx_init(ctx);
+  }
+  
+  ~SubsParallel() {
+    if(own_ctx) {
+      actx_free(ctx);
+      free(ctx);
+    }
+  }
+  
+  // Make the subs of these raws against their centers, and count their transitions
+  void operator()(std::size_t begin, std::size_t end) {
+    Raw *raw;
+    Sub *sub;
+    for(std::size_t j=begin;j<end;j++) {
+      raw = b->bi[ii[j]]->raw[rr[j]];
+      sub = b_stored_sub(b, ii[j], raw, ctx);
+      subs[raw->index] = sub;
+      if(sub) { sub_count_transitions(counts.data(), sub, b->bi[ii[j]]->center, raw, has_quals); }
+    }
+  }
+  
+  // Keep the subs made by rhs alive in this context, and add in its counts
+  void join(const SubsParallel &rhs) {
+    actx_take_subs(ctx, rhs.ctx);
+    for(std::size_t k=0;k<counts.size();k++) { counts[k] += rhs.counts[k]; }
+  }
+};
+
+/* b_make_subs_parallel:
+ Makes the sub of each raw against the center of its Bi in parallel, storing it in
+ subs[raw->index], and returns the transition matrix as b_make_transition_by_quality_matrix.
+ The subs are drawn from ctx, and live until it is released.
+*/
+Rcpp::IntegerMatrix b_make_subs_parallel(B *b, Sub **subs, AlignContext *ctx, bool has_quals, int ncol) {
+  unsigned int i, r, j, t, q;
+  
+  if(!has_quals) { ncol = 1; }
+  
+  // Gather the raws
+  unsigned int *ii = (unsigned int *) malloc(b->nraw * sizeof(unsigned int)); //E
+  unsigned int *rr = (unsigned int *) malloc(b->nraw * sizeof(unsigned int)); //E
+  if(ii==NULL || rr==NULL) Rcpp::stop("Memory allocation failed.");
+  for(i=0,j=0;i<b->nclust;i++) {
+    for(r=0;r<b->bi[i]->nraw;r++,j++) {
+      ii[j] = i;
+      rr[j] = r;
+    }
+  }
+  
+  // Parallelize the sub construction, reducing the per-thread transition counts
+  SubsParallel subsParallel(b, ii, rr, subs, ctx, has_quals, ncol);
+  RcppParallel::parallelReduce(0, j, subsParallel, GRAIN_SIZE);
+  
+  Rcpp::IntegerMatrix transMat(16, ncol);
+  for(t=0;t<16;t++) {
+    for(q=0;q<(unsigned int) ncol;q++) {
+      transMat(t,q) = subsParallel.counts[t + 16*q];
+    }
+  }
+  free(ii);
+  free(rr);
+  return(transMat);
+}
+
 // Makes data.frame of number of substitutions by position on the sequence
 // Also finds the expected number of substitutions at each position, based on quality scores
 //    and the input error matrix
@@ -181,8 +278,7 @@ Rcpp::DataFrame b_make_positional_substitution_df(B *b, Sub **subs, unsigned int
           nts_by_pos(pos) += raw->reads;
           // Add expected error count
           if(use_quals) {
-            // Turn quality into the index in the array
-            qind = round(raw->qual[pos1]);
+            qind = raw->qind[pos1];
           } else {
             qind = 0;
           }
@@ -199,38 +295,83 @@ Rcpp::DataFrame b_make_positional_substitution_df(B *b, Sub **subs, unsigned int
 }
 
 
+// Averages the qualities of the raws in bi at each position of its center into col (of length
+// maxlen), weighting by reads. quals is the column-major quals matrix with qnrow rows.
+static void bi_quality_column(Bi *bi, Sub **subs, const double *quals, unsigned int qnrow, double *col, unsigned int maxlen, unsigned int *nreads) {
+  unsigned int r, pos0, pos1, raw_reads, seqlen;
+  Sub *sub;
+  Raw *raw;
+  
+  seqlen = bi->center->length;
+  for(pos0=0;pos0<seqlen;pos0++) { nreads[pos0] = 0; }
+  for(r=0;r<bi->nraw;r++) {
+    raw = bi->raw[r];
+    raw_reads = raw->reads;
+    sub = subs[raw->index];
+    if(sub) {
+      for(pos0=0;pos0<seqlen;pos0++) {
+        pos1 = sub->map[pos0];
+        if(pos1 == GAP_GLYPH) { // Gap
+          continue;
+        }
+        nreads[pos0] += raw_reads;
+        col[pos0] += (((float) quals[raw->index*qnrow + pos1]) * raw_reads);
+      }
+    }
+  } // for(r=0;r<bi->nraw;r++)
+  for(pos0=0;pos0<seqlen;pos0++) { col[pos0] = col[pos0]/nreads[pos0]; }
+  for(pos0=seqlen;pos0<maxlen;pos0++) { col[pos0] = NA_REAL; }
+}
+
 // Calculate the average positional qualities for each cluster/partition/Bi
+// Qualities are read from the input quals matrix, which has a column for each raw.
 // Return position (rows) by Bi (columns) matrix.
-Rcpp::NumericMatrix b_make_cluster_quality_matrix(B *b, Sub **subs, bool has_quals, unsigned int maxlen) {
-  unsigned int i, r, pos0, pos1, raw_reads, seqlen;
+Rcpp::NumericMatrix b_make_cluster_quality_matrix(B *b, Sub **subs, Rcpp::NumericMatrix quals, bool has_quals, unsigned int maxlen) {
+  unsigned int i;
   std::vector<unsigned int> nreads(maxlen);
-  Sub *sub;
-  Raw *raw;
   Rcpp::NumericMatrix Rquals(maxlen, b->nclust);
   
   if(has_quals) {
     for(i=0;i<b->nclust;i++) {
-      seqlen = b->bi[i]->center->length;
-      for(pos0=0;pos0<seqlen;pos0++) { nreads[pos0] = 0; }
-      for(r=0;r<b->bi[i]->nraw;r++) {
-        raw = b->bi[i]->raw[r];
-        raw_reads = raw->reads;
-        sub = subs[raw->index];
-        if(sub) {
-          for(pos0=0;pos0<seqlen;pos0++) {
-            pos1 = sub->map[pos0];
-            if(pos1 == GAP_GLYPH) { // Gap
-              continue;
-            }
-            nreads[pos0] += raw_reads;
-            Rquals(pos0,i) += (raw->qual[pos1] * raw_reads);
-          }
-        }
-      } // for(pos0=0;pos0<len1;pos0++)
-      for(pos0=0;pos0<seqlen;pos0++) { Rquals(pos0,i) = Rquals(pos0,i)/nreads[pos0]; }
-      for(pos0=seqlen;pos0<maxlen;pos0++) { Rquals(pos0,i) = NA_REAL; }
+      bi_quality_column(b->bi[i], subs, &quals[0], quals.nrow(), &Rquals[i*maxlen], maxlen, nreads.data());
+    }
+  }
+  
+  return(Rquals);
+}
+
+struct ClusterQualityParallel : public RcppParallel::Worker
+{
+  // source data
+  B *b;
+  Sub **subs;
+  const RcppParallel::RMatrix<double> quals;
+  
+  // output
+  RcppParallel::RMatrix<double> Rquals;
+  
+  // initialize with source and destination
+  ClusterQualityParallel(B *b, Sub **subs, const Rcpp::NumericMatrix &quals, Rcpp::NumericMatrix &Rquals) 
+    : b(b), subs(subs), quals(quals), Rquals(Rquals) {}
+  
+  // Each Bi is a column of the output
+  void operator()(std::size_t begin, std::size_t end) {
+    unsigned int maxlen = Rquals.nrow();
+    std::vector<unsigned int> nreads(maxlen);
+    for(std::size_t i=begin;i<end;i++) {
+      bi_quality_column(b->bi[i], subs, quals.begin(), quals.nrow(), &Rquals(0,i), maxlen, nreads.data());
     }
   }
+};
+
+// As b_make_cluster_quality_matrix, with the Bis averaged in parallel.
+Rcpp::NumericMatrix b_make_cluster_quality_matrix_parallel(B *b, Sub **subs, Rcpp::NumericMatrix quals, bool has_quals, unsigned int maxlen) {
+  Rcpp::NumericMatrix Rquals(maxlen, b->nclust);
+  
+  if(has_quals) {
+    ClusterQualityParallel clusterQualityParallel(b, subs, quals, Rquals);
+    RcppParallel::parallelFor(0, b->nclust, clusterQualityParallel, 1);
+  }
   
   return(Rquals);
 }
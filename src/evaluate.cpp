@@ -18,6 +18,8 @@ using namespace Rcpp;
 Rcpp::CharacterVector C_nwalign(std::string s1, std::string s2, int match, int mismatch, int gap_p, int homo_gap_p, int band, bool endsfree) {
   int i, j;
   char **al;
+  AlignContext ctx;
+  actx_init(&ctx);
   // Make integer-ized c-style sequence strings
   char *seq1 = (char *) malloc(s1.size()+1); //E
   char *seq2 = (char *) malloc(s2.size()+1); //E
@@ -35,15 +37,15 @@ Rcpp::CharacterVector C_nwalign(std::string s1, std::string s2, int match, int m
   // Perform alignment and convert back to ACGT
   if(endsfree) {
     if(gap_p == homo_gap_p) {
-      al = nwalign_endsfree(seq1, seq2, c_score, gap_p, band);
+      al = nwalign_endsfree(seq1, seq2, c_score, gap_p, band, &ctx);
     } else {
-      al = nwalign_endsfree_homo(seq1, seq2, c_score, gap_p, homo_gap_p, band);
+      al = nwalign_endsfree_homo(seq1, seq2, c_score, gap_p, homo_gap_p, band, &ctx);
     }
   } else {
     if(gap_p != homo_gap_p) {
       Rprintf("Warning: A separate homopolymer gap penalty isn't implemented when endsfree=FALSE.\n\tAll gaps will be penalized by the regular gap penalty.\n");
     }
-    al = nwalign(seq1, seq2, c_score, gap_p, band);
+    al = nwalign(seq1, seq2, c_score, gap_p, band, &ctx);
   }
   int2nt(al[0], al[0]);
   int2nt(al[1], al[1]);
@@ -54,9 +56,7 @@ Rcpp::CharacterVector C_nwalign(std::string s1, std::string s2, int match, int m
   // Clean up
   free(seq1);
   free(seq2);
-  free(al[0]);
-  free(al[1]);
-  free(al);
+  actx_free(&ctx);
   return(rval);
 }
 
@@ -210,7 +210,7 @@ Rcpp::LogicalVector C_isACGT(std::vector<std::string> seqs) {
 //'  A vector containing all unique sequences in the data set.
 //'  Only A/C/G/T allowed.
 //'  
-//' @param kmer_size (Required). A \code{numeric(1)}. The size of the kmer to test (eg. 5-mer).
+//' @param kmer_size (Required). A \code{numeric(1)}. The size of the kmer to test (eg. 5-mer). At most 8.
 //' 
 //' @param score (Required). Numeric matrix (4x4).
 //' The score matrix used during the alignment. Coerced to integer.
@@ -233,6 +233,7 @@ Rcpp::LogicalVector C_isACGT(std::vector<std::string> seqs) {
 // [[Rcpp::export]]
 Rcpp::DataFrame evaluate_kmers(std::vector< std::string > seqs, int kmer_size, Rcpp::NumericMatrix score, int gap, int band, unsigned int max_aligns) {
   int i, j, n_iters, stride, minlen, nseqs, len1 = 0, len2 = 0;
+  unsigned int nkmer2;
   char *seq1, *seq2;
 
   int c_score[4][4];
@@ -260,6 +261,8 @@ Rcpp::DataFrame evaluate_kmers(std::vector< std::string > seqs, int kmer_size, R
   Sub *sub;
   uint16_t *kv1;
   uint16_t *kv2;
+  AlignContext ctx;
+  actx_init(&ctx);
 
   for(i=0;i<nseqs;i=i+stride) {
     seq1 = intstr(seqs[i].c_str());
@@ -268,14 +271,16 @@ Rcpp::DataFrame evaluate_kmers(std::vector< std::string > seqs, int kmer_size, R
     for(j=i+1;j<nseqs;j=j+stride) {
       seq2 = intstr(seqs[j].c_str());
       len2 = strlen(seq2);
-      kv2 = get_kmer(seq2, kmer_size);
+      kv2 = get_kmer_pairs(seq2, kmer_size, &nkmer2);
 
       minlen = (len1 < len2 ? len1 : len2);
 
-      sub = al2subs(nwalign_endsfree(seq1, seq2, c_score, gap, band));
+      nwalign_endsfree_path(seq1, seq2, c_score, gap, band, &ctx);
+      sub = path2sub(seq1, seq2, &ctx);
       adist[npairs] = ((double) sub->nsubs)/((double) minlen);
+      actx_release_subs(&ctx);
       
-      kdist[npairs] = kmer_dist(kv1, len1, kv2, len2, kmer_size);
+      kdist[npairs] = kmer_dist(kv1, len1, kv2, nkmer2, len2, kmer_size);
       npairs++;
       free(kv2);
       free(seq2);
@@ -285,6 +290,7 @@ Rcpp::DataFrame evaluate_kmers(std::vector< std::string > seqs, int kmer_size, R
     free(seq1);
     if(npairs >= max_aligns) { break; }
   }
+  actx_free(&ctx);
   
   if(npairs != max_aligns) {
     Rcpp::Rcout << "Warning: Failed to reach requested number of alignments.\n";
@@ -313,3 +319,22 @@ Rcpp::DataFrame C_subpos(std::string s1, std::string s2) {
   
   return(Rcpp::DataFrame::create(_["pos"]=position, _["err"]=error));
 }
+
+//------------------------------------------------------------------
+// Exposes the poisson upper tail used by the abundance p-values to R, to test it against ppois.
+// 
+// @param n An \code{integer} of read counts.
+// @param E A \code{numeric} of expected read counts, of the same length.
+// 
+// @return A \code{numeric}. P(X >= n) for X ~ Pois(E), for each n and E.
+// 
+// [[Rcpp::export]]
+Rcpp::NumericVector C_ppois_upper(std::vector<int> n, std::vector<double> E) {
+  unsigned int i;
+  if(n.size() != E.size()) { Rcpp::stop("n and E must be the same length."); }
+  Rcpp::NumericVector pval(n.size());
+  for(i=0;i<n.size();i++) {
+    pval[i] = ppois_upper(n[i], E[i]);
+  }
+  return pval;
+}
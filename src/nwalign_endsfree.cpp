@@ -1,34 +1,219 @@
 #include <string.h>
 #include <stdlib.h>
 #include "dada.h"
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define KMER_SIMD
+#include <immintrin.h>
+#endif
 // [[Rcpp::interfaces(cpp)]]
 
 /************* KMERS *****************
  * Current Kmer implementation assumes A/C/G/T only.
  */
 
-double kmer_dist(uint16_t *kv1, int len1, uint16_t *kv2, int len2, int k) {
-  int i;
-  int n_kmer = 1 << (2*k); // 4^k kmers
-  uint16_t dotsum = 0;
-  double dot = 0.0;
+/* kmer_dot:
+ Sum over the kmer pairs kp2 of the min of their count and the count in the
+ dense kmer vector kv1. Vectorized versions are compiled for the instruction
+ sets below and picked at load time by what the CPU supports. Each reads the
+ (kmer, count) pairs as 32-bit words (kmer in the low half on x86), looks up or
+ gathers kv1 at those kmers, and accumulates the mins in 32-bit lanes.
+ The gathers read 32 bits at each kmer, hence the padding entry in get_kmer.
+*/
+typedef uint32_t (*kmer_dot_fn)(const uint16_t *kv1, const uint16_t *kp2, unsigned int n2);
+
+static uint32_t kmer_dot_scalar(const uint16_t *kv1, const uint16_t *kp2, unsigned int n2) {
+  unsigned int i;
+  uint32_t dotsum = 0;
+  for(i=0;i<n2; i++) {
+    dotsum += (kv1[kp2[2*i]] < kp2[2*i+1] ? kv1[kp2[2*i]] : kp2[2*i+1]);
+  }
+  return dotsum;
+}
+
+#ifdef KMER_SIMD
+__attribute__((target("sse4.1")))
+static uint32_t kmer_dot_sse41(const uint16_t *kv1, const uint16_t *kp2, unsigned int n2) {
+  unsigned int i;
+  __m128i pairs, counts, counts1, acc = _mm_setzero_si128();
+  for(i=0;i+4<=n2;i+=4) {
+    pairs = _mm_loadu_si128((const __m128i *) &kp2[2*i]);
+    counts = _mm_srli_epi32(pairs, 16);
+    counts1 = _mm_setr_epi32(kv1[kp2[2*i]], kv1[kp2[2*i+2]], kv1[kp2[2*i+4]], kv1[kp2[2*i+6]]);
+    acc = _mm_add_epi32(acc, _mm_min_epu32(counts, counts1));
+  }
+  acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, 0x4E));
+  acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, 0xB1));
+  return (uint32_t) _mm_cvtsi128_si32(acc) + kmer_dot_scalar(kv1, &kp2[2*i], n2-i);
+}
+
+__attribute__((target("avx2")))
+static uint32_t kmer_dot_avx2(const uint16_t *kv1, const uint16_t *kp2, unsigned int n2) {
+  unsigned int i;
+  const __m256i lo16 = _mm256_set1_epi32(0xFFFF);
+  __m256i pairs, counts, counts1, acc = _mm256_setzero_si256();
+  __m128i acc128;
+  for(i=0;i+8<=n2;i+=8) {
+    pairs = _mm256_loadu_si256((const __m256i *) &kp2[2*i]);
+    counts = _mm256_srli_epi32(pairs, 16);
+    counts1 = _mm256_and_si256(_mm256_i32gather_epi32((const int *) kv1, _mm256_and_si256(pairs, lo16), 2), lo16);
+    acc = _mm256_add_epi32(acc, _mm256_min_epu32(counts, counts1));
+  }
+  acc128 = _mm_add_epi32(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+  acc128 = _mm_add_epi32(acc128, _mm_shuffle_epi32(acc128, 0x4E));
+  acc128 = _mm_add_epi32(acc128, _mm_shuffle_epi32(acc128, 0xB1));
+  return (uint32_t) _mm_cvtsi128_si32(acc128) + kmer_dot_scalar(kv1, &kp2[2*i], n2-i);
+}
+
+__attribute__((target("avx512f")))
+static uint32_t kmer_dot_avx512(const uint16_t *kv1, const uint16_t *kp2, unsigned int n2) {
+  unsigned int i;
+  const __m512i lo16 = _mm512_set1_epi32(0xFFFF), zero = _mm512_setzero_si512();
+  __m512i pairs, counts, counts1, acc = _mm512_setzero_si512();
+  __m256i acc256;
+  __m128i acc128;
+  // The fully masked-in maskz/mask forms are used as the plain ones start from an uninitialized vector
+  for(i=0;i+16<=n2;i+=16) {
+    pairs = _mm512_loadu_si512((const void *) &kp2[2*i]);
+    counts = _mm512_maskz_srli_epi32(0xFFFF, pairs, 16);
+    counts1 = _mm512_and_si512(_mm512_mask_i32gather_epi32(zero, 0xFFFF, _mm512_and_si512(pairs, lo16), (const void *) kv1, 2), lo16);
+    acc = _mm512_add_epi32(acc, _mm512_maskz_min_epu32(0xFFFF, counts, counts1));
+  }
+  acc256 = _mm256_add_epi32(_mm512_maskz_extracti64x4_epi64(0xFF, acc, 0), _mm512_maskz_extracti64x4_epi64(0xFF, acc, 1));
+  acc128 = _mm_add_epi32(_mm256_castsi256_si128(acc256), _mm256_extracti128_si256(acc256, 1));
+  acc128 = _mm_add_epi32(acc128, _mm_shuffle_epi32(acc128, 0x4E));
+  acc128 = _mm_add_epi32(acc128, _mm_shuffle_epi32(acc128, 0xB1));
+  return (uint32_t) _mm_cvtsi128_si32(acc128) + kmer_dot_scalar(kv1, &kp2[2*i], n2-i);
+}
+#endif
+
+static kmer_dot_fn kmer_dot_select() {
+#ifdef KMER_SIMD
+  __builtin_cpu_init();
+  if(__builtin_cpu_supports("avx512f")) { return kmer_dot_avx512; }
+  if(__builtin_cpu_supports("avx2")) { return kmer_dot_avx2; }
+  if(__builtin_cpu_supports("sse4.1")) { return kmer_dot_sse41; }
+#endif
+  return kmer_dot_scalar;
+}
+
+static const kmer_dot_fn kmer_dot = kmer_dot_select();
+
+// Kmer distance between the sequence with dense kmer vector kv1 (see get_kmer)
+// and the sequence with n2 sorted kmer pairs kp2 (see get_kmer_pairs).
+// Only the kmers present in the second sequence are visited.
+double kmer_dist(uint16_t *kv1, int len1, uint16_t *kp2, unsigned int n2, int len2, int k) {
+  return kmer_dist_shared(kmer_dot(kv1, kp2, n2), len1, len2, k);
+}
+
+/* kmer_shared:
+ The number of kmers shared by raw0, with dense kmer vector kv0, and raw1,
+ ie. the sum over kmers of the min of their counts in each. Safe to call from worker threads.
+ Where kmer_dot has no vectorized version the raws carry kmer presence bitmaps (see get_kmer_bits),
+ and the count is the popcount of their intersection plus, for the kmers seen more than once in raw1,
+ the excess of the min over 1. That beats the dense loop over all 4^k kmers, which the pairs
+ lookups alone do not without gathers.
+*/
+uint32_t kmer_shared(const uint16_t *kv0, const Raw *raw0, const Raw *raw1) {
+  unsigned int i;
+  uint16_t c0, *multi;
+  uint32_t dotsum = 0;
   
-  for(i=0;i<n_kmer; i++) {
-    dotsum += (kv1[i] < kv2[i] ? kv1[i] : kv2[i]);
+  if(!raw0->kmer_bits || !raw1->kmer_bits) {
+    return kmer_dot(kv0, raw1->kmer, raw1->nkmer);
+  }
+  for(i=0;i<KMER_NWORDS;i++) {
+    dotsum += __builtin_popcountll(raw0->kmer_bits[i] & raw1->kmer_bits[i]);
   }
+  multi = (uint16_t *) &raw1->kmer_bits[KMER_NWORDS];
+  for(i=0;i<raw1->nkmer_multi;i++) {
+    c0 = kv0[multi[2*i]];
+    if(c0) { dotsum += (c0 < multi[2*i+1] ? c0 : multi[2*i+1]) - 1; }
+  }
+  return dotsum;
+}
+
+// Fills kv, of KMER_VLEN entries, with the dense kmer vector (see get_kmer) of the n kmer pairs kp
+void kmer_pairs_dense(const uint16_t *kp, unsigned int n, uint16_t *kv) {
+  memset(kv, 0, KMER_VLEN * sizeof(uint16_t));
+  for(unsigned int i=0;i<n;i++) { kv[kp[2*i]] = kp[2*i+1]; }
+}
 
+// Kmer distance between sequences of lengths len1 and len2 that share dotsum kmers,
+// ie. the sum over kmers of the min of their counts in each.
+double kmer_dist_shared(uint32_t dotsum, int len1, int len2, int k) {
+  double dot = 0.0;
+  
   dot = ((double) dotsum)/((len1 < len2 ? len1 : len2) - k + 1.);
   return (1. - dot);
 }
 
+/* min_nsubs:
+ A lower bound on the number of substitutions in the alignment of raw1 to raw0
+ that raw_align would return, from the dotsum kmers they share (see kmer_dist_shared).
+ That alignment scores at least as well as the ungapped one with free end gaps.
+ With s substitutions and g gapped columns inside the alignment:
+   matches <= dot + (k-1)(s+g+1) as each run of l matches adds l-k+1 shared kmers,
+   matches <= minlen - s, and matches <= (len0+len1-g)/2 - s,
+ and the bound is the smallest s for which the best score over g allowed by these
+ still reaches the ungapped score. That best score is concave and piecewise linear
+ in g, so it is found at g=0 or where two of the limits on matches cross.
+ Returns 0 if the scores give no bound, ie. matches don't score or gaps are free.
+ */
+unsigned int min_nsubs(Raw *raw0, uint32_t dotsum, Raw *raw1, int score[4][4], int gap_p, int homo_gap_p) {
+  unsigned int pos, s, c, minlen = (raw0->length < raw1->length ? raw0->length : raw1->length);
+  int i, j, match, mismatch, gap, ungapped = 0;
+  double dot, kmatch, nmatch, pmatch, nmax, g[4], sc, best;
+  const double k1 = KMER_SIZE - 1.;
+  
+  // Score as raw_align does, with the best match/mismatch and cheapest gap
+  gap = (homo_gap_p != gap_p && homo_gap_p <= 0 && homo_gap_p > gap_p) ? homo_gap_p : gap_p;
+  match = score[0][0];
+  mismatch = score[0][1];
+  for(i=0;i<4;i++) {
+    for(j=0;j<4;j++) {
+      if(i==j && score[i][j] > match) { match = score[i][j]; }
+      if(i!=j && score[i][j] > mismatch) { mismatch = score[i][j]; }
+    }
+  }
+  for(pos=0;pos<minlen;pos++) {
+    ungapped += score[raw0->seq[pos]-1][raw1->seq[pos]-1];
+  }
+  if(match <= 0 || gap >= 0) { return 0; }
+  
+  // get_kmer leaves out the last kmer of each sequence
+  dot = dotsum + 2.;
+  for(s=0;s<minlen;s++) {
+    kmatch = dot + k1*(s+1);
+    nmatch = minlen - s;
+    pmatch = (raw0->length + raw1->length)/2. - s;
+    g[0] = 0.;
+    g[1] = (nmatch - kmatch)/k1;
+    g[2] = (pmatch - kmatch)/(k1 + 0.5);
+    g[3] = 2.*(pmatch - nmatch);
+    best = -INFINITY;
+    for(c=0;c<4;c++) {
+      if(g[c] < 0) { continue; }
+      nmax = kmatch + k1*g[c];
+      if(nmatch < nmax) { nmax = nmatch; }
+      if(pmatch - g[c]/2. < nmax) { nmax = pmatch - g[c]/2.; }
+      sc = match*nmax + gap*g[c];
+      if(sc > best) { best = sc; }
+    }
+    if(best + mismatch*(double)s + 1e-6 >= ungapped) { break; }
+  }
+  return s;
+}
+
+
 uint16_t *get_kmer(char *seq, int k) {  // Assumes a clean seq (just 1s,2s,3s,4s)
   int i, j, nti;
   int len = strlen(seq);
   size_t kmer = 0;
   size_t n_kmers = (1 << (2*k));  // 4^k kmers
-  uint16_t *kvec = (uint16_t *) malloc(n_kmers * sizeof(uint16_t)); //E
+  // One extra zero entry so kmer_dot can gather 32 bits at the last kmer
+  uint16_t *kvec = (uint16_t *) malloc((n_kmers+1) * sizeof(uint16_t)); //E
   if (kvec == NULL)  Rcpp::stop("Memory allocation failed.");
-  for(kmer=0;kmer<n_kmers;kmer++) { kvec[kmer] = 0; }
+  for(kmer=0;kmer<=n_kmers;kmer++) { kvec[kmer] = 0; }
 
   if(len <=0 || len > SEQLEN) {
     Rcpp::stop("Unexpected sequence length.");
@@ -59,33 +244,289 @@ uint16_t *get_kmer(char *seq, int k) {  // Assumes a clean seq (just 1s,2s,3s,4s
   return kvec;
 }
 
+// Compact form of the kmer vector: the kmers present in the sequence as (kmer, count)
+// pairs stored consecutively and sorted by kmer. The number of pairs is put in nkmer.
+uint16_t *get_kmer_pairs(char *seq, int k, unsigned int *nkmer) {
+  size_t kmer, n_kmers = (1 << (2*k));  // 4^k kmers
+  unsigned int n = 0;
+  uint16_t *kvec, *kpairs;
+  
+  if(k > 8) { Rcpp::stop("Kmer size too large for kmer pairs (max 8)."); } // kmer must fit in uint16_t
+  kvec = get_kmer(seq, k);
+  for(kmer=0;kmer<n_kmers;kmer++) {
+    if(kvec[kmer]) { n++; }
+  }
+  kpairs = (uint16_t *) malloc(2 * n * sizeof(uint16_t)); //E
+  if (kpairs == NULL && n > 0)  Rcpp::stop("Memory allocation failed.");
+  for(kmer=0,n=0;kmer<n_kmers;kmer++) {
+    if(kvec[kmer]) {
+      kpairs[2*n] = kmer;
+      kpairs[2*n+1] = kvec[kmer];
+      n++;
+    }
+  }
+  free(kvec);
+  *nkmer = n;
+  return kpairs;
+}
+
+// The presence bitmap (KMER_NWORDS words) of the n kmer pairs kp, followed in the same block by
+// the *nmulti pairs with counts above 1, for kmer_shared. NULL where kmer_dot is vectorized,
+// as the bitmaps would go unused. The block is freed with free().
+uint64_t *get_kmer_bits(const uint16_t *kp, unsigned int n, unsigned int *nmulti) {
+  unsigned int i, m = 0;
+  uint64_t *bits;
+  uint16_t *multi;
+  
+  *nmulti = 0;
+  if(kmer_dot != kmer_dot_scalar) { return NULL; }
+  for(i=0;i<n;i++) {
+    if(kp[2*i+1] > 1) { m++; }
+  }
+  bits = (uint64_t *) calloc(1, KMER_NWORDS * sizeof(uint64_t) + 2 * m * sizeof(uint16_t)); //E
+  if (bits == NULL)  Rcpp::stop("Memory allocation failed.");
+  multi = (uint16_t *) &bits[KMER_NWORDS];
+  for(i=0,m=0;i<n;i++) {
+    bits[kp[2*i]/64] |= ((uint64_t) 1) << (kp[2*i]%64);
+    if(kp[2*i+1] > 1) {
+      multi[2*m] = kp[2*i];
+      multi[2*m+1] = kp[2*i+1];
+      m++;
+    }
+  }
+  *nmulti = m;
+  return bits;
+}
+
+
 /************* ALIGNMENT *****************
  * Banded Needleman Wunsch
  */
 
-char **raw_align(Raw *raw1, Raw *raw2, int score[4][4], int gap_p, int homo_gap_p, bool use_kmers, double kdist_cutoff, int band, bool vectorized_alignment) {
-  char **al;
+/************* ALIGNER CONTEXT *****************
+ * Scratch space for the aligners, grown as needed and reused between alignments.
+ */
+
+void actx_init(AlignContext *ctx) {
+  memset(ctx, 0, sizeof(AlignContext));
+}
+
+void actx_free(AlignContext *ctx) {
+  free(ctx->d);
+  free(ctx->p);
+  free(ctx->diag);
+  free(ctx->homo);
+  free(ctx->gaps);
+  free(ctx->path);
+  free(ctx->subs);
+  free(ctx->alb);
+  free(ctx->lseq);
+  free(ctx->lpath);
+  actx_release_subs(ctx);
+  while(ctx->spare) {
+    SubChunk *chunk = ctx->spare;
+    ctx->spare = chunk->next;
+    free(chunk);
+  }
+  actx_init(ctx);
+}
+
+// Holds the context of a thread, freed when the thread exits
+struct ThreadContext {
+  AlignContext ctx;
+  ThreadContext() { actx_init(&ctx); }
+  ~ThreadContext() { actx_free(&ctx); }
+};
+
+// The context of the calling thread, for the parallel workers. The RcppParallel threads persist,
+// so its buffers are reused by all the ranges and calls they run. Subs drawn from it must be
+// released before the range returns.
+AlignContext *actx_thread() {
+  static thread_local ThreadContext tctx;
+  return &tctx.ctx;
+}
+
+// Returns the buffer *buf, grown to at least size bytes if needed. The contents are not kept.
+void *actx_reserve(void **buf, size_t *buf_size, size_t size) {
+  if(size > *buf_size) {
+    free(*buf);
+    *buf = malloc(size); //E
+    if(*buf == NULL) Rcpp::stop("Memory allocation failed.");
+    *buf_size = size;
+  }
+  return *buf;
+}
+
+// Returns all the Subs drawn from the pool of ctx to it. Their chunks are kept for reuse.
+void actx_release_subs(AlignContext *ctx) {
+  SubChunk *chunk;
+  while(ctx->pool) {
+    chunk = ctx->pool;
+    ctx->pool = chunk->next;
+    chunk->used = 0;
+    chunk->next = ctx->spare;
+    ctx->spare = chunk;
+  }
+}
+
+// Moves the Subs drawn from the pool of from into the pool of ctx, so they live as long as ctx
+void actx_take_subs(AlignContext *ctx, AlignContext *from) {
+  SubChunk *last;
+  if(!from->pool) { return; }
+  for(last=from->pool; last->next; last=last->next) { ; }
+  if(ctx->pool) { // ctx keeps drawing from its current chunk
+    last->next = ctx->pool->next;
+    ctx->pool->next = from->pool;
+  } else {
+    ctx->pool = from->pool;
+  }
+  from->pool = NULL;
+}
+
+// Hands out size bytes (8-byte aligned) from the pool of ctx, taking a new chunk if needed
+static void *actx_pool_alloc(AlignContext *ctx, size_t size) {
+  SubChunk *chunk, **pchunk;
+  void *mem;
+  size = (size + 7) & ~((size_t) 7);
+  
+  chunk = ctx->pool;
+  if(!chunk || chunk->used + size > chunk->size) {
+    // Reuse a spare chunk big enough if there is one, otherwise make one
+    for(pchunk=&ctx->spare; *pchunk && (*pchunk)->size < size; pchunk=&(*pchunk)->next) { ; }
+    if(*pchunk) {
+      chunk = *pchunk;
+      *pchunk = chunk->next;
+    } else {
+      chunk = (SubChunk *) malloc(sizeof(SubChunk) + (size > SUBPOOL_CHUNK ? size : SUBPOOL_CHUNK)); //E
+      if(chunk == NULL) Rcpp::stop("Memory allocation failed.");
+      chunk->size = (size > SUBPOOL_CHUNK ? size : SUBPOOL_CHUNK);
+      chunk->used = 0;
+    }
+    chunk->next = ctx->pool;
+    ctx->pool = chunk;
+  }
+  mem = (char *) (chunk + 1) + chunk->used;
+  chunk->used += size;
+  return mem;
+}
+
+// Points ctx->al at room in the context for two alignment strings of length len_al.
+char **actx_alignment(AlignContext *ctx, size_t len_al) {
+  ctx->al[0] = (char *) actx_reserve(&ctx->alb, &ctx->alb_size, 2 * (len_al+1));
+  ctx->al[1] = ctx->al[0] + len_al+1;
+  return ctx->al;
+}
+
+// True if the score matrix reduces to a match score on the diagonal and a mismatch score off it
+bool score_match_mismatch(int score[4][4]) {
+  int i, j;
+  for(i=0;i<4;i++) {
+    for(j=0;j<4;j++) {
+      if(score[i][j] != (i==j ? score[0][0] : score[0][1])) { return false; }
+    }
+  }
+  return true;
+}
+
+// Aligns raw1 to raw2, leaving the alignment path in ctx. Returns false if outside the kmer threshold.
+bool raw_align(Raw *raw1, Raw *raw2, int score[4][4], int gap_p, int homo_gap_p, bool use_kmers, double kdist_cutoff, int band, bool vectorized_alignment, AlignContext *ctx) {
   double kdist;
   
+  ctx->nw_narrow = 0;
   if(use_kmers) {
-    kdist = kmer_dist(raw1->kmer, raw1->length, raw2->kmer, raw2->length, KMER_SIZE);
+    uint16_t kv1[KMER_VLEN];
+    kmer_pairs_dense(raw1->kmer, raw1->nkmer, kv1);
+    kdist = kmer_dist_shared(kmer_shared(kv1, raw1, raw2), raw1->length, raw2->length, KMER_SIZE);
+    if(kdist > kdist_cutoff) { return false; }
   }
   
-  if(use_kmers && kdist > kdist_cutoff) {
-    al = NULL;
-  } else if(vectorized_alignment) { // ASSUMES SCORE MATRIX REDUCES TO MATCH/MISMATCH
-    al = nwalign_vectorized2(raw1->seq, raw2->seq, (int16_t) score[0][0], (int16_t) score[0][1], (int16_t) gap_p, 0, band);
+  if(vectorized_alignment && homo_gap_p != gap_p && homo_gap_p <= 0) {
+    nwalign_vectorized2_score_path(raw1->seq, raw2->seq, raw1->homo, raw2->homo, score, (int16_t) gap_p, (int16_t) homo_gap_p, 0, band, ctx);
+  } else if(vectorized_alignment && !score_match_mismatch(score)) {
+    nwalign_vectorized2_score_path(raw1->seq, raw2->seq, NULL, NULL, score, (int16_t) gap_p, (int16_t) gap_p, 0, band, ctx);
+  } else if(vectorized_alignment) {
+    nwalign_vectorized2_path(raw1->seq, raw2->seq, (int16_t) score[0][0], (int16_t) score[0][1], (int16_t) gap_p, 0, band, ctx);
   } else if(homo_gap_p != gap_p && homo_gap_p <= 0) {
-    al = nwalign_endsfree_homo(raw1->seq, raw2->seq, score, gap_p, homo_gap_p, band);
+    nwalign_endsfree_homo_path(raw1->seq, raw2->seq, raw1->homo, raw2->homo, score, gap_p, homo_gap_p, band, ctx);
   } else {
-    al = nwalign_endsfree(raw1->seq, raw2->seq, score, gap_p, band);
+    nwalign_endsfree_path(raw1->seq, raw2->seq, score, gap_p, band, ctx);
   }
 
+  return true;
+}
+
+// Aligns center to each of the n raws, which must have the same length, as raw_align does with
+// vectorized_alignment but ALIGN_LANES at a time. The path of raws[k] is recovered by actx_lane_path.
+void align_center_batch(Raw *center, Raw **raws, unsigned int n, int score[4][4], int gap_p, int band, AlignContext *ctx) {
+  const char *seqs[ALIGN_LANES];
+  unsigned int k;
+  
+  if(n > ALIGN_LANES) { Rcpp::stop("Too many raws for one batch alignment."); }
+  for(k=0;k<n;k++) { seqs[k] = raws[k]->seq; }
+  nwalign_vectorized2_batch_path(center->seq, seqs, n, (int16_t) score[0][0], (int16_t) score[0][1], (int16_t) gap_p, 0, band, ctx);
+}
+
+// Makes the path of lane k of the last batch alignment the path in ctx, as if aligned alone
+void actx_lane_path(AlignContext *ctx, unsigned int k) {
+  size_t len_al = ctx->lane_len_path[k];
+  char *path = (char *) actx_reserve(&ctx->path, &ctx->path_size, len_al);
+  memcpy(path, (char *) ctx->lpath + k*ctx->lpath_stride, len_al);
+  ctx->len_path = len_al;
+}
+
+// Appends the path in ctx to runs, as runs of the same move: (length << 2) | move
+void path_pack(AlignContext *ctx, std::vector<uint16_t> &runs) {
+  size_t k, len;
+  const char *path = (const char *) ctx->path;
+  
+  for(k=0;k<ctx->len_path;k+=len) {
+    for(len=1; k+len<ctx->len_path && path[k+len]==path[k]; len++) { ; }
+    runs.push_back((uint16_t) ((len << 2) | path[k]));
+  }
+}
+
+// Restores into ctx a path packed by path_pack
+void path_unpack(const uint16_t *runs, size_t nrun, AlignContext *ctx) {
+  size_t r, len_al = 0;
+  for(r=0;r<nrun;r++) { len_al += runs[r] >> 2; }
+  char *path = (char *) actx_reserve(&ctx->path, &ctx->path_size, len_al);
+  
+  for(r=0;r<nrun;r++) {
+    memset(path, runs[r] & 3, runs[r] >> 2);
+    path += runs[r] >> 2;
+  }
+  ctx->len_path = len_al;
+}
+
+// Writes the alignment strings of s1 and s2 along the path in ctx, returns them (owned by ctx)
+char **path2al(const char *s1, const char *s2, AlignContext *ctx) {
+  size_t k, len_al = ctx->len_path;
+  const char *path = (const char *) ctx->path;
+  char **al = actx_alignment(ctx, len_al);
+  
+  for(k=0;k<len_al;k++) {
+    switch ( path[len_al-1-k] ) {
+    case 1:
+      al[0][k] = *s1++;
+      al[1][k] = *s2++;
+      break;
+    case 2:
+      al[0][k] = '-';
+      al[1][k] = *s2++;
+      break;
+    case 3:
+      al[0][k] = *s1++;
+      al[1][k] = '-';
+      break;
+    }
+  }
+  al[0][len_al] = '\0';
+  al[1][len_al] = '\0';
   return al;
 }
 
 /* note: input sequence must end with string termination character, '\0' */
-char **nwalign_endsfree(const char *s1, const char *s2, int score[4][4], int gap_p, int band) {
+void nwalign_endsfree_path(const char *s1, const char *s2, int score[4][4], int gap_p, int band, AlignContext *ctx) {
   static size_t nnw = 0;
   int i, j;
   int l, r;
@@ -95,9 +536,8 @@ char **nwalign_endsfree(const char *s1, const char *s2, int score[4][4], int gap
   
   unsigned int nrow = len1+1;
   unsigned int ncol = len2+1;
-  int *d = (int *) malloc(nrow * ncol * sizeof(int)); //E
-  int *p = (int *) malloc(nrow * ncol * sizeof(int)); //E
-  if(d == NULL || p == NULL) Rcpp::stop("Memory allocation failed.");
+  int *d = (int *) actx_reserve(&ctx->d, &ctx->d_size, nrow * ncol * sizeof(int));
+  int *p = (int *) actx_reserve(&ctx->p, &ctx->p_size, nrow * ncol * sizeof(int));
   
   // Fill out left columns of d, p.
   for (i = 0; i <= len1; i++) {
@@ -171,110 +611,81 @@ char **nwalign_endsfree(const char *s1, const char *s2, int score[4][4], int gap
     }
   }
     
-  char *al0 = (char *) malloc((len1+len2+1) * sizeof(char));
-  char *al1 = (char *) malloc((len1+len2+1) * sizeof(char));
-  if(al0 == NULL || al1 == NULL) Rcpp::stop("Memory allocation failed.");
-
-  // Trace back over p to form the alignment.
+  // Trace back over p to form the alignment path.
+  char *path = (char *) actx_reserve(&ctx->path, &ctx->path_size, len1+len2);
   size_t len_al = 0;
+  int move;
   i = len1;
   j = len2;  
 
   while ( i > 0 || j > 0 ) {
-//    Rprintf("(%i, %i): p=%i, d=%i\n", i, j, p[i*ncol + j], d[i*ncol + j]);
-    switch ( p[i*ncol + j] ) {
+    move = p[i*ncol + j];
+    switch ( move ) {
     case 1:
-      al0[len_al] = s1[--i];
-      al1[len_al] = s2[--j];
+      i--; j--;
       break;
     case 2:
-      al0[len_al] = '-';
-      al1[len_al] = s2[--j];
+      j--;
       break;
     case 3:
-      al0[len_al] = s1[--i];
-      al1[len_al] = '-';
+      i--;
       break;
     default:
       Rcpp::stop("N-W Align out of range.");
     }
-    len_al++;
+    path[len_al++] = move;
   }
-  al0[len_al] = '\0';
-  al1[len_al] = '\0';
-  
-  
-  // Allocate memory to alignment strings.
-  char **al = (char **) malloc( 2 * sizeof(char *) ); //E
-  if (al == NULL)  Rcpp::stop("Memory allocation failed.");
-  al[0] = (char *) malloc(len_al+1); //E
-  al[1] = (char *) malloc(len_al+1); //E
-  if (al[0] == NULL || al[1] == NULL)  Rcpp::stop("Memory allocation failed.");
-
-  // Reverse the alignment strings (since traced backwards).
-  for (i=0;i<len_al;i++) {
-    al[0][i] = al0[len_al-i-1];
-    al[1][i] = al1[len_al-i-1];
-  }
-  al[0][len_al] = '\0';
-  al[1][len_al] = '\0';
-  
-  // Free allocated memory
-  free(d);
-  free(p);
-  free(al0);
-  free(al1);
+  ctx->len_path = len_al;
   
   nnw++;
-  return al;
 }
 
-/* note: input sequence must end with string termination character, '\0' */
-/* 08-17-15: MJR homopolymer free gapping version of ends-free alignment */
-char **nwalign_endsfree_homo(const char *s1, const char *s2, int score[4][4], int gap_p, int homo_gap_p, int band) {
-  static size_t nnw = 0;
-  int i, j, k;
-  int l, r;
-  unsigned int len1 = strlen(s1);
-  unsigned int len2 = strlen(s2);
-  int diag, left, up;
-  
-  //find locations where s1 has homopolymer and put 1s in homo1
-  unsigned char *homo1 = (unsigned char *) malloc(len1*sizeof(unsigned char)); //E
-  unsigned char *homo2 = (unsigned char *) malloc(len2*sizeof(unsigned char)); //E
-  if(homo1 == NULL || homo2 == NULL) Rcpp::stop("Memory allocation failed.");
-  for (i=0,j=0;j<len1;j++) {
-    if (j==len1-1 || s1[j]!=s1[j+1]) {
+char **nwalign_endsfree(const char *s1, const char *s2, int score[4][4], int gap_p, int band, AlignContext *ctx) {
+  nwalign_endsfree_path(s1, s2, score, gap_p, band, ctx);
+  return path2al(s1, s2, ctx);
+}
+
+// Puts 1s in homo where seq has a homopolymer, and 0s elsewhere
+void homo_mask(const char *seq, unsigned int len, unsigned char *homo) {
+  unsigned int i, j, k;
+  for (i=0,j=0;j<len;j++) {
+    if (j==len-1 || seq[j]!=seq[j+1]) {
       for(k=i;k<=j;k++) {
         if (j-i>=2) {//min homopolymer length = 3
-          homo1[k] = 1;
+          homo[k] = 1;
         } else {
-          homo1[k] = 0;
+          homo[k] = 0;
         }
       }
       i = j+1;
     }
   }
+}
+
+/* note: input sequence must end with string termination character, '\0' */
+/* 08-17-15: MJR homopolymer free gapping version of ends-free alignment */
+// homo1/homo2 are the homo_masks of s1/s2 (as kept in Raw), or NULL to find them here
+void nwalign_endsfree_homo_path(const char *s1, const char *s2, const unsigned char *homo1, const unsigned char *homo2, int score[4][4], int gap_p, int homo_gap_p, int band, AlignContext *ctx) {
+  static size_t nnw = 0;
+  int i, j;
+  int l, r;
+  unsigned int len1 = strlen(s1);
+  unsigned int len2 = strlen(s2);
+  int diag, left, up;
   
-  //find locations where s2 has homopolymer and put 1s in homo2
-  for (i=0,j=0;j<len2;j++) {
-    if (j==len2-1 || s2[j]!=s2[j+1]) {
-      for(k=i;k<=j;k++) {
-        if (j-i>=2) { //min homopolymer length = 3
-          homo2[k] = 1;
-        } else {
-          homo2[k] = 0;
-        }
-      }
-      i = j+1;
-    }
+  //find locations where s1/s2 have homopolymers, if not given
+  if(homo1 == NULL || homo2 == NULL) {
+    unsigned char *homo = (unsigned char *) actx_reserve(&ctx->homo, &ctx->homo_size, (len1+len2)*sizeof(unsigned char));
+    homo_mask(s1, len1, homo);
+    homo_mask(s2, len2, homo + len1);
+    homo1 = homo;
+    homo2 = homo + len1;
   }
 
   unsigned int nrow = len1+1;
   unsigned int ncol = len2+1;
-  int *d = (int *) malloc(nrow * ncol * sizeof(int)); //E
-  int *p = (int *) malloc(nrow * ncol * sizeof(int)); //E
-  if(d == NULL || p == NULL) Rcpp::stop("Memory allocation failed.");
+  int *d = (int *) actx_reserve(&ctx->d, &ctx->d_size, nrow * ncol * sizeof(int));
+  int *p = (int *) actx_reserve(&ctx->p, &ctx->p_size, nrow * ncol * sizeof(int));
   
   // Fill out left columns of d, p.
   for (i = 0; i <= len1; i++) {
@@ -352,63 +763,38 @@ char **nwalign_endsfree_homo(const char *s1, const char *s2, int score[4][4], in
     }
   }
   
-  char *al0 = (char *) malloc((len1+len2+1) * sizeof(char)); //E
-  char *al1 = (char *) malloc((len1+len2+1) * sizeof(char)); //E
-  if(al0 == NULL || al1 == NULL) Rcpp::stop("Memory allocation failed.");
-  
-  // Trace back over p to form the alignment.
+  // Trace back over p to form the alignment path.
+  char *path = (char *) actx_reserve(&ctx->path, &ctx->path_size, len1+len2);
   size_t len_al = 0;
+  int move;
   i = len1;
   j = len2;  
-  
+
   while ( i > 0 || j > 0 ) {
-    switch ( p[i*ncol + j] ) {
+    move = p[i*ncol + j];
+    switch ( move ) {
     case 1:
-      al0[len_al] = s1[--i];
-      al1[len_al] = s2[--j];
+      i--; j--;
       break;
     case 2:
-      al0[len_al] = '-';
-      al1[len_al] = s2[--j];
+      j--;
       break;
     case 3:
-      al0[len_al] = s1[--i];
-      al1[len_al] = '-';
+      i--;
       break;
     default:
       Rcpp::stop("N-W Align out of range.");
     }
-    len_al++;
-  }
-  al0[len_al] = '\0';
-  al1[len_al] = '\0';
-  
-  
-  // Allocate memory to alignment strings.
-  char **al = (char **) malloc( 2 * sizeof(char *) ); //E
-  if (al == NULL)  Rcpp::stop("Memory allocation failed.");
-  al[0] = (char *) malloc(len_al+1); //E
-  al[1] = (char *) malloc(len_al+1); //E
-  if (al[0] == NULL || al[1] == NULL)  Rcpp::stop("Memory allocation failed.");
-  
-  // Reverse the alignment strings (since traced backwards).
-  for (i=0;i<len_al;i++) {
-    al[0][i] = al0[len_al-i-1];
-    al[1][i] = al1[len_al-i-1];
+    path[len_al++] = move;
   }
-  al[0][len_al] = '\0';
-  al[1][len_al] = '\0';
-  
-  // Free allocated memory
-  free(d);
-  free(p);
-  free(homo1);
-  free(homo2);
-  free(al0);
-  free(al1);
+  ctx->len_path = len_al;
   
   nnw++;
-  return al;
+}
+
+char **nwalign_endsfree_homo(const char *s1, const char *s2, int score[4][4], int gap_p, int homo_gap_p, int band, AlignContext *ctx) {
+  nwalign_endsfree_homo_path(s1, s2, NULL, NULL, score, gap_p, homo_gap_p, band, ctx);
+  return path2al(s1, s2, ctx);
 }
 
 
@@ -416,7 +802,7 @@ char **nwalign_endsfree_homo(const char *s1, const char *s2, int score[4][4], in
 // Not used within the dada method
 // Separate function to avoid if statement within performance critical nwalign_endsfree
 /* note: input sequence must end with string termination character, '\0' */
-char **nwalign(const char *s1, const char *s2, int score[4][4], int gap_p, int band) {
+void nwalign_path(const char *s1, const char *s2, int score[4][4], int gap_p, int band, AlignContext *ctx) {
   static size_t nnw = 0;
   int i, j;
   int l, r;
@@ -426,9 +812,8 @@ char **nwalign(const char *s1, const char *s2, int score[4][4], int gap_p, int b
   
   unsigned int nrow = len1+1;
   unsigned int ncol = len2+1;
-  int *d = (int *) malloc(nrow * ncol * sizeof(int)); //E
-  int *p = (int *) malloc(nrow * ncol * sizeof(int)); //E
-  if(d == NULL || p == NULL) Rcpp::stop("Memory allocation failed.");
+  int *d = (int *) actx_reserve(&ctx->d, &ctx->d_size, nrow * ncol * sizeof(int));
+  int *p = (int *) actx_reserve(&ctx->p, &ctx->p_size, nrow * ncol * sizeof(int));
   
   d[0] = 0;
   p[0] = 0; // Should never be queried
@@ -497,61 +882,38 @@ char **nwalign(const char *s1, const char *s2, int score[4][4], int gap_p, int b
     }
   }
     
-  char *al0 = (char *) malloc((len1+len2+1) * sizeof(char));
-  char *al1 = (char *) malloc((len1+len2+1) * sizeof(char));
-  if(al0 == NULL || al1 == NULL) Rcpp::stop("Memory allocation failed.");
-
-  // Trace back over p to form the alignment.
+  // Trace back over p to form the alignment path.
+  char *path = (char *) actx_reserve(&ctx->path, &ctx->path_size, len1+len2);
   size_t len_al = 0;
+  int move;
   i = len1;
   j = len2;  
 
   while ( i > 0 || j > 0 ) {
-    switch ( p[i*ncol + j] ) {
+    move = p[i*ncol + j];
+    switch ( move ) {
     case 1:
-      al0[len_al] = s1[--i];
-      al1[len_al] = s2[--j];
+      i--; j--;
       break;
     case 2:
-      al0[len_al] = '-';
-      al1[len_al] = s2[--j];
+      j--;
       break;
     case 3:
-      al0[len_al] = s1[--i];
-      al1[len_al] = '-';
+      i--;
       break;
     default:
       Rcpp::stop("N-W Align out of range.");
     }
-    len_al++;
+    path[len_al++] = move;
   }
-  al0[len_al] = '\0';
-  al1[len_al] = '\0';
-  
-  
-  // Allocate memory to alignment strings.
-  char **al = (char **) malloc( 2 * sizeof(char *) ); //E
-  if (al == NULL)  Rcpp::stop("Memory allocation failed.");
-  al[0] = (char *) malloc(len_al+1); //E
-  al[1] = (char *) malloc(len_al+1); //E
-  if (al[0] == NULL || al[1] == NULL)  Rcpp::stop("Memory allocation failed.");
-
-  // Reverse the alignment strings (since traced backwards).
-  for (i=0;i<len_al;i++) {
-    al[0][i] = al0[len_al-i-1];
-    al[1][i] = al1[len_al-i-1];
-  }
-  al[0][len_al] = '\0';
-  al[1][len_al] = '\0';
-  
-  // Free allocated memory
-  free(d);
-  free(p);
-  free(al0);
-  free(al1);
+  ctx->len_path = len_al;
   
   nnw++;
-  return al;
+}
+
+char **nwalign(const char *s1, const char *s2, int score[4][4], int gap_p, int band, AlignContext *ctx) {
+  nwalign_path(s1, s2, score, gap_p, band, ctx);
+  return path2al(s1, s2, ctx);
 }
 
 /************* SUBS *****************
@@ -560,184 +922,121 @@ char **nwalign(const char *s1, const char *s2, int score[4][4], int gap_p, int b
  * (could also consider CIGAR format)
  */
 
+// The bytes needed by a Sub of a ref seq of length len0 with nsubs substitutions:
+// the struct, then map, pos, nt0 and nt1 in that order. q0/q1 are only allocated by sub_set_quals.
+static size_t sub_size(unsigned int len0, unsigned int nsubs) {
+  return sizeof(Sub) + (len0 + nsubs)*sizeof(uint16_t) + 2*nsubs;
+}
+
+// Points the arrays of a Sub block at their place in it
+static void sub_layout(Sub *sub, unsigned int len0, unsigned int nsubs) {
+  sub->len0 = len0;
+  sub->nsubs = nsubs;
+  sub->map = (uint16_t *) (sub + 1);
+  sub->pos = sub->map + len0;
+  sub->nt0 = (char *) (sub->pos + nsubs);
+  sub->nt1 = sub->nt0 + nsubs;
+  sub->q0 = NULL;
+  sub->q1 = NULL;
+}
+
 /*
- al2subs:
- takes in an alignment represented as a char ** al. creates
- a Sub object from the substitutions of al[1] relative to al[0].
- that is, the identity of al[1] is stored at positions where it
- differs from al[0]
+ path2sub:
+ walks the alignment path in ctx and creates a Sub object from the
+ substitutions of s2 relative to s1. that is, the identity of s2 is
+ stored at positions where it differs from s1
  */
-Sub *al2subs(char **al) {
-  int i, i0, i1, align_length, len0, nsubs;
-  bool is_nt0, is_nt1;
-  char *al0, *al1; // dummy pointers to the sequences in the alignment
-  
-  // define dummy pointer to key string
-  char *pkey;
-  
-  if(!al) { // Null alignment (outside kmer thresh) -> Null sub
-    Sub *sub = NULL;
-    return sub;
-  }
-  
-  // create Sub obect and initialize memory
-  Sub *sub = (Sub *) malloc(sizeof(Sub)); //E
-  if (sub == NULL)  Rcpp::stop("Memory allocation failed.");
-
-  // traverse alignment and find length of sq0 and nsubs for memory allocation
-  len0 = 0; nsubs = 0;
-  al0 = al[0]; al1 = al[1];
-  align_length = strlen(al[0]);
-  for(i=0;i<align_length;i++) {
-    is_nt0 = ((al0[i] == 1) || (al0[i] == 2) || (al0[i] == 3) || (al0[i] == 4) || (al0[i] == 5)); // A/C/G/T/N (non-gap) in seq0
-    is_nt1 = ((al1[i] == 1) || (al1[i] == 2) || (al1[i] == 3) || (al1[i] == 4) || (al1[i] == 5)); // A/C/G/T/N (non-gap) in seq1
-    if(is_nt0) { len0++; }
-    
-    if(is_nt0 && is_nt1) { // Possible sub
-      if((al0[i] != al1[i]) && (al0[i] != 5) && (al1[i] != 5)) { // Ns don't make subs
+Sub *path2sub(const char *s1, const char *s2, AlignContext *ctx) {
+  size_t k, len_al = ctx->len_path;
+  const char *path = (const char *) ctx->path;
+  unsigned int i0, i1, len0, nsubs;
+  
+  len0 = strlen(s1);
+  // The map, then at most one sub per position of s1: positions, then nt0s, then nt1s
+  uint16_t *smap = (uint16_t *) actx_reserve(&ctx->subs, &ctx->subs_size, len0 * (2*sizeof(uint16_t) + 2));
+  uint16_t *spos = smap + len0;
+  char *snt0 = (char *) (spos + len0);
+  char *snt1 = snt0 + len0;
+  
+  // traverse the alignment recording the map and substitutions
+  i0 = 0; i1 = 0; nsubs = 0;
+  for(k=len_al;k>0;k--) {
+    switch ( path[k-1] ) {
+    case 1:
+      if((s1[i0] != s2[i1]) && (s1[i0] != 5) && (s2[i1] != 5)) { // Ns don't make subs
+        spos[nsubs] = i0;
+        snt0[nsubs] = s1[i0];
+        snt1[nsubs] = s2[i1];
         nsubs++;
       }
+      smap[i0++] = i1++;
+      break;
+    case 2:
+      i1++;
+      break;
+    case 3:
+      smap[i0++] = GAP_GLYPH; // Indicates gap
+      break;
     }
   }
-
-  sub->len0 = len0;
-  sub->map = (uint16_t *) malloc(len0 * sizeof(uint16_t)); //E
-  sub->pos = (uint16_t *) malloc(nsubs * sizeof(uint16_t)); //E
-  sub->nt0 = (char *) malloc(nsubs); //E
-  sub->nt1 = (char *) malloc(nsubs); //E
-  sub->key = (char *) malloc((6*nsubs) + 1); // Must be modified if SEQLEN > 1000 //E
-  if (sub->map == NULL || sub->pos == NULL || sub->nt0 == NULL || sub->nt1 == NULL || sub->key == NULL) {
-    Rcpp::stop("Memory allocation failed.");
-  }
-  sub->nsubs=0;
-    
-  // traverse the alignment and record substitutions while building the hash key
-  pkey = sub->key;
-  
-  i0 = -1; i1 = -1;
-  al0 = al[0]; al1 = al[1];
-  for(i=0;i<align_length;i++) {
-    is_nt0 = ((al0[i] == 1) || (al0[i] == 2) || (al0[i] == 3) || (al0[i] == 4) || (al0[i] == 5)); // A/C/G/T/N (non-gap) in seq0
-    is_nt1 = ((al1[i] == 1) || (al1[i] == 2) || (al1[i] == 3) || (al1[i] == 4) || (al1[i] == 5)); // A/C/G/T/N (non-gap) in seq1
-    if(is_nt0) { i0++; }
-    if(is_nt1) { i1++; }
-
-    // Record to map
-    if(is_nt0) {
-      if(is_nt1) { 
-        sub->map[i0] = i1; // Assigning a signed into to a uint16_t...
-      } else {
-        sub->map[i0] = GAP_GLYPH; // Indicates gap
-      }
-    }
-
-    if(is_nt0 && is_nt1) { // Possible sub
-      if((al0[i] != al1[i]) && (al0[i] != 5) && (al1[i] != 5)) { // Ns don't make subs
-        sub->pos[sub->nsubs] = i0;
-        sub->nt0[sub->nsubs] = al0[i];
-        sub->nt1[sub->nsubs] = al1[i];
-        
-        // Assuming space is available
-        // Assuming sequences are <1000 nts long (3 digit positions)
-        *pkey++ = al0[i];
-        *pkey++ = '0' + i0/100;
-        *pkey++ = '0' + (i0 % 100)/10;
-        *pkey++ = '0' + (i0 % 10);
-        *pkey++ = al1[i];
-        *pkey++ = ',';
-        sub->nsubs++;
-      }
-    }
-  } // for(i=0;i<align_length;i++)
-  *pkey = '\0';
+  
+  // Now that its size is known, draw the Sub from the pool and fill it in
+  Sub *sub = (Sub *) actx_pool_alloc(ctx, sub_size(len0, nsubs));
+  sub_layout(sub, len0, nsubs);
+  memcpy(sub->map, smap, len0 * sizeof(uint16_t));
+  memcpy(sub->pos, spos, nsubs * sizeof(uint16_t));
+  memcpy(sub->nt0, snt0, nsubs);
+  memcpy(sub->nt1, snt1, nsubs);
 
   return sub;
 }
 
-// Wrapper for al2subs(raw_align(...)) that manages memory and qualities
-Sub *sub_new(Raw *raw0, Raw *raw1, int score[4][4], int gap_p, int homo_gap_p, bool use_kmers, double kdist_cutoff, int band, bool vectorized_alignment) {
-  int s;
-  char **al;
-  Sub *sub;
-
-  al = raw_align(raw0, raw1, score, gap_p, homo_gap_p, use_kmers, kdist_cutoff, band, vectorized_alignment);
-  sub = al2subs(al);
-
-  if(sub) {
-    sub->q0 = NULL;
-    sub->q1 = NULL;
-    if(raw0->qual && raw1->qual) {
-      sub->q0 = (double *) malloc(sub->nsubs * sizeof(double)); //E
-      sub->q1 = (double *) malloc(sub->nsubs * sizeof(double)); //E
-      if (sub->q0 == NULL || sub->q1 == NULL) { Rcpp::stop("Memory allocation failed."); }
-      
-      for(s=0;s<sub->nsubs;s++) {
-        sub->q0[s] = raw0->qual[sub->pos[s]];
-        sub->q1[s] = raw1->qual[sub->map[sub->pos[s]]];
-      }
-    }
+// Wrapper for path2sub after raw_align(...), the alignment itself lives in ctx
+// Qualities are not filled in here, see sub_set_quals
+Sub *sub_new(Raw *raw0, Raw *raw1, int score[4][4], int gap_p, int homo_gap_p, bool use_kmers, double kdist_cutoff, int band, bool vectorized_alignment, AlignContext *ctx) {
+  if(!raw_align(raw0, raw1, score, gap_p, homo_gap_p, use_kmers, kdist_cutoff, band, vectorized_alignment, ctx)) {
+    return NULL; // Null alignment (outside kmer thresh) -> Null sub
   }
+  return path2sub(raw0->seq, raw1->seq, ctx);
+}
 
-  if(al) { // not a NULL align
-    free(al[0]);
-    free(al[1]);
-    free(al);
+// Fills in the qualities of the substitutions in a sub between raw0 and raw1
+// Qualities are read from the input quals matrix, which has a column for each raw.
+// They are drawn from the pool of ctx, the one the sub was drawn from, so live as long as it.
+void sub_set_quals(Sub *sub, Raw *raw0, Raw *raw1, Rcpp::NumericMatrix quals, AlignContext *ctx) {
+  unsigned int s;
+  if(!sub || sub->q0 || sub->q1) { return; }
+  sub->q0 = (double *) actx_pool_alloc(ctx, 2 * sub->nsubs * sizeof(double));
+  sub->q1 = sub->q0 + sub->nsubs;
+  
+  for(s=0;s<sub->nsubs;s++) {
+    sub->q0[s] = (float) quals(sub->pos[s], raw0->index);
+    sub->q1[s] = (float) quals(sub->map[sub->pos[s]], raw1->index);
   }
-
-  return sub;
 }
 
-// Copies the given sub into a newly allocated sub object
+// Copies the given sub into a newly allocated sub object, freed by sub_free
 Sub *sub_copy(Sub *sub) {
-  int nsubs, len0;
+  size_t size, qstart;
   
   if(sub == NULL) { return(NULL); }
-  nsubs = sub->nsubs;
-  len0 = sub->len0;
-  
-  Sub *rsub = (Sub *) malloc(sizeof(Sub)); //E
+  size = sub_size(sub->len0, sub->nsubs);
+  qstart = (size + 7) & ~((size_t) 7); // any qualities follow the block
+  Sub *rsub = (Sub *) malloc(qstart + (sub->q0 ? 2 * sub->nsubs * sizeof(double) : 0)); //E
   if (rsub == NULL)  Rcpp::stop("Memory allocation failed.");
-  rsub->map = (uint16_t *) malloc(len0 * sizeof(uint16_t)); //E
-  rsub->pos = (uint16_t *) malloc(nsubs * sizeof(uint16_t)); //E
-  rsub->nt0 = (char *) malloc(nsubs); //E
-  rsub->nt1 = (char *) malloc(nsubs); //E
-  rsub->key = (char *) malloc((6*nsubs) + 1); // Must be modified if SEQLEN > 1000 //E
-  if (rsub->map == NULL || rsub->pos == NULL || rsub->nt0 == NULL || rsub->nt1 == NULL || rsub->key == NULL) {
-    Rcpp::stop("Memory allocation failed.");
-  }
-  
-  rsub->nsubs = sub->nsubs;
-  rsub->len0 = sub->len0;
-  memcpy(rsub->map, sub->map, len0 * sizeof(uint16_t));
-  memcpy(rsub->pos, sub->pos, nsubs * sizeof(uint16_t));
-  memcpy(rsub->nt0, sub->nt0, nsubs);
-  memcpy(rsub->nt1, sub->nt1, nsubs);
-  memcpy(rsub->key, sub->key, (6*nsubs) + 1);
-
+  memcpy(rsub, sub, size);
+  sub_layout(rsub, sub->len0, sub->nsubs);
   if(sub->q0 && sub->q1) {
-    rsub->q0 = (double *) malloc(nsubs * sizeof(double)); //E
-    rsub->q1 = (double *) malloc(nsubs * sizeof(double)); //E
-    if (rsub->q0 == NULL || rsub->q1 == NULL) { Rcpp::stop("Memory allocation failed."); }
-    memcpy(rsub->q0, sub->q0, nsubs * sizeof(double));
-    memcpy(rsub->q1, sub->q1, nsubs * sizeof(double));
-  } else {
-    rsub->q0 = NULL;
-    rsub->q1 = NULL;
+    rsub->q0 = (double *) ((char *) rsub + qstart);
+    rsub->q1 = rsub->q0 + rsub->nsubs;
+    memcpy(rsub->q0, sub->q0, sub->nsubs * sizeof(double));
+    memcpy(rsub->q1, sub->q1, sub->nsubs * sizeof(double));
   }
 
   return rsub;
 }
 
-// Destructor for sub object
+// Destructor for sub objects made by sub_copy
 void sub_free(Sub *sub) {
-  if(sub) { // not a NULL sub
-    free(sub->key);
-    free(sub->nt1);
-    free(sub->nt0);
-    free(sub->pos);
-    free(sub->map);
-    if(sub->q0) { free(sub->q0); }
-    if(sub->q1) { free(sub->q1); }
-    free(sub);
-  }
+  free(sub);
 }
@@ -1,5 +1,9 @@
 #include <Rcpp.h>
 #include "dada.h"
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define NW_SIMD
+#include <immintrin.h>
+#endif
 using namespace Rcpp;
 
 #define MIN(a,b) (((a)<(b))?(a):(b))
@@ -58,6 +62,686 @@ void dploop_vec_swap(int16_t *__restrict__ ptr_left, int16_t *__restrict__ ptr_d
   }
 }
 
+// The diagonal scores of an anti-diagonal: prev plus match or mismatch by whether a and b agree
+void diagloop_vec(const int16_t *__restrict__ prev, const char *__restrict__ a, const char *__restrict__ b, int16_t *__restrict__ diag, int16_t match, int16_t mismatch, size_t n) {
+  size_t i;
+  for(i=0;i<n;i++) {
+    diag[i] = prev[i] + (a[i] == b[i] ? match : mismatch);
+  }
+}
+
+// diagloop_vec scoring by a full score matrix, tab[4*(a-1) + b-1], for nts encoded 1-4
+void diagloop_mat_vec(const int16_t *__restrict__ prev, const char *__restrict__ a, const char *__restrict__ b, int16_t *__restrict__ diag, const int16_t *__restrict__ tab, size_t n) {
+  size_t i;
+  for(i=0;i<n;i++) {
+    diag[i] = prev[i] + tab[4*a[i] + b[i] - 5];
+  }
+}
+
+// dploop_vec with a gap penalty for each cell, by whether its gap is in a homopolymer
+void dploop_homo_vec(int16_t *__restrict__ ptr_left, int16_t *__restrict__ ptr_diag, int16_t *__restrict__ ptr_up, int16_t *__restrict__ d, int16_t *__restrict__ p, const int16_t *__restrict__ gap_left, const int16_t *__restrict__ gap_up, size_t n) {
+  int16_t left, diag, up, entry, pentry;
+  size_t i;
+  
+  for(i=0;i<n;i++) {
+    left = ptr_left[i] + gap_left[i];
+    diag = ptr_diag[i];
+    up = ptr_up[i] + gap_up[i];
+    
+    entry = up >= left ? up : left;
+    pentry = up >= left ? 3 : 2;
+    pentry = entry >= diag ? pentry : 1;
+    entry = entry >= diag ? entry : diag;
+    
+    d[i] = entry;
+    p[i] = pentry;
+  }
+}
+
+// dploop_vec_swap with a gap penalty for each cell
+void dploop_homo_vec_swap(int16_t *__restrict__ ptr_left, int16_t *__restrict__ ptr_diag, int16_t *__restrict__ ptr_up, int16_t *__restrict__ d, int16_t *__restrict__ p, const int16_t *__restrict__ gap_left, const int16_t *__restrict__ gap_up, size_t n) {
+  int16_t left, diag, up, entry, pentry;
+  size_t i;
+  
+  for(i=0;i<n;i++) {
+    left = ptr_left[i] + gap_left[i];
+    diag = ptr_diag[i];
+    up = ptr_up[i] + gap_up[i];
+    
+    entry = left >= up ? left : up;
+    pentry = left >= up ? 2 : 3;
+    pentry = entry >= diag ? pentry : 1;
+    entry = entry >= diag ? entry : diag;
+    
+    d[i] = entry;
+    p[i] = pentry;
+  }
+}
+
+/* Explicitly vectorized anti-diagonal kernels:
+ The loops above only run vectorized if the compiler does so at the flags R was built with,
+ often SSE2 only. These do the same 16-bit arithmetic (wrapping adds, signed compares) and
+ break ties in the same order, so the results are identical. The best version the CPU
+ supports is picked at load time, and the scalar loops finish off the tails.
+*/
+typedef void (*dploop_fn)(int16_t *ptr_left, int16_t *ptr_diag, int16_t *ptr_up, int16_t *d, int16_t *p, int16_t gap_p, size_t n);
+typedef void (*diagloop_fn)(const int16_t *prev, const char *a, const char *b, int16_t *diag, int16_t match, int16_t mismatch, size_t n);
+typedef void (*diagloop_mat_fn)(const int16_t *prev, const char *a, const char *b, int16_t *diag, const int16_t *tab, size_t n);
+typedef void (*dploop_homo_fn)(int16_t *ptr_left, int16_t *ptr_diag, int16_t *ptr_up, int16_t *d, int16_t *p, const int16_t *gap_left, const int16_t *gap_up, size_t n);
+
+#ifdef NW_SIMD
+__attribute__((target("sse4.1")))
+static void dploop_sse41(int16_t *ptr_left, int16_t *ptr_diag, int16_t *ptr_up, int16_t *d, int16_t *p, int16_t gap_p, size_t n) {
+  size_t i;
+  const __m128i gap = _mm_set1_epi16(gap_p), one = _mm_set1_epi16(1), two = _mm_set1_epi16(2), three = _mm_set1_epi16(3);
+  __m128i left, diag, up, entry, pentry;
+  for(i=0;i+8<=n;i+=8) {
+    left = _mm_add_epi16(_mm_loadu_si128((const __m128i *) &ptr_left[i]), gap);
+    diag = _mm_loadu_si128((const __m128i *) &ptr_diag[i]);
+    up = _mm_add_epi16(_mm_loadu_si128((const __m128i *) &ptr_up[i]), gap);
+    pentry = _mm_blendv_epi8(three, two, _mm_cmpgt_epi16(left, up)); // up on ties
+    entry = _mm_max_epi16(up, left);
+    pentry = _mm_blendv_epi8(pentry, one, _mm_cmpgt_epi16(diag, entry));
+    _mm_storeu_si128((__m128i *) &d[i], _mm_max_epi16(entry, diag));
+    _mm_storeu_si128((__m128i *) &p[i], pentry);
+  }
+  dploop_vec(&ptr_left[i], &ptr_diag[i], &ptr_up[i], &d[i], &p[i], gap_p, n-i);
+}
+
+__attribute__((target("sse4.1")))
+static void dploop_swap_sse41(int16_t *ptr_left, int16_t *ptr_diag, int16_t *ptr_up, int16_t *d, int16_t *p, int16_t gap_p, size_t n) {
+  size_t i;
+  const __m128i gap = _mm_set1_epi16(gap_p), one = _mm_set1_epi16(1), two = _mm_set1_epi16(2), three = _mm_set1_epi16(3);
+  __m128i left, diag, up, entry, pentry;
+  for(i=0;i+8<=n;i+=8) {
+    left = _mm_add_epi16(_mm_loadu_si128((const __m128i *) &ptr_left[i]), gap);
+    diag = _mm_loadu_si128((const __m128i *) &ptr_diag[i]);
+    up = _mm_add_epi16(_mm_loadu_si128((const __m128i *) &ptr_up[i]), gap);
+    pentry = _mm_blendv_epi8(two, three, _mm_cmpgt_epi16(up, left)); // left on ties
+    entry = _mm_max_epi16(up, left);
+    pentry = _mm_blendv_epi8(pentry, one, _mm_cmpgt_epi16(diag, entry));
+    _mm_storeu_si128((__m128i *) &d[i], _mm_max_epi16(entry, diag));
+    _mm_storeu_si128((__m128i *) &p[i], pentry);
+  }
+  dploop_vec_swap(&ptr_left[i], &ptr_diag[i], &ptr_up[i], &d[i], &p[i], gap_p, n-i);
+}
+
+__attribute__((target("sse4.1")))
+static void diagloop_sse41(const int16_t *prev, const char *a, const char *b, int16_t *diag, int16_t match, int16_t mismatch, size_t n) {
+  size_t i;
+  const __m128i vmatch = _mm_set1_epi16(match), vmismatch = _mm_set1_epi16(mismatch);
+  __m128i va, vb;
+  for(i=0;i+8<=n;i+=8) {
+    va = _mm_cvtepi8_epi16(_mm_loadl_epi64((const __m128i *) &a[i]));
+    vb = _mm_cvtepi8_epi16(_mm_loadl_epi64((const __m128i *) &b[i]));
+    _mm_storeu_si128((__m128i *) &diag[i], _mm_add_epi16(_mm_loadu_si128((const __m128i *) &prev[i]),
+                                                          _mm_blendv_epi8(vmismatch, vmatch, _mm_cmpeq_epi16(va, vb))));
+  }
+  diagloop_vec(&prev[i], &a[i], &b[i], &diag[i], match, mismatch, n-i);
+}
+
+__attribute__((target("avx2")))
+static void dploop_avx2(int16_t *ptr_left, int16_t *ptr_diag, int16_t *ptr_up, int16_t *d, int16_t *p, int16_t gap_p, size_t n) {
+  size_t i;
+  const __m256i gap = _mm256_set1_epi16(gap_p), one = _mm256_set1_epi16(1), two = _mm256_set1_epi16(2), three = _mm256_set1_epi16(3);
+  __m256i left, diag, up, entry, pentry;
+  for(i=0;i+16<=n;i+=16) {
+    left = _mm256_add_epi16(_mm256_loadu_si256((const __m256i *) &ptr_left[i]), gap);
+    diag = _mm256_loadu_si256((const __m256i *) &ptr_diag[i]);
+    up = _mm256_add_epi16(_mm256_loadu_si256((const __m256i *) &ptr_up[i]), gap);
+    pentry = _mm256_blendv_epi8(three, two, _mm256_cmpgt_epi16(left, up)); // up on ties
+    entry = _mm256_max_epi16(up, left);
+    pentry = _mm256_blendv_epi8(pentry, one, _mm256_cmpgt_epi16(diag, entry));
+    _mm256_storeu_si256((__m256i *) &d[i], _mm256_max_epi16(entry, diag));
+    _mm256_storeu_si256((__m256i *) &p[i], pentry);
+  }
+  dploop_vec(&ptr_left[i], &ptr_diag[i], &ptr_up[i], &d[i], &p[i], gap_p, n-i);
+}
+
+__attribute__((target("avx2")))
+static void dploop_swap_avx2(int16_t *ptr_left, int16_t *ptr_diag, int16_t *ptr_up, int16_t *d, int16_t *p, int16_t gap_p, size_t n) {
+  size_t i;
+  const __m256i gap = _mm256_set1_epi16(gap_p), one = _mm256_set1_epi16(1), two = _mm256_set1_epi16(2), three = _mm256_set1_epi16(3);
+  __m256i left, diag, up, entry, pentry;
+  for(i=0;i+16<=n;i+=16) {
+    left = _mm256_add_epi16(_mm256_loadu_si256((const __m256i *) &ptr_left[i]), gap);
+    diag = _mm256_loadu_si256((const __m256i *) &ptr_diag[i]);
+    up = _mm256_add_epi16(_mm256_loadu_si256((const __m256i *) &ptr_up[i]), gap);
+    pentry = _mm256_blendv_epi8(two, three, _mm256_cmpgt_epi16(up, left)); // left on ties
+    entry = _mm256_max_epi16(up, left);
+    pentry = _mm256_blendv_epi8(pentry, one, _mm256_cmpgt_epi16(diag, entry));
+    _mm256_storeu_si256((__m256i *) &d[i], _mm256_max_epi16(entry, diag));
+    _mm256_storeu_si256((__m256i *) &p[i], pentry);
+  }
+  dploop_vec_swap(&ptr_left[i], &ptr_diag[i], &ptr_up[i], &d[i], &p[i], gap_p, n-i);
+}
+
+__attribute__((target("avx2")))
+static void diagloop_avx2(const int16_t *prev, const char *a, const char *b, int16_t *diag, int16_t match, int16_t mismatch, size_t n) {
+  size_t i;
+  const __m256i vmatch = _mm256_set1_epi16(match), vmismatch = _mm256_set1_epi16(mismatch);
+  __m256i va, vb;
+  for(i=0;i+16<=n;i+=16) {
+    va = _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i *) &a[i]));
+    vb = _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i *) &b[i]));
+    _mm256_storeu_si256((__m256i *) &diag[i], _mm256_add_epi16(_mm256_loadu_si256((const __m256i *) &prev[i]),
+                                                                _mm256_blendv_epi8(vmismatch, vmatch, _mm256_cmpeq_epi16(va, vb))));
+  }
+  diagloop_vec(&prev[i], &a[i], &b[i], &diag[i], match, mismatch, n-i);
+}
+
+__attribute__((target("avx512bw")))
+static void dploop_avx512(int16_t *ptr_left, int16_t *ptr_diag, int16_t *ptr_up, int16_t *d, int16_t *p, int16_t gap_p, size_t n) {
+  size_t i;
+  const __m512i gap = _mm512_set1_epi16(gap_p), one = _mm512_set1_epi16(1), two = _mm512_set1_epi16(2), three = _mm512_set1_epi16(3);
+  __m512i left, diag, up, entry, pentry;
+  for(i=0;i+32<=n;i+=32) {
+    left = _mm512_add_epi16(_mm512_loadu_si512((const void *) &ptr_left[i]), gap);
+    diag = _mm512_loadu_si512((const void *) &ptr_diag[i]);
+    up = _mm512_add_epi16(_mm512_loadu_si512((const void *) &ptr_up[i]), gap);
+    pentry = _mm512_mask_blend_epi16(_mm512_cmpgt_epi16_mask(left, up), three, two); // up on ties
+    entry = _mm512_max_epi16(up, left);
+    pentry = _mm512_mask_blend_epi16(_mm512_cmpgt_epi16_mask(diag, entry), pentry, one);
+    _mm512_storeu_si512((void *) &d[i], _mm512_max_epi16(entry, diag));
+    _mm512_storeu_si512((void *) &p[i], pentry);
+  }
+  dploop_vec(&ptr_left[i], &ptr_diag[i], &ptr_up[i], &d[i], &p[i], gap_p, n-i);
+}
+
+__attribute__((target("avx512bw")))
+static void dploop_swap_avx512(int16_t *ptr_left, int16_t *ptr_diag, int16_t *ptr_up, int16_t *d, int16_t *p, int16_t gap_p, size_t n) {
+  size_t i;
+  const __m512i gap = _mm512_set1_epi16(gap_p), one = _mm512_set1_epi16(1), two = _mm512_set1_epi16(2), three = _mm512_set1_epi16(3);
+  __m512i left, diag, up, entry, pentry;
+  for(i=0;i+32<=n;i+=32) {
+    left = _mm512_add_epi16(_mm512_loadu_si512((const void *) &ptr_left[i]), gap);
+    diag = _mm512_loadu_si512((const void *) &ptr_diag[i]);
+    up = _mm512_add_epi16(_mm512_loadu_si512((const void *) &ptr_up[i]), gap);
+    pentry = _mm512_mask_blend_epi16(_mm512_cmpgt_epi16_mask(up, left), two, three); // left on ties
+    entry = _mm512_max_epi16(up, left);
+    pentry = _mm512_mask_blend_epi16(_mm512_cmpgt_epi16_mask(diag, entry), pentry, one);
+    _mm512_storeu_si512((void *) &d[i], _mm512_max_epi16(entry, diag));
+    _mm512_storeu_si512((void *) &p[i], pentry);
+  }
+  dploop_vec_swap(&ptr_left[i], &ptr_diag[i], &ptr_up[i], &d[i], &p[i], gap_p, n-i);
+}
+
+__attribute__((target("avx512bw")))
+static void diagloop_avx512(const int16_t *prev, const char *a, const char *b, int16_t *diag, int16_t match, int16_t mismatch, size_t n) {
+  size_t i;
+  const __m512i vmatch = _mm512_set1_epi16(match), vmismatch = _mm512_set1_epi16(mismatch);
+  __m512i va, vb;
+  for(i=0;i+32<=n;i+=32) {
+    va = _mm512_cvtepi8_epi16(_mm256_loadu_si256((const __m256i *) &a[i]));
+    vb = _mm512_cvtepi8_epi16(_mm256_loadu_si256((const __m256i *) &b[i]));
+    _mm512_storeu_si512((void *) &diag[i], _mm512_add_epi16(_mm512_loadu_si512((const void *) &prev[i]),
+                                                             _mm512_mask_blend_epi16(_mm512_cmpeq_epi16_mask(va, vb), vmismatch, vmatch)));
+  }
+  diagloop_vec(&prev[i], &a[i], &b[i], &diag[i], match, mismatch, n-i);
+}
+
+__attribute__((target("sse4.1")))
+static void dploop_homo_sse41(int16_t *ptr_left, int16_t *ptr_diag, int16_t *ptr_up, int16_t *d, int16_t *p, const int16_t *gap_left, const int16_t *gap_up, size_t n) {
+  size_t i;
+  const __m128i one = _mm_set1_epi16(1), two = _mm_set1_epi16(2), three = _mm_set1_epi16(3);
+  __m128i left, diag, up, entry, pentry;
+  for(i=0;i+8<=n;i+=8) {
+    left = _mm_add_epi16(_mm_loadu_si128((const __m128i *) &ptr_left[i]), _mm_loadu_si128((const __m128i *) &gap_left[i]));
+    diag = _mm_loadu_si128((const __m128i *) &ptr_diag[i]);
+    up = _mm_add_epi16(_mm_loadu_si128((const __m128i *) &ptr_up[i]), _mm_loadu_si128((const __m128i *) &gap_up[i]));
+    pentry = _mm_blendv_epi8(three, two, _mm_cmpgt_epi16(left, up)); // up on ties
+    entry = _mm_max_epi16(up, left);
+    pentry = _mm_blendv_epi8(pentry, one, _mm_cmpgt_epi16(diag, entry));
+    _mm_storeu_si128((__m128i *) &d[i], _mm_max_epi16(entry, diag));
+    _mm_storeu_si128((__m128i *) &p[i], pentry);
+  }
+  dploop_homo_vec(&ptr_left[i], &ptr_diag[i], &ptr_up[i], &d[i], &p[i], &gap_left[i], &gap_up[i], n-i);
+}
+
+__attribute__((target("sse4.1")))
+static void dploop_homo_swap_sse41(int16_t *ptr_left, int16_t *ptr_diag, int16_t *ptr_up, int16_t *d, int16_t *p, const int16_t *gap_left, const int16_t *gap_up, size_t n) {
+  size_t i;
+  const __m128i one = _mm_set1_epi16(1), two = _mm_set1_epi16(2), three = _mm_set1_epi16(3);
+  __m128i left, diag, up, entry, pentry;
+  for(i=0;i+8<=n;i+=8) {
+    left = _mm_add_epi16(_mm_loadu_si128((const __m128i *) &ptr_left[i]), _mm_loadu_si128((const __m128i *) &gap_left[i]));
+    diag = _mm_loadu_si128((const __m128i *) &ptr_diag[i]);
+    up = _mm_add_epi16(_mm_loadu_si128((const __m128i *) &ptr_up[i]), _mm_loadu_si128((const __m128i *) &gap_up[i]));
+    pentry = _mm_blendv_epi8(two, three, _mm_cmpgt_epi16(up, left)); // left on ties
+    entry = _mm_max_epi16(up, left);
+    pentry = _mm_blendv_epi8(pentry, one, _mm_cmpgt_epi16(diag, entry));
+    _mm_storeu_si128((__m128i *) &d[i], _mm_max_epi16(entry, diag));
+    _mm_storeu_si128((__m128i *) &p[i], pentry);
+  }
+  dploop_homo_vec_swap(&ptr_left[i], &ptr_diag[i], &ptr_up[i], &d[i], &p[i], &gap_left[i], &gap_up[i], n-i);
+}
+
+__attribute__((target("avx2")))
+static void dploop_homo_avx2(int16_t *ptr_left, int16_t *ptr_diag, int16_t *ptr_up, int16_t *d, int16_t *p, const int16_t *gap_left, const int16_t *gap_up, size_t n) {
+  size_t i;
+  const __m256i one = _mm256_set1_epi16(1), two = _mm256_set1_epi16(2), three = _mm256_set1_epi16(3);
+  __m256i left, diag, up, entry, pentry;
+  for(i=0;i+16<=n;i+=16) {
+    left = _mm256_add_epi16(_mm256_loadu_si256((const __m256i *) &ptr_left[i]), _mm256_loadu_si256((const __m256i *) &gap_left[i]));
+    diag = _mm256_loadu_si256((const __m256i *) &ptr_diag[i]);
+    up = _mm256_add_epi16(_mm256_loadu_si256((const __m256i *) &ptr_up[i]), _mm256_loadu_si256((const __m256i *) &gap_up[i]));
+    pentry = _mm256_blendv_epi8(three, two, _mm256_cmpgt_epi16(left, up)); // up on ties
+    entry = _mm256_max_epi16(up, left);
+    pentry = _mm256_blendv_epi8(pentry, one, _mm256_cmpgt_epi16(diag, entry));
+    _mm256_storeu_si256((__m256i *) &d[i], _mm256_max_epi16(entry, diag));
+    _mm256_storeu_si256((__m256i *) &p[i], pentry);
+  }
+  _mm256_zeroupper(); // the SSE4.1 tail must not run with the upper halves dirty
+  dploop_homo_sse41(&ptr_left[i], &ptr_diag[i], &ptr_up[i], &d[i], &p[i], &gap_left[i], &gap_up[i], n-i);
+}
+
+__attribute__((target("avx2")))
+static void dploop_homo_swap_avx2(int16_t *ptr_left, int16_t *ptr_diag, int16_t *ptr_up, int16_t *d, int16_t *p, const int16_t *gap_left, const int16_t *gap_up, size_t n) {
+  size_t i;
+  const __m256i one = _mm256_set1_epi16(1), two = _mm256_set1_epi16(2), three = _mm256_set1_epi16(3);
+  __m256i left, diag, up, entry, pentry;
+  for(i=0;i+16<=n;i+=16) {
+    left = _mm256_add_epi16(_mm256_loadu_si256((const __m256i *) &ptr_left[i]), _mm256_loadu_si256((const __m256i *) &gap_left[i]));
+    diag = _mm256_loadu_si256((const __m256i *) &ptr_diag[i]);
+    up = _mm256_add_epi16(_mm256_loadu_si256((const __m256i *) &ptr_up[i]), _mm256_loadu_si256((const __m256i *) &gap_up[i]));
+    pentry = _mm256_blendv_epi8(two, three, _mm256_cmpgt_epi16(up, left)); // left on ties
+    entry = _mm256_max_epi16(up, left);
+    pentry = _mm256_blendv_epi8(pentry, one, _mm256_cmpgt_epi16(diag, entry));
+    _mm256_storeu_si256((__m256i *) &d[i], _mm256_max_epi16(entry, diag));
+    _mm256_storeu_si256((__m256i *) &p[i], pentry);
+  }
+  _mm256_zeroupper(); // the SSE4.1 tail must not run with the upper halves dirty
+  dploop_homo_swap_sse41(&ptr_left[i], &ptr_diag[i], &ptr_up[i], &d[i], &p[i], &gap_left[i], &gap_up[i], n-i);
+}
+
+__attribute__((target("avx512bw")))
+static void dploop_homo_avx512(int16_t *ptr_left, int16_t *ptr_diag, int16_t *ptr_up, int16_t *d, int16_t *p, const int16_t *gap_left, const int16_t *gap_up, size_t n) {
+  size_t i;
+  const __m512i one = _mm512_set1_epi16(1), two = _mm512_set1_epi16(2), three = _mm512_set1_epi16(3);
+  __m512i left, diag, up, entry, pentry;
+  for(i=0;i+32<=n;i+=32) {
+    left = _mm512_add_epi16(_mm512_loadu_si512((const void *) &ptr_left[i]), _mm512_loadu_si512((const void *) &gap_left[i]));
+    diag = _mm512_loadu_si512((const void *) &ptr_diag[i]);
+    up = _mm512_add_epi16(_mm512_loadu_si512((const void *) &ptr_up[i]), _mm512_loadu_si512((const void *) &gap_up[i]));
+    pentry = _mm512_mask_blend_epi16(_mm512_cmpgt_epi16_mask(left, up), three, two); // up on ties
+    entry = _mm512_max_epi16(up, left);
+    pentry = _mm512_mask_blend_epi16(_mm512_cmpgt_epi16_mask(diag, entry), pentry, one);
+    _mm512_storeu_si512((void *) &d[i], _mm512_max_epi16(entry, diag));
+    _mm512_storeu_si512((void *) &p[i], pentry);
+  }
+  dploop_homo_avx2(&ptr_left[i], &ptr_diag[i], &ptr_up[i], &d[i], &p[i], &gap_left[i], &gap_up[i], n-i);
+}
+
+__attribute__((target("avx512bw")))
+static void dploop_homo_swap_avx512(int16_t *ptr_left, int16_t *ptr_diag, int16_t *ptr_up, int16_t *d, int16_t *p, const int16_t *gap_left, const int16_t *gap_up, size_t n) {
+  size_t i;
+  const __m512i one = _mm512_set1_epi16(1), two = _mm512_set1_epi16(2), three = _mm512_set1_epi16(3);
+  __m512i left, diag, up, entry, pentry;
+  for(i=0;i+32<=n;i+=32) {
+    left = _mm512_add_epi16(_mm512_loadu_si512((const void *) &ptr_left[i]), _mm512_loadu_si512((const void *) &gap_left[i]));
+    diag = _mm512_loadu_si512((const void *) &ptr_diag[i]);
+    up = _mm512_add_epi16(_mm512_loadu_si512((const void *) &ptr_up[i]), _mm512_loadu_si512((const void *) &gap_up[i]));
+    pentry = _mm512_mask_blend_epi16(_mm512_cmpgt_epi16_mask(up, left), two, three); // left on ties
+    entry = _mm512_max_epi16(up, left);
+    pentry = _mm512_mask_blend_epi16(_mm512_cmpgt_epi16_mask(diag, entry), pentry, one);
+    _mm512_storeu_si512((void *) &d[i], _mm512_max_epi16(entry, diag));
+    _mm512_storeu_si512((void *) &p[i], pentry);
+  }
+  dploop_homo_swap_avx2(&ptr_left[i], &ptr_diag[i], &ptr_up[i], &d[i], &p[i], &gap_left[i], &gap_up[i], n-i);
+}
+
+/* The diagloop_mat kernels look the scores up 16 at a time with a byte shuffle, the table packed
+ into bytes. They are only used if all the scores fit in a byte (see nwalign_vectorized2_path16). */
+__attribute__((target("sse4.1")))
+static void diagloop_mat_sse41(const int16_t *prev, const char *a, const char *b, int16_t *diag, const int16_t *tab, size_t n) {
+  size_t i;
+  const __m128i vtab = _mm_packs_epi16(_mm_loadu_si128((const __m128i *) &tab[0]), _mm_loadu_si128((const __m128i *) &tab[8]));
+  const __m128i five = _mm_set1_epi8(5);
+  __m128i va, vb, idx;
+  for(i=0;i+8<=n;i+=8) {
+    va = _mm_loadl_epi64((const __m128i *) &a[i]);
+    vb = _mm_loadl_epi64((const __m128i *) &b[i]);
+    va = _mm_add_epi8(va, va);
+    idx = _mm_sub_epi8(_mm_add_epi8(_mm_add_epi8(va, va), vb), five);
+    _mm_storeu_si128((__m128i *) &diag[i], _mm_add_epi16(_mm_loadu_si128((const __m128i *) &prev[i]),
+                                                          _mm_cvtepi8_epi16(_mm_shuffle_epi8(vtab, idx))));
+  }
+  diagloop_mat_vec(&prev[i], &a[i], &b[i], &diag[i], tab, n-i);
+}
+
+__attribute__((target("avx2")))
+static void diagloop_mat_avx2(const int16_t *prev, const char *a, const char *b, int16_t *diag, const int16_t *tab, size_t n) {
+  size_t i;
+  const __m128i vtab = _mm_packs_epi16(_mm_loadu_si128((const __m128i *) &tab[0]), _mm_loadu_si128((const __m128i *) &tab[8]));
+  const __m128i five = _mm_set1_epi8(5);
+  __m128i va, vb, idx;
+  for(i=0;i+16<=n;i+=16) {
+    va = _mm_loadu_si128((const __m128i *) &a[i]);
+    vb = _mm_loadu_si128((const __m128i *) &b[i]);
+    va = _mm_add_epi8(va, va);
+    idx = _mm_sub_epi8(_mm_add_epi8(_mm_add_epi8(va, va), vb), five);
+    _mm256_storeu_si256((__m256i *) &diag[i], _mm256_add_epi16(_mm256_loadu_si256((const __m256i *) &prev[i]),
+                                                                _mm256_cvtepi8_epi16(_mm_shuffle_epi8(vtab, idx))));
+  }
+  _mm256_zeroupper(); // the SSE4.1 tail must not run with the upper halves dirty
+  diagloop_mat_sse41(&prev[i], &a[i], &b[i], &diag[i], tab, n-i);
+}
+
+__attribute__((target("avx512bw")))
+static void diagloop_mat_avx512(const int16_t *prev, const char *a, const char *b, int16_t *diag, const int16_t *tab, size_t n) {
+  size_t i;
+  const __m256i vtab = _mm256_broadcastsi128_si256(_mm_packs_epi16(_mm_loadu_si128((const __m128i *) &tab[0]), _mm_loadu_si128((const __m128i *) &tab[8])));
+  const __m256i five = _mm256_set1_epi8(5);
+  __m256i va, vb, idx;
+  for(i=0;i+32<=n;i+=32) {
+    va = _mm256_loadu_si256((const __m256i *) &a[i]);
+    vb = _mm256_loadu_si256((const __m256i *) &b[i]);
+    va = _mm256_add_epi8(va, va);
+    idx = _mm256_sub_epi8(_mm256_add_epi8(_mm256_add_epi8(va, va), vb), five);
+    _mm512_storeu_si512((void *) &diag[i], _mm512_add_epi16(_mm512_loadu_si512((const void *) &prev[i]),
+                                                             _mm512_cvtepi8_epi16(_mm256_shuffle_epi8(vtab, idx))));
+  }
+  diagloop_mat_avx2(&prev[i], &a[i], &b[i], &diag[i], tab, n-i);
+}
+#endif
+
+// Returns 3 with AVX-512BW, 2 with AVX2, 1 with SSE4.1 and 0 otherwise
+static int nw_simd_level() {
+#ifdef NW_SIMD
+  __builtin_cpu_init();
+  if(__builtin_cpu_supports("avx512bw")) { return 3; }
+  if(__builtin_cpu_supports("avx2")) { return 2; }
+  if(__builtin_cpu_supports("sse4.1")) { return 1; }
+#endif
+  return 0;
+}
+
+static const int nw_simd = nw_simd_level();
+#ifdef NW_SIMD
+static const dploop_fn dploop = nw_simd==3 ? dploop_avx512 : nw_simd==2 ? dploop_avx2 : nw_simd==1 ? dploop_sse41 : dploop_vec;
+static const dploop_fn dploop_swap = nw_simd==3 ? dploop_swap_avx512 : nw_simd==2 ? dploop_swap_avx2 : nw_simd==1 ? dploop_swap_sse41 : dploop_vec_swap;
+static const diagloop_fn diagloop = nw_simd==3 ? diagloop_avx512 : nw_simd==2 ? diagloop_avx2 : nw_simd==1 ? diagloop_sse41 : diagloop_vec;
+static const dploop_homo_fn dploop_homo = nw_simd==3 ? dploop_homo_avx512 : nw_simd==2 ? dploop_homo_avx2 : nw_simd==1 ? dploop_homo_sse41 : dploop_homo_vec;
+static const dploop_homo_fn dploop_homo_swap = nw_simd==3 ? dploop_homo_swap_avx512 : nw_simd==2 ? dploop_homo_swap_avx2 : nw_simd==1 ? dploop_homo_swap_sse41 : dploop_homo_vec_swap;
+static const diagloop_mat_fn diagloop_mat = nw_simd==3 ? diagloop_mat_avx512 : nw_simd==2 ? diagloop_mat_avx2 : nw_simd==1 ? diagloop_mat_sse41 : diagloop_mat_vec;
+#else
+static const dploop_fn dploop = dploop_vec;
+static const dploop_fn dploop_swap = dploop_vec_swap;
+static const diagloop_fn diagloop = diagloop_vec;
+static const dploop_homo_fn dploop_homo = dploop_homo_vec;
+static const dploop_homo_fn dploop_homo_swap = dploop_homo_vec_swap;
+static const diagloop_mat_fn diagloop_mat = diagloop_mat_vec;
+#endif
+
+/* 8-bit versions of the loops, for nwalign_vectorized2_path8:
+ Scores are kept doubled, with the low bit set if the score is only an upper bound on the true one
+ as it came from a score that saturated (at NW8_FLOOR, which is odd). Adding doubled scores keeps
+ the bit, and a maximum gets it if any bound ties or beats all the exact scores compared.
+*/
+#define NW8_FLOOR (INT8_MIN+1)
+#define NW8_MAX_PEN 16 // Largest magnitude of the scores and penalties aligned in 8 bits
+#define NW8_DRIFT 32 // How far the best (doubled) score of a row may stray from 0 before the row is offset
+
+static inline int8_t sat8(int v) {
+  return v < NW8_FLOOR ? NW8_FLOOR : (v > INT8_MAX ? INT8_MAX : v);
+}
+
+// Precedence is up>left>diag. Returns the largest score written
+int8_t dploop8_vec(int8_t *__restrict__ ptr_left, int8_t *__restrict__ ptr_diag, int8_t *__restrict__ ptr_up, int8_t *__restrict__ d, int8_t *__restrict__ p, int8_t gap_p, size_t n) {
+  int8_t left, diag, up, entry, pentry, dmax = NW8_FLOOR;
+  size_t i;
+  
+  for(i=0;i<n;i++) {
+    left = sat8(ptr_left[i] + gap_p);
+    diag = ptr_diag[i];
+    up = sat8(ptr_up[i] + gap_p);
+    
+    entry = up >= left ? up : left;
+    pentry = up >= left ? 3 : 2;
+    pentry = entry >= diag ? pentry : 1;
+    entry = entry >= diag ? entry : diag;
+    
+    d[i] = entry;
+    p[i] = pentry;
+    dmax = entry > dmax ? entry : dmax;
+  }
+  return dmax;
+}
+
+// Precedence is left>up>diag
+int8_t dploop8_vec_swap(int8_t *__restrict__ ptr_left, int8_t *__restrict__ ptr_diag, int8_t *__restrict__ ptr_up, int8_t *__restrict__ d, int8_t *__restrict__ p, int8_t gap_p, size_t n) {
+  int8_t left, diag, up, entry, pentry, dmax = NW8_FLOOR;
+  size_t i;
+  
+  for(i=0;i<n;i++) {
+    left = sat8(ptr_left[i] + gap_p);
+    diag = ptr_diag[i];
+    up = sat8(ptr_up[i] + gap_p);
+    
+    entry = left >= up ? left : up;
+    pentry = left >= up ? 2 : 3;
+    pentry = entry >= diag ? pentry : 1;
+    entry = entry >= diag ? entry : diag;
+    
+    d[i] = entry;
+    p[i] = pentry;
+    dmax = entry > dmax ? entry : dmax;
+  }
+  return dmax;
+}
+
+void diagloop8_vec(const int8_t *__restrict__ prev, const char *__restrict__ a, const char *__restrict__ b, int8_t *__restrict__ diag, int8_t match, int8_t mismatch, size_t n) {
+  size_t i;
+  for(i=0;i<n;i++) {
+    diag[i] = sat8(prev[i] + (a[i] == b[i] ? match : mismatch));
+  }
+}
+
+typedef int8_t (*dploop8_fn)(int8_t *ptr_left, int8_t *ptr_diag, int8_t *ptr_up, int8_t *d, int8_t *p, int8_t gap_p, size_t n);
+typedef void (*diagloop8_fn)(const int8_t *prev, const char *a, const char *b, int8_t *diag, int8_t match, int8_t mismatch, size_t n);
+
+// Rows are short, so the AVX2 versions hand their tails to the SSE4.1 ones, and AVX-512 masks its tail
+#ifdef NW_SIMD
+// The largest of the 16 scores in v and x
+__attribute__((target("sse4.1")))
+static inline int8_t hmax8(__m128i v, int8_t x) {
+  v = _mm_max_epi8(v, _mm_srli_si128(v, 8));
+  v = _mm_max_epi8(v, _mm_srli_si128(v, 4));
+  v = _mm_max_epi8(v, _mm_srli_si128(v, 2));
+  v = _mm_max_epi8(v, _mm_srli_si128(v, 1));
+  return (int8_t) _mm_extract_epi8(v, 0) > x ? (int8_t) _mm_extract_epi8(v, 0) : x;
+}
+
+__attribute__((target("sse4.1")))
+static int8_t dploop8_sse41(int8_t *ptr_left, int8_t *ptr_diag, int8_t *ptr_up, int8_t *d, int8_t *p, int8_t gap_p, size_t n) {
+  size_t i;
+  const __m128i gap = _mm_set1_epi8(gap_p), one = _mm_set1_epi8(1), two = _mm_set1_epi8(2), three = _mm_set1_epi8(3), floor = _mm_set1_epi8(NW8_FLOOR);
+  __m128i left, diag, up, entry, pentry, dmax = floor;
+  for(i=0;i+16<=n;i+=16) {
+    left = _mm_max_epi8(_mm_adds_epi8(_mm_loadu_si128((const __m128i *) &ptr_left[i]), gap), floor);
+    diag = _mm_loadu_si128((const __m128i *) &ptr_diag[i]);
+    up = _mm_max_epi8(_mm_adds_epi8(_mm_loadu_si128((const __m128i *) &ptr_up[i]), gap), floor);
+    pentry = _mm_blendv_epi8(three, two, _mm_cmpgt_epi8(left, up)); // up on ties
+    entry = _mm_max_epi8(up, left);
+    pentry = _mm_blendv_epi8(pentry, one, _mm_cmpgt_epi8(diag, entry));
+    entry = _mm_max_epi8(entry, diag);
+    dmax = _mm_max_epi8(dmax, entry);
+    _mm_storeu_si128((__m128i *) &d[i], entry);
+    _mm_storeu_si128((__m128i *) &p[i], pentry);
+  }
+  return hmax8(dmax, dploop8_vec(&ptr_left[i], &ptr_diag[i], &ptr_up[i], &d[i], &p[i], gap_p, n-i));
+}
+
+__attribute__((target("sse4.1")))
+static int8_t dploop8_swap_sse41(int8_t *ptr_left, int8_t *ptr_diag, int8_t *ptr_up, int8_t *d, int8_t *p, int8_t gap_p, size_t n) {
+  size_t i;
+  const __m128i gap = _mm_set1_epi8(gap_p), one = _mm_set1_epi8(1), two = _mm_set1_epi8(2), three = _mm_set1_epi8(3), floor = _mm_set1_epi8(NW8_FLOOR);
+  __m128i left, diag, up, entry, pentry, dmax = floor;
+  for(i=0;i+16<=n;i+=16) {
+    left = _mm_max_epi8(_mm_adds_epi8(_mm_loadu_si128((const __m128i *) &ptr_left[i]), gap), floor);
+    diag = _mm_loadu_si128((const __m128i *) &ptr_diag[i]);
+    up = _mm_max_epi8(_mm_adds_epi8(_mm_loadu_si128((const __m128i *) &ptr_up[i]), gap), floor);
+    pentry = _mm_blendv_epi8(two, three, _mm_cmpgt_epi8(up, left)); // left on ties
+    entry = _mm_max_epi8(up, left);
+    pentry = _mm_blendv_epi8(pentry, one, _mm_cmpgt_epi8(diag, entry));
+    entry = _mm_max_epi8(entry, diag);
+    dmax = _mm_max_epi8(dmax, entry);
+    _mm_storeu_si128((__m128i *) &d[i], entry);
+    _mm_storeu_si128((__m128i *) &p[i], pentry);
+  }
+  return hmax8(dmax, dploop8_vec_swap(&ptr_left[i], &ptr_diag[i], &ptr_up[i], &d[i], &p[i], gap_p, n-i));
+}
+
+__attribute__((target("sse4.1")))
+static void diagloop8_sse41(const int8_t *prev, const char *a, const char *b, int8_t *diag, int8_t match, int8_t mismatch, size_t n) {
+  size_t i;
+  const __m128i vmatch = _mm_set1_epi8(match), vmismatch = _mm_set1_epi8(mismatch), floor = _mm_set1_epi8(NW8_FLOOR);
+  __m128i vprev, va, vb;
+  for(i=0;i+16<=n;i+=16) {
+    vprev = _mm_loadu_si128((const __m128i *) &prev[i]);
+    va = _mm_loadu_si128((const __m128i *) &a[i]);
+    vb = _mm_loadu_si128((const __m128i *) &b[i]);
+    _mm_storeu_si128((__m128i *) &diag[i], _mm_max_epi8(_mm_adds_epi8(vprev, _mm_blendv_epi8(vmismatch, vmatch, _mm_cmpeq_epi8(va, vb))), floor));
+  }
+  diagloop8_vec(&prev[i], &a[i], &b[i], &diag[i], match, mismatch, n-i);
+}
+
+__attribute__((target("avx2")))
+static int8_t dploop8_avx2(int8_t *ptr_left, int8_t *ptr_diag, int8_t *ptr_up, int8_t *d, int8_t *p, int8_t gap_p, size_t n) {
+  size_t i;
+  const __m256i gap = _mm256_set1_epi8(gap_p), one = _mm256_set1_epi8(1), two = _mm256_set1_epi8(2), three = _mm256_set1_epi8(3), floor = _mm256_set1_epi8(NW8_FLOOR);
+  __m256i left, diag, up, entry, pentry, dmax = floor;
+  for(i=0;i+32<=n;i+=32) {
+    left = _mm256_max_epi8(_mm256_adds_epi8(_mm256_loadu_si256((const __m256i *) &ptr_left[i]), gap), floor);
+    diag = _mm256_loadu_si256((const __m256i *) &ptr_diag[i]);
+    up = _mm256_max_epi8(_mm256_adds_epi8(_mm256_loadu_si256((const __m256i *) &ptr_up[i]), gap), floor);
+    pentry = _mm256_blendv_epi8(three, two, _mm256_cmpgt_epi8(left, up)); // up on ties
+    entry = _mm256_max_epi8(up, left);
+    pentry = _mm256_blendv_epi8(pentry, one, _mm256_cmpgt_epi8(diag, entry));
+    entry = _mm256_max_epi8(entry, diag);
+    dmax = _mm256_max_epi8(dmax, entry);
+    _mm256_storeu_si256((__m256i *) &d[i], entry);
+    _mm256_storeu_si256((__m256i *) &p[i], pentry);
+  }
+  __m128i dmax128 = _mm_max_epi8(_mm256_castsi256_si128(dmax), _mm256_extracti128_si256(dmax, 1));
+  _mm256_zeroupper(); // the SSE4.1 tail must not run with the upper halves dirty
+  return hmax8(dmax128, dploop8_sse41(&ptr_left[i], &ptr_diag[i], &ptr_up[i], &d[i], &p[i], gap_p, n-i));
+}
+
+__attribute__((target("avx2")))
+static int8_t dploop8_swap_avx2(int8_t *ptr_left, int8_t *ptr_diag, int8_t *ptr_up, int8_t *d, int8_t *p, int8_t gap_p, size_t n) {
+  size_t i;
+  const __m256i gap = _mm256_set1_epi8(gap_p), one = _mm256_set1_epi8(1), two = _mm256_set1_epi8(2), three = _mm256_set1_epi8(3), floor = _mm256_set1_epi8(NW8_FLOOR);
+  __m256i left, diag, up, entry, pentry, dmax = floor;
+  for(i=0;i+32<=n;i+=32) {
+    left = _mm256_max_epi8(_mm256_adds_epi8(_mm256_loadu_si256((const __m256i *) &ptr_left[i]), gap), floor);
+    diag = _mm256_loadu_si256((const __m256i *) &ptr_diag[i]);
+    up = _mm256_max_epi8(_mm256_adds_epi8(_mm256_loadu_si256((const __m256i *) &ptr_up[i]), gap), floor);
+    pentry = _mm256_blendv_epi8(two, three, _mm256_cmpgt_epi8(up, left)); // left on ties
+    entry = _mm256_max_epi8(up, left);
+    pentry = _mm256_blendv_epi8(pentry, one, _mm256_cmpgt_epi8(diag, entry));
+    entry = _mm256_max_epi8(entry, diag);
+    dmax = _mm256_max_epi8(dmax, entry);
+    _mm256_storeu_si256((__m256i *) &d[i], entry);
+    _mm256_storeu_si256((__m256i *) &p[i], pentry);
+  }
+  __m128i dmax128 = _mm_max_epi8(_mm256_castsi256_si128(dmax), _mm256_extracti128_si256(dmax, 1));
+  _mm256_zeroupper(); // the SSE4.1 tail must not run with the upper halves dirty
+  return hmax8(dmax128, dploop8_swap_sse41(&ptr_left[i], &ptr_diag[i], &ptr_up[i], &d[i], &p[i], gap_p, n-i));
+}
+
+__attribute__((target("avx2")))
+static void diagloop8_avx2(const int8_t *prev, const char *a, const char *b, int8_t *diag, int8_t match, int8_t mismatch, size_t n) {
+  size_t i;
+  const __m256i vmatch = _mm256_set1_epi8(match), vmismatch = _mm256_set1_epi8(mismatch), floor = _mm256_set1_epi8(NW8_FLOOR);
+  __m256i vprev, va, vb;
+  for(i=0;i+32<=n;i+=32) {
+    vprev = _mm256_loadu_si256((const __m256i *) &prev[i]);
+    va = _mm256_loadu_si256((const __m256i *) &a[i]);
+    vb = _mm256_loadu_si256((const __m256i *) &b[i]);
+    _mm256_storeu_si256((__m256i *) &diag[i], _mm256_max_epi8(_mm256_adds_epi8(vprev, _mm256_blendv_epi8(vmismatch, vmatch, _mm256_cmpeq_epi8(va, vb))), floor));
+  }
+  _mm256_zeroupper(); // the SSE4.1 tail must not run with the upper halves dirty
+  diagloop8_sse41(&prev[i], &a[i], &b[i], &diag[i], match, mismatch, n-i);
+}
+
+__attribute__((target("avx512bw")))
+static int8_t dploop8_avx512(int8_t *ptr_left, int8_t *ptr_diag, int8_t *ptr_up, int8_t *d, int8_t *p, int8_t gap_p, size_t n) {
+  size_t i;
+  __mmask64 m = ~(__mmask64) 0;
+  const __m512i gap = _mm512_set1_epi8(gap_p), one = _mm512_set1_epi8(1), two = _mm512_set1_epi8(2), three = _mm512_set1_epi8(3), floor = _mm512_set1_epi8(NW8_FLOOR);
+  __m512i left, diag, up, entry, pentry, dmax = floor;
+  __m256i dmax256;
+  for(i=0;i<n;i+=64) {
+    if(n-i < 64) { m = (~(__mmask64) 0) >> (64-(n-i)); }
+    left = _mm512_max_epi8(_mm512_adds_epi8(_mm512_maskz_loadu_epi8(m, &ptr_left[i]), gap), floor);
+    diag = _mm512_maskz_loadu_epi8(m, &ptr_diag[i]);
+    up = _mm512_max_epi8(_mm512_adds_epi8(_mm512_maskz_loadu_epi8(m, &ptr_up[i]), gap), floor);
+    pentry = _mm512_mask_blend_epi8(_mm512_cmpgt_epi8_mask(left, up), three, two); // up on ties
+    entry = _mm512_max_epi8(up, left);
+    pentry = _mm512_mask_blend_epi8(_mm512_cmpgt_epi8_mask(diag, entry), pentry, one);
+    entry = _mm512_max_epi8(entry, diag);
+    dmax = _mm512_mask_max_epi8(dmax, m, dmax, entry);
+    _mm512_mask_storeu_epi8(&d[i], m, entry);
+    _mm512_mask_storeu_epi8(&p[i], m, pentry);
+  }
+  // the maskz extracts zero their (fully masked-in) destination, where the plain ones start from an uninitialized vector
+  dmax256 = _mm256_max_epi8(_mm512_maskz_extracti64x4_epi64(0xFF, dmax, 0), _mm512_maskz_extracti64x4_epi64(0xFF, dmax, 1));
+  return hmax8(_mm_max_epi8(_mm256_castsi256_si128(dmax256), _mm256_extracti128_si256(dmax256, 1)), NW8_FLOOR);
+}
+
+__attribute__((target("avx512bw")))
+static int8_t dploop8_swap_avx512(int8_t *ptr_left, int8_t *ptr_diag, int8_t *ptr_up, int8_t *d, int8_t *p, int8_t gap_p, size_t n) {
+  size_t i;
+  __mmask64 m = ~(__mmask64) 0;
+  const __m512i gap = _mm512_set1_epi8(gap_p), one = _mm512_set1_epi8(1), two = _mm512_set1_epi8(2), three = _mm512_set1_epi8(3), floor = _mm512_set1_epi8(NW8_FLOOR);
+  __m512i left, diag, up, entry, pentry, dmax = floor;
+  __m256i dmax256;
+  for(i=0;i<n;i+=64) {
+    if(n-i < 64) { m = (~(__mmask64) 0) >> (64-(n-i)); }
+    left = _mm512_max_epi8(_mm512_adds_epi8(_mm512_maskz_loadu_epi8(m, &ptr_left[i]), gap), floor);
+    diag = _mm512_maskz_loadu_epi8(m, &ptr_diag[i]);
+    up = _mm512_max_epi8(_mm512_adds_epi8(_mm512_maskz_loadu_epi8(m, &ptr_up[i]), gap), floor);
+    pentry = _mm512_mask_blend_epi8(_mm512_cmpgt_epi8_mask(up, left), two, three); // left on ties
+    entry = _mm512_max_epi8(up, left);
+    pentry = _mm512_mask_blend_epi8(_mm512_cmpgt_epi8_mask(diag, entry), pentry, one);
+    entry = _mm512_max_epi8(entry, diag);
+    dmax = _mm512_mask_max_epi8(dmax, m, dmax, entry);
+    _mm512_mask_storeu_epi8(&d[i], m, entry);
+    _mm512_mask_storeu_epi8(&p[i], m, pentry);
+  }
+  // the maskz extracts zero their (fully masked-in) destination, where the plain ones start from an uninitialized vector
+  dmax256 = _mm256_max_epi8(_mm512_maskz_extracti64x4_epi64(0xFF, dmax, 0), _mm512_maskz_extracti64x4_epi64(0xFF, dmax, 1));
+  return hmax8(_mm_max_epi8(_mm256_castsi256_si128(dmax256), _mm256_extracti128_si256(dmax256, 1)), NW8_FLOOR);
+}
+
+__attribute__((target("avx512bw")))
+static void diagloop8_avx512(const int8_t *prev, const char *a, const char *b, int8_t *diag, int8_t match, int8_t mismatch, size_t n) {
+  size_t i;
+  __mmask64 m = ~(__mmask64) 0;
+  const __m512i vmatch = _mm512_set1_epi8(match), vmismatch = _mm512_set1_epi8(mismatch), floor = _mm512_set1_epi8(NW8_FLOOR);
+  __m512i vprev, va, vb, vdiag;
+  for(i=0;i<n;i+=64) {
+    if(n-i < 64) { m = (~(__mmask64) 0) >> (64-(n-i)); }
+    vprev = _mm512_maskz_loadu_epi8(m, &prev[i]);
+    va = _mm512_maskz_loadu_epi8(m, &a[i]);
+    vb = _mm512_maskz_loadu_epi8(m, &b[i]);
+    vdiag = _mm512_adds_epi8(vprev, _mm512_mask_blend_epi8(_mm512_cmpeq_epi8_mask(va, vb), vmismatch, vmatch));
+    _mm512_mask_storeu_epi8(&diag[i], m, _mm512_max_epi8(vdiag, floor));
+  }
+}
+#endif
+
+#ifdef NW_SIMD
+static const dploop8_fn dploop8 = nw_simd==3 ? dploop8_avx512 : nw_simd==2 ? dploop8_avx2 : nw_simd==1 ? dploop8_sse41 : dploop8_vec;
+static const dploop8_fn dploop8_swap = nw_simd==3 ? dploop8_swap_avx512 : nw_simd==2 ? dploop8_swap_avx2 : nw_simd==1 ? dploop8_swap_sse41 : dploop8_vec_swap;
+static const diagloop8_fn diagloop8 = nw_simd==3 ? diagloop8_avx512 : nw_simd==2 ? diagloop8_avx2 : nw_simd==1 ? diagloop8_sse41 : diagloop8_vec;
+#else
+static const dploop8_fn dploop8 = dploop8_vec;
+static const dploop8_fn dploop8_swap = dploop8_vec_swap;
+static const diagloop8_fn diagloop8 = diagloop8_vec;
+#endif
+
 void parr(int16_t *arr, int nrow, int ncol) {
   int col, row;
   for(row=0;row<nrow;row++) {
@@ -68,19 +752,24 @@ void parr(int16_t *arr, int nrow, int ncol) {
   }
 }
 
-char **nwalign_vectorized2(const char *s1, const char *s2, int16_t match, int16_t mismatch, int16_t gap_p, int16_t end_gap_p, int band) {
+// If homo1/homo2 are given, gaps in the homopolymers they mark are penalized by homo_gap_p instead of gap_p.
+// If score_tab is given, nts (encoded 1-4) are scored by score_tab[4*(nt1-1) + nt2-1] instead of match/mismatch.
+static void nwalign_vectorized2_path16(const char *s1, const char *s2, const unsigned char *homo1, const unsigned char *homo2, const int16_t *score_tab, int16_t match, int16_t mismatch, int16_t gap_p, int16_t homo_gap_p, int16_t end_gap_p, int band, AlignContext *ctx) {
   size_t row, col, ncol, nrow, foo;
   size_t i,j;
   size_t len1, len2;
   int16_t d_free;
-  size_t start_col, end_col;
+  size_t start_col;
   size_t col_min, col_max, even;
   size_t i_max, j_min;
   int16_t *ptr_left, *ptr_diag, *ptr_up, *ptr_d, *ptr_p;
+  int16_t *gap1 = NULL, *gap2 = NULL;
+  int16_t tab[16], score_min;
+  diagloop_mat_fn diag_mat = diagloop_mat;
   bool swap = false;
   bool recalc_left = false, recalc_right = false;
   const char *ptr_const_char;
-  char *ptr_char;
+  const unsigned char *ptr_const_uchar;
 
   len1 = strlen(s1);
   len2 = strlen(s2);
@@ -88,26 +777,51 @@ char **nwalign_vectorized2(const char *s1, const char *s2, int16_t match, int16_
     ptr_const_char = s1;
     s1 = s2;
     s2 = ptr_const_char;
+    ptr_const_uchar = homo1;
+    homo1 = homo2;
+    homo2 = ptr_const_uchar;
     swap = true;
     foo = len1;
     len1 = len2;
     len2 = foo;
   }
+  if(homo1 == NULL || homo2 == NULL) { homo_gap_p = gap_p; }
+  
+  // The score matrix, transposed if s1 and s2 were, and the lowest score
+  score_min = MIN(match, mismatch);
+  if(score_tab) {
+    score_min = INT16_MAX;
+    for(i=0;i<16;i++) {
+      tab[i] = swap ? score_tab[4*(i%4) + i/4] : score_tab[i];
+      score_min = MIN(score_min, tab[i]);
+      if(tab[i] < INT8_MIN || tab[i] > INT8_MAX) { diag_mat = diagloop_mat_vec; } // doesn't fit the byte lookup
+    }
+  }
   if(band < 0) { band = len2; }
   
   // Allocate the DP matrices
   start_col = 1 + (1+(band<len1 ? band : len1))/2;
-  end_col = start_col + (len2-len1)/2;
   //  ncol = 3 + (len1+len2+1)/2; // 3 = left boundary + center + right boundary !!!
   ncol = 2 + start_col + ((len2-len1+band)<len2 ? (len2-len1+band) : len2)/2;
   nrow = len1 + len2 + 1;
-  int16_t *d = (int16_t *) malloc(ncol * nrow * sizeof(int16_t));
-  int16_t *p = (int16_t *) malloc(ncol * nrow * sizeof(int16_t));
-  int16_t *diag_buf = (int16_t *) malloc(ncol * sizeof(int16_t));
-  if (d == NULL || p == NULL || diag_buf == NULL)  Rcpp::stop("Memory allocation failed.");
+  int16_t *d = (int16_t *) actx_reserve(&ctx->d, &ctx->d_size, ncol * nrow * sizeof(int16_t));
+  int16_t *p = (int16_t *) actx_reserve(&ctx->p, &ctx->p_size, ncol * nrow * sizeof(int16_t));
+  int16_t *diag_buf = (int16_t *) actx_reserve(&ctx->diag, &ctx->diag_size, ncol * sizeof(int16_t));
+  
+  // s1 reversed, so that the nts compared along an anti-diagonal are contiguous in both
+  char *rev1 = (char *) actx_reserve(&ctx->lseq, &ctx->lseq_size, len1);
+  for(i=0;i<len1;i++) { rev1[i] = s1[len1-1-i]; }
+  
+  // The penalty of a gap against each nt, of s1 reversed as rev1 and of s2
+  if(homo_gap_p != gap_p) {
+    gap1 = (int16_t *) actx_reserve(&ctx->gaps, &ctx->gaps_size, (len1+len2) * sizeof(int16_t));
+    gap2 = gap1 + len1;
+    for(i=0;i<len1;i++) { gap1[i] = homo1[len1-1-i] ? homo_gap_p : gap_p; }
+    for(j=0;j<len2;j++) { gap2[j] = homo2[j] ? homo_gap_p : gap_p; }
+  }
   
   // For banding issues later on
-  int16_t fill_val = INT16_MIN - MIN(MIN(mismatch, gap_p), MIN(match, 0));
+  int16_t fill_val = INT16_MIN - MIN(MIN(score_min, MIN(gap_p, homo_gap_p)), 0);
   for(row=0;row<nrow;row++) {
     d[row*ncol] = fill_val;
     d[row*ncol+1] = fill_val;
@@ -165,16 +879,23 @@ char **nwalign_vectorized2(const char *s1, const char *s2, int16_t match, int16_
   
   while(row <= (len1+len2)) {
       // Fill out row
-    for(col=col_min,i=i_max,j=j_min;col<(1+col_max);col++,i--,j++) {
-      diag_buf[col] = d[(row-2)*ncol + col] + (s1[i] == s2[j] ? match : mismatch);
+    // s1[i_max-k] is rev1[len1-1-i_max+k] for the k-th cell
+    if(score_tab) {
+      diag_mat(&d[(row-2)*ncol + col_min], &rev1[len1-1-i_max], &s2[j_min], &diag_buf[col_min], tab, col_max-col_min+1);
+    } else {
+      diagloop(&d[(row-2)*ncol + col_min], &rev1[len1-1-i_max], &s2[j_min], &diag_buf[col_min], match, mismatch, col_max-col_min+1);
     }
     ptr_left = &d[(row-1)*ncol + col_min-even];
     ptr_diag = &diag_buf[col_min];
     ptr_up = &d[(row-1)*ncol + col_min+1-even];
-    if(swap) {
-      dploop_vec_swap(ptr_left, ptr_diag, ptr_up, &d[row*ncol + col_min], &p[row*ncol + col_min], gap_p, col_max-col_min+1);
+    if(gap1 && swap) { // a left move gaps s2[j_min+k], an up move s1[i_max-k]
+      dploop_homo_swap(ptr_left, ptr_diag, ptr_up, &d[row*ncol + col_min], &p[row*ncol + col_min], &gap2[j_min], &gap1[len1-1-i_max], col_max-col_min+1);
+    } else if(gap1) {
+      dploop_homo(ptr_left, ptr_diag, ptr_up, &d[row*ncol + col_min], &p[row*ncol + col_min], &gap2[j_min], &gap1[len1-1-i_max], col_max-col_min+1);
+    } else if(swap) {
+      dploop_swap(ptr_left, ptr_diag, ptr_up, &d[row*ncol + col_min], &p[row*ncol + col_min], gap_p, col_max-col_min+1);
     } else {
-      dploop_vec(ptr_left, ptr_diag, ptr_up, &d[row*ncol + col_min], &p[row*ncol + col_min], gap_p, col_max-col_min+1);
+      dploop(ptr_left, ptr_diag, ptr_up, &d[row*ncol + col_min], &p[row*ncol + col_min], gap_p, col_max-col_min+1);
     }
     
     // Offset to the boundary after top wedge (w/ prefilled boundary) is done
@@ -188,7 +909,7 @@ char **nwalign_vectorized2(const char *s1, const char *s2, int16_t match, int16_
     }
     
     // Recalculate ends-free cells for lower boundary
-    if(end_gap_p > gap_p) {
+    if(end_gap_p > gap_p || end_gap_p > homo_gap_p) {
       // Left column
       if(recalc_left) { // past first row of lower tri
         d_free = ptr_left[0] + end_gap_p; // first cell of left array
@@ -256,92 +977,572 @@ char **nwalign_vectorized2(const char *s1, const char *s2, int16_t match, int16_
 //    Rprintf("Score: %d\n", d[(len1+len2)*ncol + (2*start_col+len2-len1)/2]);
 //  }
 
-  char *al0 = (char *) malloc((nrow+1) * sizeof(char));
-  char *al1 = (char *) malloc((nrow+1) * sizeof(char));
-  if(al0 == NULL || al1 == NULL) Rcpp::stop("Memory allocation failed.");
-  
-  // Trace back over p to form the alignment.
+  // Trace back over p to form the alignment path, in the input ordering
+  char *path = (char *) actx_reserve(&ctx->path, &ctx->path_size, len1+len2);
   size_t len_al = 0;
+  int16_t move;
   i = len1;
   j = len2;
   
   while ( i > 0 || j > 0 ) {
-    switch ( p[(i+j)*ncol + (2*start_col+j-i)/2] ) {
+    move = p[(i+j)*ncol + (2*start_col+j-i)/2];
+    switch ( move ) {
       case 1:
-        al0[len_al] = s1[--i];
-        al1[len_al] = s2[--j];
+        i--; j--;
         break;
       case 2:
-        al0[len_al] = '-';
-        al1[len_al] = s2[--j];
+        j--;
         break;
       case 3:
-        al0[len_al] = s1[--i];
-        al1[len_al] = '-';
+        i--;
         break;
       default:
-        Rprintf("len1/2=(%i, %i), nrow,ncol=(%i,%i), ij=(%i,%i), rc=(%i,%i), d[][]=%i, p[][]=%i\n", len1, len2, nrow, ncol, i,j,i+j,(2*start_col+j-i)/2, d[(i+j)*ncol + (2*start_col+j-i)/2], p[(i+j)*ncol + (2*start_col+j-i)/2]);
+        Rprintf("len1/2=(%i, %i), nrow,ncol=(%i,%i), ij=(%i,%i), rc=(%i,%i), d[][]=%i, p[][]=%i\n", (int) len1, (int) len2, (int) nrow, (int) ncol, (int) i, (int) j, (int) (i+j), (int) ((2*start_col+j-i)/2), d[(i+j)*ncol + (2*start_col+j-i)/2], p[(i+j)*ncol + (2*start_col+j-i)/2]);
         Rcpp::stop("N-W Align out of range.");
     }
-    len_al++;
+    if(swap && move != 1) { move = 5 - move; } // a gap in one is a gap in the other
+    path[len_al++] = move;
+  }
+  ctx->len_path = len_al;
+}
+
+/* nwalign_vectorized2_path8:
+ nwalign_vectorized2_path16 in 8-bit scores, twice as many cells per instruction. Each row is stored
+ relative to an offset that follows its best cell, doubled and marked if only a bound (see NW8_FLOOR).
+ The bounds are never below the true scores, so an unmarked cell beat them all in 16 bits as well and
+ has the same score and move there. So if no cell on the traceback path is marked, the path is the same
+ as in 16 bits. Returns false if it may not be (or a score saturated upwards), to rerun in 16 bits.
+*/
+static bool nwalign_vectorized2_path8(const char *s1, const char *s2, int16_t match, int16_t mismatch, int16_t gap_p, int16_t end_gap_p, int band, AlignContext *ctx) {
+  size_t row, col, ncol, nrow, foo;
+  size_t i,j;
+  size_t len1, len2;
+  int d_free, dmatch, dmismatch;
+  int off_prev = 0, off_prev2 = 0; // the offsets of the scores of the last two rows
+  int8_t row_max, dmax;
+  size_t start_col;
+  size_t col_min, col_max, even;
+  size_t i_max, j_min;
+  int8_t *ptr_left, *ptr_diag, *ptr_up;
+  bool swap = false;
+  bool recalc_left = false, recalc_right = false;
+  const char *ptr_const_char;
+
+  len1 = strlen(s1);
+  len2 = strlen(s2);
+  if(len1 > len2) { // Ensure s1 is the shorter sequences
+    ptr_const_char = s1;
+    s1 = s2;
+    s2 = ptr_const_char;
+    swap = true;
+    foo = len1;
+    len1 = len2;
+    len2 = foo;
+  }
+  if(band < 0) { band = len2; }
+  
+  // Allocate the DP matrices, cells that are never filled out are bounds at the floor
+  start_col = 1 + (1+(band<len1 ? band : len1))/2;
+  ncol = 2 + start_col + ((len2-len1+band)<len2 ? (len2-len1+band) : len2)/2;
+  nrow = len1 + len2 + 1;
+  int8_t *d = (int8_t *) actx_reserve(&ctx->d, &ctx->d_size, ncol * nrow);
+  int8_t *p = (int8_t *) actx_reserve(&ctx->p, &ctx->p_size, ncol * nrow);
+  int8_t *diag_buf = (int8_t *) actx_reserve(&ctx->diag, &ctx->diag_size, ncol);
+  memset(d, NW8_FLOOR, ncol * nrow);
+  
+  // s1 reversed, so that the nts compared along an anti-diagonal are contiguous in both
+  char *rev1 = (char *) actx_reserve(&ctx->lseq, &ctx->lseq_size, len1);
+  for(i=0;i<len1;i++) { rev1[i] = s1[len1-1-i]; }
+
+  // Fill out starting point, and the ends-free cells of the first row (offsets 0)
+  d[start_col] = 0;
+  p[start_col] = 0; // Should never be queried
+  if(1 < (1 + (band < len1 ? band : len1))) {
+    d[ncol + start_col-1] = sat8(2*end_gap_p);
+    p[ncol + start_col-1] = 3;
+  }
+  if(1 < (1+(band+len2-len1 < len2 ? band+len2-len1 : len2))) {
+    d[ncol + start_col] = sat8(2*end_gap_p);
+    p[ncol + start_col] = 2;
+  }
+  
+  // Fill out DP matrix (Row 0/1 taken care of by ends-free)
+  row = 2;
+  col_min = start_col; // Do not fill out the ends-free cells
+  col_max = start_col;
+  i_max = 0; // 1st nt
+  j_min = 0; // 1st nt
+  even = 1; // TRUE
+  
+  while(row <= (len1+len2)) {
+    // The ends-free cells of the "left" "column" and "top" "row", relative to the last row
+    row_max = NW8_FLOOR;
+    if(row < (1 + (band < len1 ? band : len1))) {
+      row_max = d[row*ncol + start_col-1-(row-1)/2] = sat8(2*((int) row*end_gap_p - off_prev));
+      p[row*ncol + start_col-1-(row-1)/2] = 3;
+    }
+    if(row < (1+(band+len2-len1 < len2 ? band+len2-len1 : len2))) {
+      row_max = d[row*ncol + start_col+row/2] = sat8(2*((int) row*end_gap_p - off_prev));
+      p[row*ncol + start_col+row/2] = 2;
+    }
+    
+    // Fill out row, relative to the last row. s1[i_max-k] is rev1[len1-1-i_max+k] for the k-th cell
+    dmatch = 2*(match + off_prev2 - off_prev);
+    dmismatch = 2*(mismatch + off_prev2 - off_prev);
+    if(dmatch > INT8_MAX || dmatch < INT8_MIN || dmismatch > INT8_MAX || dmismatch < INT8_MIN) { return false; }
+    diagloop8(&d[(row-2)*ncol + col_min], &rev1[len1-1-i_max], &s2[j_min], &diag_buf[col_min], dmatch, dmismatch, col_max-col_min+1);
+    ptr_left = &d[(row-1)*ncol + col_min-even];
+    ptr_diag = &diag_buf[col_min];
+    ptr_up = &d[(row-1)*ncol + col_min+1-even];
+    if(swap) {
+      dmax = dploop8_swap(ptr_left, ptr_diag, ptr_up, &d[row*ncol + col_min], &p[row*ncol + col_min], 2*gap_p, col_max-col_min+1);
+    } else {
+      dmax = dploop8(ptr_left, ptr_diag, ptr_up, &d[row*ncol + col_min], &p[row*ncol + col_min], 2*gap_p, col_max-col_min+1);
+    }
+    row_max = dmax > row_max ? dmax : row_max;
+    
+    // Offset to the boundary after top wedge (w/ prefilled boundary) is done
+    if(row==(band<len1 ? band : len1)) { 
+      col_min--;
+      i_max++;
+      j_min--;
+    }
+    if(row == (band+len2-len1 < len2 ? band+len2-len1 : len2)) {
+      col_max++;
+    }
+    
+    // Recalculate ends-free cells for lower boundary
+    if(end_gap_p > gap_p) {
+      // Left column
+      if(recalc_left) { // past first row of lower tri
+        d_free = sat8(ptr_left[0] + 2*end_gap_p); // first cell of left array
+        if(d_free > d[row*ncol + col_min]) { // ends-free gap is better
+          d[row*ncol + col_min] = d_free;
+          p[row*ncol + col_min] = 2;
+          row_max = d_free > row_max ? d_free : row_max;
+        } else if(!swap && d_free == d[row*ncol + col_min] && p[row*ncol + col_min] == 1) { // left gap takes precedence over diagonal move (for consistency)
+          p[row*ncol + col_min] = 2;
+        } else if(swap && d_free == d[row*ncol + col_min] && p[row*ncol + col_min] != 2) { // left-is-up, and takes precedence other moves
+          p[row*ncol + col_min] = 2;
+        }
+      }
+      if(i_max == len1-1) { recalc_left = true; }
+      // Right column
+      if(recalc_right) {
+        d_free = sat8(ptr_up[col_max-col_min] + 2*end_gap_p); // last cell of up array
+        if(d_free > d[row*ncol + col_max]) { // ends-free gap is better
+          d[row*ncol + col_max] = d_free;
+          p[row*ncol + col_max] = 3;
+          row_max = d_free > row_max ? d_free : row_max;
+        } else if(!swap && d_free == d[row*ncol + col_max] && p[row*ncol + col_max] != 3) { // up gap takes precedence over left or diagonal move (for consistency)
+          p[row*ncol + col_max] = 3;
+        } else if(swap && d_free == d[row*ncol + col_max] && p[row*ncol + col_max] == 1) { // up-is-left, and takes precedence over diagonal
+          p[row*ncol + col_max] = 3;
+        }
+      }
+      if((row+1)/2 + col_max - start_col == len2) { recalc_right = true; }
+    }
+    
+    // Bring the best cell of the row back to 0 (or 1, if marked) once it strays far enough
+    if(row_max == INT8_MAX) { return false; }
+    off_prev2 = off_prev;
+    if(row_max > NW8_DRIFT || row_max < -NW8_DRIFT) {
+      for(col=0;col<ncol;col++) {
+        d[row*ncol + col] = sat8(d[row*ncol + col] - 2*(row_max >> 1));
+      }
+      off_prev += row_max >> 1;
+    }
+    
+    // Update the indices
+    if(row < band && row < len1) { // upper tri for seq1
+      if(even) { col_min--; }
+      i_max++;
+    } else if(i_max < len1-1) { // banded area
+      if(band%2 == 0) {
+        if(even) { j_min++; }
+        else { i_max++; }
+      } else { // odd band
+        if(even) { col_min--; i_max++; }
+        else { col_min++; j_min++; }
+      }
+    } else { // lower tri for seq1
+      if(!even) { col_min++; }
+      j_min++;
+    }
+
+    if(row<(band+len2-len1 < len2 ? band+len2-len1 : len2)) {
+      if(!even) { col_max++; }
+    } else if((row+1)/2 + col_max - start_col < len2) { // "j_max" (1-index) < len2
+      if((band+len2-len1) % 2 == 0) { // even band (including the extra band from length difference)
+        if(even) { col_max--; }
+        else { col_max++; }
+      } // no action on odd band
+    } else {
+      if(even) { col_max--; }
+    }
+    
+    row++;
+    even = 1 - even;
   }
-  al0[len_al] = '\0';
-  al1[len_al] = '\0';
+
+  // Trace back over p to form the alignment path, in the input ordering, giving up at a bound
+  char *path = (char *) actx_reserve(&ctx->path, &ctx->path_size, len1+len2);
+  size_t len_al = 0;
+  int8_t move;
+  i = len1;
+  j = len2;
   
-  // Free DP objects
-  free(d);
-  free(p);
-  free(diag_buf);
+  while ( i > 0 || j > 0 ) {
+    if(d[(i+j)*ncol + (2*start_col+j-i)/2] & 1) { return false; }
+    move = p[(i+j)*ncol + (2*start_col+j-i)/2];
+    switch ( move ) {
+      case 1:
+        i--; j--;
+        break;
+      case 2:
+        j--;
+        break;
+      case 3:
+        i--;
+        break;
+      default:
+        return false;
+    }
+    if(swap && move != 1) { move = 5 - move; } // a gap in one is a gap in the other
+    path[len_al++] = move;
+  }
+  ctx->len_path = len_al;
+  return true;
+}
+
+// Aligns in 8 bits when the scores allow it, and in 16 bits if that is not enough (counted in ctx->nw_narrow)
+void nwalign_vectorized2_path(const char *s1, const char *s2, int16_t match, int16_t mismatch, int16_t gap_p, int16_t end_gap_p, int band, AlignContext *ctx) {
+  ctx->nw_narrow = 0;
+  if(gap_p <= 0 && gap_p >= -NW8_MAX_PEN && end_gap_p <= 0 && end_gap_p >= -NW8_MAX_PEN &&
+     match <= NW8_MAX_PEN && match >= -NW8_MAX_PEN && mismatch <= NW8_MAX_PEN && mismatch >= -NW8_MAX_PEN) {
+    ctx->nw_narrow = 1;
+    if(nwalign_vectorized2_path8(s1, s2, match, mismatch, gap_p, end_gap_p, band, ctx)) { return; }
+    ctx->nw_narrow = 2;
+  }
+  nwalign_vectorized2_path16(s1, s2, NULL, NULL, NULL, match, mismatch, gap_p, gap_p, end_gap_p, band, ctx);
+}
+
+// nwalign_vectorized2_path with gaps in homopolymers penalized by homo_gap_p, as in nwalign_endsfree_homo.
+// homo1/homo2 are the homo_masks of s1/s2 (as kept in Raw), or NULL to find them here. Always in 16 bits.
+void nwalign_vectorized2_homo_path(const char *s1, const char *s2, const unsigned char *homo1, const unsigned char *homo2, int16_t match, int16_t mismatch, int16_t gap_p, int16_t homo_gap_p, int16_t end_gap_p, int band, AlignContext *ctx) {
+  size_t len1, len2;
   
-  // Return to input ordering
-  if(swap) {
-    ptr_char = al0;
-    al0 = al1;
-    al1 = ptr_char;
+  ctx->nw_narrow = 0;
+  if(homo1 == NULL || homo2 == NULL) {
+    len1 = strlen(s1);
+    len2 = strlen(s2);
+    unsigned char *homo = (unsigned char *) actx_reserve(&ctx->homo, &ctx->homo_size, (len1+len2)*sizeof(unsigned char));
+    homo_mask(s1, len1, homo);
+    homo_mask(s2, len2, homo + len1);
+    homo1 = homo;
+    homo2 = homo + len1;
   }
+  nwalign_vectorized2_path16(s1, s2, homo1, homo2, NULL, match, mismatch, gap_p, homo_gap_p, end_gap_p, band, ctx);
+}
+
+// nwalign_vectorized2_path scoring by the full score matrix, for sequences encoded 1-4 as in Raw.
+// Gaps in the homopolymers marked by homo1/homo2 are penalized by homo_gap_p, unless they are NULL. Always in 16 bits.
+void nwalign_vectorized2_score_path(const char *s1, const char *s2, const unsigned char *homo1, const unsigned char *homo2, int score[4][4], int16_t gap_p, int16_t homo_gap_p, int16_t end_gap_p, int band, AlignContext *ctx) {
+  int16_t score_tab[16];
+  int i, j;
   
-  // Allocate memory to alignment strings.
-  char **al = (char **) malloc( 2 * sizeof(char *) ); //E
-  if (al == NULL)  Rcpp::stop("Failed memory allocation.");
-  al[0] = (char *) malloc(len_al+1); //E
-  al[1] = (char *) malloc(len_al+1); //E
-  if (al[0] == NULL || al[1] == NULL)  Rcpp::stop("Failed memory allocation.");
+  ctx->nw_narrow = 0;
+  for(i=0;i<4;i++) {
+    for(j=0;j<4;j++) {
+      score_tab[4*i+j] = (int16_t) score[i][j];
+    }
+  }
+  nwalign_vectorized2_path16(s1, s2, homo1, homo2, score_tab, score[0][0], score[0][1], gap_p, homo_gap_p, end_gap_p, band, ctx);
+}
+
+/* nwalign_vectorized2_batch_path:
+ Aligns s1 to each of the n (at most ALIGN_LANES) sequences s2[], which must all have the same length,
+ by the same recurrence as nwalign_vectorized2_path. As the lengths are shared so is the geometry of the
+ band, and the DP matrices hold the cells of all the lanes side by side: the cell (row, col) of lane k is
+ at [(row*ncol + col)*ALIGN_LANES + k]. Each anti-diagonal of the band is then one contiguous run for
+ dploop_vec, ALIGN_LANES times as long. The path of lane k is left in the context by actx_lane_path.
+*/
+void nwalign_vectorized2_batch_path(const char *s1, const char **s2, unsigned int n, int16_t match, int16_t mismatch, int16_t gap_p, int16_t end_gap_p, int band, AlignContext *ctx) {
+  const size_t W = ALIGN_LANES;
+  size_t row, col, ncol, nrow, foo;
+  size_t i,j,k;
+  size_t len1, len2;
+  int16_t d_free;
+  size_t start_col;
+  size_t col_min, col_max, col_min_prev, even;
+  size_t i_max, j_min;
+  int16_t *ptr_left, *ptr_diag, *ptr_up, *ptr_d, *ptr_p, *ptr_prev;
+  bool swap = false;
+  bool recalc_left = false, recalc_right = false;
+  const char *fixed = s1; // the sequence shared by all lanes
+  char fixed_nt[ALIGN_LANES];
   
-  // Reverse the alignment strings (since traced backwards).
-  for (i=0;i<len_al;i++) {
-    al[0][i] = al0[len_al-i-1];
-    al[1][i] = al1[len_al-i-1];
+  if(n == 0) { return; }
+  if(n > W) { Rcpp::stop("Too many sequences for one batch alignment."); }
+  len1 = strlen(s1);
+  len2 = strlen(s2[0]);
+  for(k=1;k<n;k++) {
+    if(strlen(s2[k]) != len2) { Rcpp::stop("Sequences in a batch alignment must have the same length."); }
   }
-  al[0][len_al] = '\0';
-  al[1][len_al] = '\0';
+  if(len1 > len2) { // Ensure s1 is the shorter sequences, here the lanes
+    swap = true;
+    foo = len1;
+    len1 = len2;
+    len2 = foo;
+  }
+  if(band < 0) { band = len2; }
   
-  free(al0);
-  free(al1);
+  // Interleave the lane sequences by position, unused lanes repeat the first
+  size_t len_lane = swap ? len1 : len2;
+  char *lseq = (char *) actx_reserve(&ctx->lseq, &ctx->lseq_size, len_lane * W);
+  for(k=0;k<W;k++) {
+    const char *s = s2[k<n ? k : 0];
+    for(i=0;i<len_lane;i++) { lseq[i*W+k] = s[i]; }
+  }
   
-  return al;
+  // Allocate the DP matrices
+  start_col = 1 + (1+(band<len1 ? band : len1))/2;
+  ncol = 2 + start_col + ((len2-len1+band)<len2 ? (len2-len1+band) : len2)/2;
+  nrow = len1 + len2 + 1;
+  int16_t *d = (int16_t *) actx_reserve(&ctx->d, &ctx->d_size, ncol * nrow * W * sizeof(int16_t));
+  int16_t *p = (int16_t *) actx_reserve(&ctx->p, &ctx->p_size, ncol * nrow * W * sizeof(int16_t));
+  int16_t *diag_buf = (int16_t *) actx_reserve(&ctx->diag, &ctx->diag_size, ncol * W * sizeof(int16_t));
+  
+  // For banding issues later on
+  int16_t fill_val = INT16_MIN - MIN(MIN(mismatch, gap_p), MIN(match, 0));
+  for(row=0;row<nrow;row++) {
+    for(k=0;k<W;k++) {
+      d[(row*ncol)*W+k] = fill_val;
+      d[(row*ncol+1)*W+k] = fill_val;
+      d[(row*ncol+ncol-2)*W+k] = fill_val;
+      d[(row*ncol+ncol-1)*W+k] = fill_val;
+    }
+  }
+
+  // Fill out starting point
+  for(k=0;k<W;k++) {
+    d[start_col*W+k] = 0;
+    p[start_col*W+k] = 0; // Should never be queried
+  }
+  
+  // Fill out "left" "column" of d, p.
+  row=1;
+  col=start_col-1;
+  ptr_d=&d[ncol*W]; // start of 1st row
+  ptr_p=&p[ncol*W];
+  d_free = end_gap_p; // end-gap score
+  while(row < (1 + (band < len1 ? band : len1))) {
+    for(k=0;k<W;k++) {
+      ptr_d[col*W+k] = d_free; // end gap
+      ptr_p[col*W+k] = 3;
+    }
+    if(row%2==0) {
+      col--;
+    }
+    row++;
+    d_free += end_gap_p;
+    ptr_d += ncol*W;
+    ptr_p += ncol*W;
+  }
+  
+  // Fill out "top" "row" of d, p.
+  row=1;
+  col=start_col;
+  ptr_d=&d[ncol*W]; // start of 1st row
+  ptr_p=&p[ncol*W];
+  d_free = end_gap_p; // end-gap score
+  while(row < (1+(band+len2-len1 < len2 ? band+len2-len1 : len2))) {
+    for(k=0;k<W;k++) {
+      ptr_d[col*W+k] = d_free;
+      ptr_p[col*W+k] = 2;
+    }
+    if(row%2 == 1) {
+      col++;
+    }
+    row++;
+    d_free += end_gap_p;
+    ptr_d += ncol*W;
+    ptr_p += ncol*W;
+  }
+
+  // Fill out DP matrix (Row 0/1 taken care of by ends-free)
+  row = 2;
+  col_min = start_col; // Do not fill out the ends-free cells
+  col_max = start_col;
+  i_max = 0; // 1st nt
+  j_min = 0; // 1st nt
+  even = 1; // TRUE
+  
+  while(row <= (len1+len2)) {
+    // Fill out row, the shared sequence is s2 of the recurrence if swapped and s1 otherwise
+    for(col=col_min,i=i_max,j=j_min;col<(1+col_max);col++,i--,j++) {
+      memset(fixed_nt, swap ? fixed[j] : fixed[i], W);
+      diagloop(&d[((row-2)*ncol + col)*W], fixed_nt, &lseq[(swap ? i : j)*W], &diag_buf[col*W], match, mismatch, W);
+    }
+    ptr_left = &d[((row-1)*ncol + col_min-even)*W];
+    ptr_diag = &diag_buf[col_min*W];
+    ptr_up = &d[((row-1)*ncol + col_min+1-even)*W];
+    if(swap) {
+      dploop_swap(ptr_left, ptr_diag, ptr_up, &d[(row*ncol + col_min)*W], &p[(row*ncol + col_min)*W], gap_p, (col_max-col_min+1)*W);
+    } else {
+      dploop(ptr_left, ptr_diag, ptr_up, &d[(row*ncol + col_min)*W], &p[(row*ncol + col_min)*W], gap_p, (col_max-col_min+1)*W);
+    }
+    col_min_prev = col_min;
+    
+    // Offset to the boundary after top wedge (w/ prefilled boundary) is done
+    if(row==(band<len1 ? band : len1)) { 
+      col_min--;
+      i_max++;
+      j_min--;
+    }
+    if(row == (band+len2-len1 < len2 ? band+len2-len1 : len2)) {
+      col_max++;
+    }
+    
+    // Recalculate ends-free cells for lower boundary, lane by lane
+    if(end_gap_p > gap_p) {
+      // Left column
+      if(recalc_left) { // past first row of lower tri
+        ptr_d = &d[(row*ncol + col_min)*W];
+        ptr_p = &p[(row*ncol + col_min)*W];
+        for(k=0;k<W;k++) {
+          d_free = ptr_left[k] + end_gap_p; // first cell of left array
+          if(d_free > ptr_d[k]) { // ends-free gap is better
+            ptr_d[k] = d_free;
+            ptr_p[k] = 2;
+          } else if(!swap && d_free == ptr_d[k] && ptr_p[k] == 1) { // left gap takes precedence over diagonal move (for consistency)
+            ptr_p[k] = 2;
+          } else if(swap && d_free == ptr_d[k] && ptr_p[k] != 2) { // left-is-up, and takes precedence other moves
+            ptr_p[k] = 2;
+          }
+        }
+      }
+      if(i_max == len1-1) { recalc_left = true; }
+      // Right column
+      if(recalc_right) {
+        ptr_prev = &d[((row-1)*ncol + col_min_prev+1-even + col_max-col_min)*W]; // last cell of up array
+        ptr_d = &d[(row*ncol + col_max)*W];
+        ptr_p = &p[(row*ncol + col_max)*W];
+        for(k=0;k<W;k++) {
+          d_free = ptr_prev[k] + end_gap_p;
+          if(d_free > ptr_d[k]) { // ends-free gap is better
+            ptr_d[k] = d_free;
+            ptr_p[k] = 3;
+          } else if(!swap && d_free == ptr_d[k] && ptr_p[k] != 3) { // up gap takes precedence over left or diagonal move (for consistency)
+            ptr_p[k] = 3;
+          } else if(swap && d_free == ptr_d[k] && ptr_p[k] == 1) { // up-is-left, and takes precedence over diagonal
+            ptr_p[k] = 3;
+          }
+        }
+      }
+      if((row+1)/2 + col_max - start_col == len2) { recalc_right = true; }
+    }
+    // Update the indices
+    if(row < band && row < len1) { // upper tri for seq1
+      if(even) { col_min--; }
+      i_max++;
+    } else if(i_max < len1-1) { // banded area
+      if(band%2 == 0) {
+        if(even) { j_min++; }
+        else { i_max++; }
+      } else { // odd band
+        if(even) { col_min--; i_max++; }
+        else { col_min++; j_min++; }
+      }
+    } else { // lower tri for seq1
+      if(!even) { col_min++; }
+      j_min++;
+    }
+
+    if(row<(band+len2-len1 < len2 ? band+len2-len1 : len2)) {
+      if(!even) { col_max++; }
+    } else if((row+1)/2 + col_max - start_col < len2) { // "j_max" (1-index) < len2
+      if((band+len2-len1) % 2 == 0) { // even band (including the extra band from length difference)
+        if(even) { col_max--; }
+        else { col_max++; }
+      } // no action on odd band
+    } else {
+      if(even) { col_max--; }
+    }
+    
+    row++;
+    even = 1 - even;
+  }
+
+  // Trace back over p for each lane to form the alignment paths, in the input ordering
+  ctx->lpath_stride = len1+len2;
+  char *lpath = (char *) actx_reserve(&ctx->lpath, &ctx->lpath_size, W * (len1+len2));
+  size_t len_al;
+  int16_t move;
+  for(k=0;k<n;k++) {
+    char *path = &lpath[k*ctx->lpath_stride];
+    len_al = 0;
+    i = len1;
+    j = len2;
+    while ( i > 0 || j > 0 ) {
+      move = p[((i+j)*ncol + (2*start_col+j-i)/2)*W+k];
+      switch ( move ) {
+        case 1:
+          i--; j--;
+          break;
+        case 2:
+          j--;
+          break;
+        case 3:
+          i--;
+          break;
+        default:
+          Rprintf("len1/2=(%i, %i), nrow,ncol=(%i,%i), ij=(%i,%i), lane=%i, p[][]=%i\n", (int) len1, (int) len2, (int) nrow, (int) ncol, (int) i, (int) j, (int) k, p[((i+j)*ncol + (2*start_col+j-i)/2)*W+k]);
+          Rcpp::stop("N-W Align out of range.");
+      }
+      if(swap && move != 1) { move = 5 - move; } // a gap in one is a gap in the other
+      path[len_al++] = move;
+    }
+    ctx->lane_len_path[k] = len_al;
+  }
+}
+
+char **nwalign_vectorized2(const char *s1, const char *s2, int16_t match, int16_t mismatch, int16_t gap_p, int16_t end_gap_p, int band, AlignContext *ctx) {
+  nwalign_vectorized2_path(s1, s2, match, mismatch, gap_p, end_gap_p, band, ctx);
+  return path2al(s1, s2, ctx);
+}
+
+char **nwalign_vectorized2_homo(const char *s1, const char *s2, int16_t match, int16_t mismatch, int16_t gap_p, int16_t homo_gap_p, int16_t end_gap_p, int band, AlignContext *ctx) {
+  nwalign_vectorized2_homo_path(s1, s2, NULL, NULL, match, mismatch, gap_p, homo_gap_p, end_gap_p, band, ctx);
+  return path2al(s1, s2, ctx);
 }
 
 // [[Rcpp::export]]
-Rcpp::CharacterVector C_nwvec(std::vector<std::string> s1, std::vector<std::string> s2, int16_t match, int16_t mismatch, int16_t gap_p, int band, bool endsfree) {
+Rcpp::CharacterVector C_nwvec(std::vector<std::string> s1, std::vector<std::string> s2, int16_t match, int16_t mismatch, int16_t gap_p, int16_t homo_gap_p, int band, bool endsfree) {
   char **al;
   int i;
+  AlignContext ctx;
   if(s1.size() != s2.size()) {
     Rcpp::stop("Character vectors to be aligned must be of equal length.");
   }
+  if(!endsfree && gap_p != homo_gap_p) {
+    Rprintf("Warning: A separate homopolymer gap penalty isn't implemented when endsfree=FALSE.\n\tAll gaps will be penalized by the regular gap penalty.\n");
+  }
   Rcpp::CharacterVector rval(s1.size()*2);
   
+  actx_init(&ctx);
   for(i=0;i<s1.size();i++) {
-    if(endsfree) {
-      al = nwalign_vectorized2(s1[i].c_str(), s2[i].c_str(), match, mismatch, gap_p, 0, (size_t) band);
+    if(endsfree && gap_p != homo_gap_p) {
+      al = nwalign_vectorized2_homo(s1[i].c_str(), s2[i].c_str(), match, mismatch, gap_p, homo_gap_p, 0, (size_t) band, &ctx);
+    } else if(endsfree) {
+      al = nwalign_vectorized2(s1[i].c_str(), s2[i].c_str(), match, mismatch, gap_p, 0, (size_t) band, &ctx);
     } else {
-      al = nwalign_vectorized2(s1[i].c_str(), s2[i].c_str(), match, mismatch, gap_p, gap_p, (size_t) band);
+      al = nwalign_vectorized2(s1[i].c_str(), s2[i].c_str(), match, mismatch, gap_p, gap_p, (size_t) band, &ctx);
     }
 
     rval[2*i] = std::string(al[0]);
     rval[2*i+1] = std::string(al[1]);
-    free(al[0]);
-    free(al[1]);
-    free(al);
   }
+  actx_free(&ctx);
   return(rval);
 }
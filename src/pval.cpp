@@ -3,13 +3,99 @@ Pval.cpp contains the functions related to calculating the abundance pval in DAD
 */
 
 #include <Rcpp.h>
+#include <float.h>
 #include "dada.h"
 
 // [[Rcpp::interfaces(r, cpp)]]
 
+// Stirling's formula error log(n!) - log(sqrt(2*pi*n)*(n/e)^n), exact for small n
+static const double stirl_small[16] = {
+  0.0, // n=0 is handled separately
+  8.1061466795327261070e-02, 4.1340695955409297035e-02, 2.7677925684998338357e-02,
+  2.0790672103765093365e-02, 1.6644691189821193139e-02, 1.3876128823070748436e-02,
+  1.1896709945891769528e-02, 1.0411265261972096202e-02, 9.2554621827127328548e-03,
+  8.3305634333628707927e-03, 7.5736754879518405903e-03, 6.9428401072095299179e-03,
+  6.4089941880042071432e-03, 5.9513701127588474957e-03, 5.5547335519628010525e-03
+};
+
+static double stirlerr(int n) {
+  double nn;
+  if(n <= 15) { return stirl_small[n]; }
+  nn = ((double) n)*n;
+  if(n > 500) { return (1.0/12 - (1.0/360)/nn)/n; }
+  if(n > 80) { return (1.0/12 - (1.0/360 - (1.0/1260)/nn)/nn)/n; }
+  if(n > 35) { return (1.0/12 - (1.0/360 - (1.0/1260 - (1.0/1680)/nn)/nn)/nn)/n; }
+  return (1.0/12 - (1.0/360 - (1.0/1260 - (1.0/1680 - (1.0/1188)/nn)/nn)/nn)/nn)/n;
+}
+
+// Deviance term x*log(x/np) + np - x, by series when x and np are close
+static double bd0(double x, double np) {
+  double ej, s, s1, v;
+  int j;
+  if(fabs(x-np) < 0.1*(x+np)) {
+    v = (x-np)/(x+np);
+    s = (x-np)*v;
+    ej = 2*x*v;
+    v = v*v;
+    for(j=1;j<1000;j++) {
+      ej *= v;
+      s1 = s+ej/((j<<1)+1);
+      if(s1 == s) { return s1; }
+      s = s1;
+    }
+  }
+  return x*log(x/np)+np-x;
+}
+
+// Log of the poisson pmf at k, via Loader's saddle point expansion
+static double log_dpois(int k, double E) {
+  if(k == 0) { return -E; }
+  return -stirlerr(k) - bd0((double) k, E) - 0.5*log(2*M_PI*k);
+}
+
+// Upper tail of the poisson distribution, P(X >= n) for X ~ Pois(E)
+// Sums the pmf from n away from the mode, ie. the upper tail directly if n > E,
+// or the lower tail from n-1 downwards if n <= E. Each sum is stopped once its
+// geometric bound on the remaining terms is below double precision.
+// Does not touch R, so is safe to call from worker threads.
+double ppois_upper(int n, double E) {
+  int k;
+  double t, sum;
+  if(n <= 0) { return 1.0; }
+  if(E <= 0) { return 0.0; }
+  
+  if(n > E) {
+    t = 1.0; sum = 1.0;
+    for(k=n+1;;k++) {
+      t *= E/k;
+      sum += t;
+      if(t*E < sum*DBL_EPSILON*(k+1-E)) { break; }
+    }
+    return exp(log_dpois(n, E) + log(sum));
+  } else {
+    t = 1.0; sum = 1.0;
+    for(k=n-1;k>0;k--) {
+      t *= k/E;
+      sum += t;
+      if(t*(k-1) < sum*DBL_EPSILON*(E-k+1)) { break; }
+    }
+    return -expm1(log_dpois(n-1, E) + log(sum));
+  }
+}
+
 // Calculate abundance pval for given reads and expected number of reads
-double calc_pA(int reads, double E_reads) {
+// If memo is not NULL, pvals are cached in it by (reads, E_reads)
+double calc_pA(int reads, double E_reads, PvalMemo *memo) {
   double norm, pval=1.;
+  uint64_t key;
+  unsigned int slot=0;
+  
+  if(memo) {
+    memcpy(&key, &E_reads, sizeof(key));
+    key = (key ^ (key >> 29) ^ ((uint64_t) reads * 0x9E3779B97F4A7C15ULL)) * 0xBF58476D1CE4E5B9ULL;
+    slot = (unsigned int) (key >> 40) % PMEMO_SIZE;
+    if(memo->reads[slot] == reads && memo->E[slot] == E_reads) { return memo->pval[slot]; }
+  }
   
   // Calculate norm (since conditioning on sequence being present).
   norm = (1.0 - exp(-E_reads));
@@ -19,23 +105,44 @@ double calc_pA(int reads, double E_reads) {
   }
   
   // Calculate pval from poisson cdf.
-  Rcpp::IntegerVector n_repeats(1);
-  n_repeats(0) = reads-1;
-  Rcpp::NumericVector res = Rcpp::ppois(n_repeats, E_reads, false);  // lower.tail = false
-  pval = Rcpp::as<double>(res);
+  pval = ppois_upper(reads, E_reads);  // P(X >= reads) == ppois(reads-1, E_reads, lower.tail = false)
   
   pval = pval/norm;
+  if(memo) {
+    memo->reads[slot] = reads;
+    memo->E[slot] = E_reads;
+    memo->pval[slot] = pval;
+  }
   return pval;
 }
 
-// Find abundance pval from a Raw in a Bi
-double get_pA(Raw *raw, Bi *bi) {
+// Mark all entries of the pval memo empty
+void pmemo_init(PvalMemo *memo) {
+  for(int i=0;i<PMEMO_SIZE;i++) { memo->reads[i] = -1; }
+}
+
+// Holds the pval memo of a thread
+struct ThreadPvalMemo {
+  PvalMemo memo;
+  ThreadPvalMemo() { pmemo_init(&memo); }
+};
+
+// The pval memo of the calling thread, for the parallel workers. As the pvals only depend on
+// their (reads, E_reads) key, its entries stay valid for the life of the thread.
+PvalMemo *pmemo_thread() {
+  static thread_local ThreadPvalMemo tmemo;
+  return &tmemo.memo;
+}
+
+// Find abundance pval from a Raw in its Bi
+double get_pA(Raw *raw, Bi *bi, PvalMemo *memo) {
   unsigned int hamming;
   double lambda, E_reads, pval = 1.;
   
-  unsigned int ci = bi->comp_index[raw->index];
-  lambda = bi->comp[ci].lambda;
-  hamming = bi->comp[ci].hamming;
+  int ci = bi_comp_own(bi, raw); // raw is in bi
+  if(ci < 0) { return 1.; } // No comparison stored, can't be assessed
+  lambda = bi->comp_lambda[ci];
+  hamming = bi->comp_hamming[ci];
   
   if(raw->reads == 1) {   // Singleton. No abundance pval.
     pval=1.;
@@ -49,15 +156,95 @@ double get_pA(Raw *raw, Bi *bi) {
   else { // Calculate abundance pval.
     // E_reads is the expected number of reads for this raw
     E_reads = lambda * bi->reads;
-    pval = calc_pA(raw->reads, E_reads);
+    pval = calc_pA(raw->reads, E_reads, memo);
   }
   return pval;
 }
 
+// Calculates the log of the lambda of each raw when no substitutions are present, ie. the
+// sum of the log self-transition rates at each position, and stores it in raw->log_self.
+// Called once per error matrix. Any zero self-transition rate makes this -Inf, in which
+// case compute_lambda/compute_lambda_ts fall back to the full product.
+// Also stores what lambda_bound needs: a substitution at a position multiplies lambda by
+// err/self for that transition, which is at most the largest such ratio at that position.
+void raws_set_log_lambda(Raw **raws, unsigned int nraw, Rcpp::NumericMatrix errMat, bool use_quals) {
+  unsigned int index, pos, nti, nti0, qind, j, ncol = errMat.ncol();
+  double log_self, log_ub, lr;
+  Raw *raw;
+  
+  // Log self-transition rate, and the largest log ratio of a transition into that nt to it,
+  // for each nt (row) at each quality (col)
+  std::vector<double> lself(4*ncol), lratio(4*ncol);
+  for(qind=0;qind<ncol;qind++) {
+    for(nti=0;nti<4;nti++) {
+      lself[nti*ncol + qind] = log(errMat(nti*4 + nti, qind));
+      lratio[nti*ncol + qind] = -INFINITY;
+      for(nti0=0;nti0<4;nti0++) {
+        if(nti0 == nti) { continue; }
+        lr = log(errMat(nti0*4 + nti, qind)) - lself[nti*ncol + qind];
+        if(lr > lratio[nti*ncol + qind]) { lratio[nti*ncol + qind] = lr; }
+      }
+    }
+  }
+  
+  for(index=0;index<nraw;index++) {
+    raw = raws[index];
+    log_self = 0.0;
+    log_ub = 0.0;
+    for(j=0;j<NSUB_BOUND;j++) { raw->log_ratio[j] = -INFINITY; }
+    for(pos=0;pos<raw->length;pos++) {
+      nti = ((int) raw->seq[pos]) - 1;
+      if(nti > 3) { Rcpp::stop("Non-ACGT sequences in compute_lambda."); }
+      if(use_quals) {
+        qind = raw->qind[pos];
+      } else {
+        qind = 0;
+      }
+      if( qind > (ncol-1) ) {
+        Rcpp::stop("Rounded quality exceeded range of err lookup table.");
+      }
+      log_self += lself[nti*ncol + qind];
+      
+      // Positive ratios are all taken in log_ub, the rest are kept in descending order
+      lr = lratio[nti*ncol + qind];
+      if(lr > 0) {
+        log_ub += lr;
+        lr = 0.0;
+      }
+      if(lr > raw->log_ratio[NSUB_BOUND-1]) {
+        for(j=NSUB_BOUND-1; j>0 && raw->log_ratio[j-1] < lr; j--) {
+          raw->log_ratio[j] = raw->log_ratio[j-1];
+        }
+        raw->log_ratio[j] = lr;
+      }
+    }
+    raw->log_self = log_self;
+    raw->log_ub = log_self + log_ub;
+  }
+}
+
+// An upper bound on the lambda of a raw in any alignment with at least nsubs substitutions.
+// Ratios above 1 may or may not be present, so all are included. Of the rest, at best the
+// nsubs largest are, and those past the NSUB_BOUND kept are no larger than the last kept.
+// A little slack covers rounding differences from the summation order in compute_lambda.
+double lambda_bound(Raw *raw, unsigned int nsubs) {
+  unsigned int j;
+  double log_lambda = raw->log_ub;
+  
+  if(!std::isfinite(raw->log_self)) { return 1.0; }
+  for(j=0;j<nsubs && j<NSUB_BOUND;j++) {
+    log_lambda += raw->log_ratio[j];
+  }
+  if(nsubs > NSUB_BOUND) {
+    log_lambda += (nsubs-NSUB_BOUND) * raw->log_ratio[NSUB_BOUND-1];
+  }
+  return exp(log_lambda + 1e-6);
+}
+
 // This calculates lambda from a lookup table index by transition (row) and rounded quality (col)
 double compute_lambda(Raw *raw, Sub *sub, Rcpp::NumericMatrix errMat, bool use_quals, unsigned int ncol) {
   // use_quals does nothing in this function, just here for backwards compatability for now
-  int s, pos0, pos1, nti0, nti1, len1;
+  int s, pos0, pos1, nti0, nti1, len1, q;
   double lambda;
   int tvec[SEQLEN];
   int qind[SEQLEN];
@@ -66,6 +253,26 @@ double compute_lambda(Raw *raw, Sub *sub, Rcpp::NumericMatrix errMat, bool use_q
     return 0.0;
   }
   
+  // Start from the no-subs lambda, and correct by the ratio of the error rate
+  // to the self-transition rate at each substituted position
+  if(std::isfinite(raw->log_self)) {
+    lambda = raw->log_self;
+    for(s=0;s<sub->nsubs;s++) {
+      pos0 = sub->pos[s];
+      if(pos0 < 0 || pos0 >= sub->len0) { Rcpp::stop("CL: Bad pos0: %i (len0=%i).", pos0, sub->len0); }
+      pos1 = sub->map[sub->pos[s]];
+      if(pos1 < 0 || pos1 >= raw->length) { Rcpp::stop("CL: Bad pos1: %i (len1=%i).", pos1, raw->length); }
+      
+      nti0 = ((int) sub->nt0[s]) - 1;
+      nti1 = ((int) raw->seq[pos1]) - 1;
+      q = use_quals ? raw->qind[pos1] : 0;
+      lambda += log(errMat(nti0*4 + nti1, q)) - log(errMat(nti1*4 + nti1, q));
+    }
+    lambda = exp(lambda);
+    if(lambda < 0 || lambda > 1) { Rcpp::stop("Bad lambda."); }
+    return lambda;
+  }
+  
   // Make vector that indexes as integers the transitions at each position in seq1
   // Index is 0: A->A, 1: A->C, ..., 4: C->A, ...
   len1 = raw->length;
@@ -77,8 +284,7 @@ double compute_lambda(Raw *raw, Sub *sub, Rcpp::NumericMatrix errMat, bool use_q
       Rcpp::stop("Non-ACGT sequences in compute_lambda.");
     }
     if(use_quals) {
-      // Turn quality into the index in the array
-      qind[pos1] = round(raw->qual[pos1]);
+      qind[pos1] = raw->qind[pos1];
     } else {
       qind[pos1] = 0;
     }
@@ -113,7 +319,7 @@ double compute_lambda(Raw *raw, Sub *sub, Rcpp::NumericMatrix errMat, bool use_q
 
 // This calculates lambda from a lookup table index by transition (row) and rounded quality (col)
 double compute_lambda_ts(Raw *raw, Sub *sub, unsigned int ncol, double *err_mat, bool use_quals) {
-  int s, pos0, pos1, nti0, nti1, len1;
+  int s, pos0, pos1, nti0, nti1, len1, q;
   double lambda;
   int tvec[SEQLEN];
   int qind[SEQLEN];
@@ -122,6 +328,26 @@ double compute_lambda_ts(Raw *raw, Sub *sub, unsigned int ncol, double *err_mat,
     return 0.0;
   }
   
+  // Start from the no-subs lambda, and correct by the ratio of the error rate
+  // to the self-transition rate at each substituted position
+  if(std::isfinite(raw->log_self)) {
+    lambda = raw->log_self;
+    for(s=0;s<sub->nsubs;s++) {
+      pos0 = sub->pos[s];
+      if(pos0 < 0 || pos0 >= sub->len0) { Rcpp::stop("CL: Bad pos0: %i (len0=%i).", pos0, sub->len0); }
+      pos1 = sub->map[sub->pos[s]];
+      if(pos1 < 0 || pos1 >= raw->length) { Rcpp::stop("CL: Bad pos1: %i (len1=%i).", pos1, raw->length); }
+      
+      nti0 = ((int) sub->nt0[s]) - 1;
+      nti1 = ((int) raw->seq[pos1]) - 1;
+      q = use_quals ? raw->qind[pos1] : 0;
+      lambda += log(err_mat[(nti0*4 + nti1)*ncol + q]) - log(err_mat[(nti1*4 + nti1)*ncol + q]);
+    }
+    lambda = exp(lambda);
+    if(lambda < 0 || lambda > 1) { Rcpp::stop("Bad lambda."); }
+    return lambda;
+  }
+  
   // Make vector that indexes as integers the transitions at each position in seq1
   // Index is 0: A->A, 1: A->C, ..., 4: C->A, ...
   len1 = raw->length;
@@ -133,8 +359,7 @@ double compute_lambda_ts(Raw *raw, Sub *sub, unsigned int ncol, double *err_mat,
       Rcpp::stop("Non-ACGT sequences in compute_lambda.");
     }
     if(use_quals) {
-      // Turn quality into the index in the array
-      qind[pos1] = round(raw->qual[pos1]);
+      qind[pos1] = raw->qind[pos1];
     } else {
       qind[pos1] = 0;
     }